@@ -0,0 +1,4 @@
+include $(config_dir)dev.mk
+
+# C++20 is needed to compile in the coroutine awaitables of nitki::loop_thread
+this_cxxflags += -std=c++20
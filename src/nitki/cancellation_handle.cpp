@@ -0,0 +1,112 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#include "cancellation_handle.hpp"
+
+using namespace nitki;
+
+std::pair<procedure, cancellation_handle> cancellation_handle::make(
+	procedure&& proc,
+	std::shared_ptr<counters> stats
+)
+{
+	static_assert(procedure::is_inline<runner>, "cancellable procedure wrapper must not allocate");
+
+	auto s = std::make_shared<state>(std::move(proc), std::move(stats));
+
+	procedure p = runner(s);
+
+	return {std::move(p), cancellation_handle(std::move(s))};
+}
+
+cancellation_handle::runner::~runner()
+{
+	if (!this->s) {
+		// moved from
+		return;
+	}
+
+	auto v = status::pending;
+	if (this->s->value.compare_exchange_strong(v, status::done, std::memory_order_acq_rel)) {
+		// dropped without running, e.g. the queue is destroyed
+		this->s->proc = nullptr;
+		return;
+	}
+
+	if (v == status::cancelled && this->s->stats) {
+		this->s->stats->num_queued.fetch_sub(1, std::memory_order_relaxed);
+	}
+}
+
+bool cancellation_handle::runner::claim() noexcept
+{
+	auto v = status::pending;
+	if (this->s->value.compare_exchange_strong(v, status::done, std::memory_order_acq_rel)) {
+		return true;
+	}
+
+	// claimed but not run yet, the procedure is only accessed by the consumer after claiming
+	return v == status::done && this->s->proc;
+}
+
+void cancellation_handle::runner::operator()()
+{
+	if (!this->claim()) {
+		// cancelled
+		return;
+	}
+
+	auto proc = std::move(this->s->proc);
+
+	// the captured state is destroyed after running, even if the handle is still alive
+	proc();
+}
+
+bool cancellation_handle::cancel() noexcept
+{
+	if (!this->s) {
+		return false;
+	}
+
+	auto v = status::pending;
+	if (!this->s->value.compare_exchange_strong(v, status::cancelled, std::memory_order_acq_rel)) {
+		return false;
+	}
+
+	if (this->s->stats) {
+		this->s->stats->num_queued.fetch_add(1, std::memory_order_relaxed);
+		this->s->stats->num_cancelled.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	this->s->proc = nullptr;
+
+	return true;
+}
+
+bool cancellation_handle::is_cancelled() const noexcept
+{
+	return this->s && this->s->value.load(std::memory_order_acquire) == status::cancelled;
+}
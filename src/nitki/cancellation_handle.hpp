@@ -0,0 +1,152 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "procedure.hpp"
+
+namespace nitki {
+
+class queue;
+
+/**
+ * @brief Handle of a cancellable procedure pushed to nitki::queue.
+ * Returned by nitki::queue::push_cancellable() and nitki::loop_thread::push_cancellable().
+ * Allows cancelling the procedure while it still waits in the queue.
+ * Cancelled procedure is skipped by the consumer, and its callable object,
+ * together with the captured state, is destroyed right away by the cancel() call.
+ * The handle can be copied, the copies refer to the same procedure.
+ */
+class cancellation_handle
+{
+	friend class queue;
+
+	// Shared by the queue and the cancellation states of its procedures,
+	// so that the handle can be cancelled after the queue is destroyed.
+	struct counters {
+		// number of cancelled procedures which were not yet taken out of the queue and destroyed,
+		// can become negative for a short while
+		std::atomic<ptrdiff_t> num_queued = 0;
+
+		std::atomic<uint64_t> num_cancelled = 0;
+	};
+
+	enum class status {
+		pending,
+		cancelled,
+		done
+	};
+
+	struct state {
+		std::atomic<status> value = status::pending;
+
+		// owned by the one who has moved the value from status::pending
+		procedure proc;
+
+		std::shared_ptr<counters> stats;
+
+		state(procedure&& proc, std::shared_ptr<counters> stats) :
+			proc(std::move(proc)),
+			stats(std::move(stats))
+		{}
+	};
+
+	std::shared_ptr<state> s;
+
+	cancellation_handle(std::shared_ptr<state> s) :
+		s(std::move(s))
+	{}
+
+	// pushed to the queue in place of the cancellable procedure
+	class runner
+	{
+		std::shared_ptr<state> s;
+
+	public:
+		runner(std::shared_ptr<state> s) :
+			s(std::move(s))
+		{}
+
+		runner(const runner&) = delete;
+		runner& operator=(const runner&) = delete;
+
+		runner(runner&&) noexcept = default;
+		runner& operator=(runner&&) = delete;
+
+		~runner();
+
+		// Moves the procedure out of pending state, so that it cannot be cancelled anymore.
+		// Returns false if the procedure was cancelled or has already been run.
+		bool claim() noexcept;
+
+		void operator()();
+	};
+
+	static std::pair<procedure, cancellation_handle> make(procedure&& proc, std::shared_ptr<counters> stats);
+
+public:
+	/**
+	 * @brief Construct empty handle.
+	 * Empty handle does not refer to any procedure.
+	 */
+	cancellation_handle() = default;
+
+	/**
+	 * @brief Cancel the procedure.
+	 * Thread-safe. If the procedure has not started running yet, it will not be run,
+	 * and its callable object is destroyed before returning from this method.
+	 * Does nothing if the procedure is running, has already been run, has been dropped
+	 * without running, or has already been cancelled.
+	 * Does nothing if the handle is empty.
+	 * @return true if the procedure was cancelled by this call.
+	 * @return false otherwise.
+	 */
+	bool cancel() noexcept;
+
+	/**
+	 * @brief Check if the procedure was cancelled.
+	 * @return true if the procedure was cancelled.
+	 * @return false if the procedure was not cancelled or the handle is empty.
+	 */
+	bool is_cancelled() const noexcept;
+
+	/**
+	 * @brief Check if the handle refers to a procedure.
+	 * @return true if the handle is not empty.
+	 */
+	explicit operator bool() const noexcept
+	{
+		return bool(this->s);
+	}
+};
+
+} // namespace nitki
@@ -0,0 +1,86 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#include "channel.hpp"
+
+using namespace nitki;
+
+// The read end is ready to read when its event is set.
+// The write end has to be ready to write, so its event is set when the channel has free space,
+// see waitable_event for how this is done on different OSes.
+// Switching the readiness involves system calls, so it is not done under the channel's spin lock.
+// Instead, after releasing the spin lock, the readiness of both ends is brought in line with
+// the number of elements re-read under the spin lock, this is serialized by the readiness mutex,
+// so that the last one to switch the readiness always sees the latest number of elements.
+
+channel_end::channel_end(opros::ready direction) :
+	waitable_event(direction),
+	is_ready(direction == opros::ready::write)
+{}
+
+void channel_end::set_ready(bool ready) noexcept
+{
+	if (this->is_ready == ready) {
+		return;
+	}
+	this->is_ready = ready;
+
+	if (ready) {
+		this->set();
+	} else {
+		this->reset();
+	}
+}
+
+channel_base::channel_base(size_t capacity) :
+	buffer_capacity([&]() {
+		if (capacity == 0) {
+			throw std::invalid_argument("channel::channel(): capacity must be greater than 0");
+		}
+		return capacity;
+	}()),
+	read_end(opros::ready::read),
+	write_end(opros::ready::write)
+{}
+
+size_t channel_base::size() noexcept
+{
+	std::lock_guard<decltype(this->mutex)> lock(this->mutex);
+	return this->num_elements;
+}
+
+void channel_base::sync_readiness()
+{
+	std::lock_guard<decltype(this->readiness_mutex)> readiness_lock(this->readiness_mutex);
+
+	size_t num = [this]() {
+		std::lock_guard<decltype(this->mutex)> lock(this->mutex);
+		return this->num_elements;
+	}();
+
+	this->read_end.set_ready(num != 0);
+	this->write_end.set_ready(num != this->buffer_capacity);
+}
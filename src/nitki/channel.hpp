@@ -0,0 +1,388 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include <opros/waitable.hpp>
+#include <utki/config.hpp>
+#include <utki/span.hpp>
+#include <utki/spin_lock.hpp>
+
+#include "waitable_event.hpp"
+
+namespace nitki {
+
+/**
+ * @brief One end of a channel, waitable with opros::wait_set.
+ * The read end of a channel is ready to read when the channel has elements,
+ * the write end is ready to write when the channel has free space.
+ */
+class channel_end : public waitable_event
+{
+	friend class channel_base;
+	friend class mailbox_base;
+
+	// guarded by the owner's readiness mutex
+	bool is_ready;
+
+	channel_end(opros::ready direction);
+
+	// must be called with the owner's readiness mutex locked
+	void set_ready(bool ready) noexcept;
+};
+
+/**
+ * @brief Type independent part of nitki::channel.
+ * Keeps track of the ring buffer indices and the readiness of the channel ends.
+ */
+class channel_base
+{
+	const size_t buffer_capacity;
+
+	channel_end read_end;
+	channel_end write_end;
+
+	// Serializes switching readiness of the channel ends. The switching involves system calls,
+	// so it is done after releasing the spin lock, see sync_readiness().
+	std::mutex readiness_mutex;
+
+protected:
+	utki::spin_lock mutex;
+
+	// index of the first element in the ring buffer
+	size_t head = 0;
+
+	// number of elements in the ring buffer
+	size_t num_elements = 0;
+
+	channel_base(size_t capacity);
+
+	~channel_base() = default;
+
+	size_t wrap(size_t index) const noexcept
+	{
+		return index < this->buffer_capacity ? index : index - this->buffer_capacity;
+	}
+
+	/**
+	 * @brief Check if readiness of the channel ends is changed by changing the number of elements.
+	 * Must be called with the mutex locked.
+	 * @param old_num_elements - number of elements before the change.
+	 * @return true if sync_readiness() has to be called after unlocking the mutex.
+	 */
+	bool is_readiness_changed(size_t old_num_elements) const noexcept
+	{
+		return (old_num_elements == 0) != (this->num_elements == 0) ||
+			(old_num_elements == this->buffer_capacity) != (this->num_elements == this->buffer_capacity);
+	}
+
+	/**
+	 * @brief Bring readiness of the channel ends in line with the current number of elements.
+	 * Must be called with the mutex unlocked.
+	 */
+	void sync_readiness();
+
+public:
+	channel_base(const channel_base&) = delete;
+	channel_base& operator=(const channel_base&) = delete;
+	channel_base(channel_base&&) = delete;
+	channel_base& operator=(channel_base&&) = delete;
+
+	/**
+	 * @brief Get maximum number of elements the channel can hold.
+	 * @return capacity of the channel.
+	 */
+	size_t capacity() const noexcept
+	{
+		return this->buffer_capacity;
+	}
+
+	/**
+	 * @brief Get current number of elements in the channel.
+	 * The value can be outdated by the time it is returned, if other threads use the channel.
+	 * @return number of elements in the channel.
+	 */
+	size_t size() noexcept;
+
+	/**
+	 * @brief Get the read end of the channel.
+	 * The returned waitable can be added to an opros::wait_set to wait for opros::ready::read,
+	 * it is ready when the channel is not empty.
+	 * @return waitable read end of the channel.
+	 */
+	opros::waitable& get_read_waitable() noexcept
+	{
+		return this->read_end;
+	}
+
+	/**
+	 * @brief Get the write end of the channel.
+	 * The returned waitable can be added to an opros::wait_set to wait for opros::ready::write,
+	 * it is ready when the channel is not full.
+	 * @return waitable write end of the channel.
+	 */
+	opros::waitable& get_write_waitable() noexcept
+	{
+		return this->write_end;
+	}
+};
+
+/**
+ * @brief Bounded typed multi-producer/multi-consumer channel.
+ * The elements are stored in a contiguous ring buffer allocated once on construction,
+ * so sending and receiving elements does not allocate memory.
+ * Sending and receiving never block, the read and write ends of the channel can be waited on
+ * with an opros::wait_set instead, e.g. by a loop_thread.
+ * Batch send() and receive() transfer a span of elements under a single lock.
+ * @tparam value_type - type of the elements, must be nothrow move constructible and move assignable.
+ */
+template <typename value_type>
+class channel : public channel_base
+{
+	static_assert(
+		std::is_nothrow_move_constructible_v<value_type> && std::is_nothrow_move_assignable_v<value_type>,
+		"channel elements must be nothrow movable"
+	);
+
+	struct storage_type {
+		alignas(value_type) std::byte data[sizeof(value_type)]; // NOLINT(modernize-avoid-c-arrays)
+	};
+
+	std::unique_ptr<storage_type[]> buffer;
+
+	void* slot(size_t index) noexcept
+	{
+		return this->buffer[this->wrap(index)].data;
+	}
+
+	value_type& element(size_t index) noexcept
+	{
+		return *std::launder(static_cast<value_type*>(this->slot(index)));
+	}
+
+	template <typename element_type>
+	size_t send_internal(utki::span<element_type> elements)
+	{
+		size_t num = 0;
+		bool readiness_changed = false;
+		{
+			std::lock_guard<decltype(this->mutex)> lock(this->mutex);
+
+			num = std::min(elements.size(), this->capacity() - this->num_elements);
+			if (num == 0) {
+				return 0;
+			}
+
+			size_t tail = this->head + this->num_elements;
+			size_t i = 0;
+			try {
+				for (; i != num; ++i) {
+					if constexpr (std::is_const_v<element_type>) {
+						new (this->slot(tail + i)) value_type(elements[i]);
+					} else {
+						new (this->slot(tail + i)) value_type(std::move(elements[i]));
+					}
+				}
+			} catch (...) {
+				// copy constructor has thrown, the elements are not published yet,
+				// so destroy the already constructed ones and leave the channel as it was
+				for (size_t j = 0; j != i; ++j) {
+					this->element(tail + j).~value_type();
+				}
+				throw;
+			}
+
+			size_t old_num_elements = this->num_elements;
+			this->num_elements += num;
+			readiness_changed = this->is_readiness_changed(old_num_elements);
+		}
+
+		if (readiness_changed) {
+			this->sync_readiness();
+		}
+
+		return num;
+	}
+
+public:
+	/**
+	 * @brief Create channel.
+	 * @param capacity - maximum number of elements in the channel.
+	 * @throw std::invalid_argument - if capacity is 0.
+	 */
+	channel(size_t capacity) :
+		channel_base(capacity),
+		buffer(new storage_type[capacity])
+	{}
+
+	channel(const channel&) = delete;
+	channel& operator=(const channel&) = delete;
+	channel(channel&&) = delete;
+	channel& operator=(channel&&) = delete;
+
+	~channel() noexcept
+	{
+		for (size_t i = 0; i != this->num_elements; ++i) {
+			this->element(this->head + i).~value_type();
+		}
+	}
+
+	/**
+	 * @brief Send element to the channel if it is not full.
+	 * Can be called from any thread.
+	 * @param value - element to send. The element is moved from only if it was sent.
+	 * @return true if the element was sent.
+	 * @return false if the channel is full.
+	 */
+	bool try_send(value_type&& value)
+	{
+		return this->send_internal(utki::span<value_type>(&value, 1)) == 1;
+	}
+
+	/**
+	 * @brief Send element to the channel if it is not full.
+	 * Can be called from any thread.
+	 * @param value - element to send.
+	 * @return true if the element was sent.
+	 * @return false if the channel is full.
+	 * @throw any exception thrown by the copy constructor of the element, the element is not sent in that case.
+	 */
+	bool try_send(const value_type& value)
+	{
+		return this->send_internal(utki::span<const value_type>(&value, 1)) == 1;
+	}
+
+	/**
+	 * @brief Send a batch of elements to the channel.
+	 * Sends as many elements from the beginning of the span as the channel has free space for.
+	 * The sent elements are moved from.
+	 * Can be called from any thread.
+	 * @param elements - elements to send.
+	 * @return number of elements sent.
+	 */
+	size_t send(utki::span<value_type> elements)
+	{
+		return this->send_internal(elements);
+	}
+
+	/**
+	 * @brief Send a batch of elements to the channel.
+	 * Sends copies of as many elements from the beginning of the span as the channel has free space for.
+	 * Can be called from any thread.
+	 * @param elements - elements to send.
+	 * @return number of elements sent.
+	 * @throw any exception thrown by the copy constructor of an element, no elements are sent in that case.
+	 */
+	size_t send(utki::span<const value_type> elements)
+	{
+		return this->send_internal(elements);
+	}
+
+	/**
+	 * @brief Receive a batch of elements from the channel.
+	 * Moves as many elements as available, but not more than the size of the span,
+	 * to the beginning of the span.
+	 * Can be called from any thread.
+	 * @param elements - span to move the received elements to.
+	 * @return number of elements received.
+	 */
+	size_t receive(utki::span<value_type> elements)
+	{
+		size_t num = 0;
+		bool readiness_changed = false;
+		{
+			std::lock_guard<decltype(this->mutex)> lock(this->mutex);
+
+			num = std::min(elements.size(), this->num_elements);
+			if (num == 0) {
+				return 0;
+			}
+
+			for (size_t i = 0; i != num; ++i) {
+				auto& e = this->element(this->head + i);
+				elements[i] = std::move(e);
+				e.~value_type();
+			}
+
+			size_t old_num_elements = this->num_elements;
+			this->head = this->wrap(this->head + num);
+			this->num_elements -= num;
+			readiness_changed = this->is_readiness_changed(old_num_elements);
+		}
+
+		if (readiness_changed) {
+			this->sync_readiness();
+		}
+
+		return num;
+	}
+
+	/**
+	 * @brief Receive element from the channel if it is not empty.
+	 * Can be called from any thread.
+	 * @return the received element.
+	 * @return std::nullopt if the channel is empty.
+	 */
+	std::optional<value_type> try_receive()
+	{
+		std::optional<value_type> ret;
+		bool readiness_changed = false;
+		{
+			std::lock_guard<decltype(this->mutex)> lock(this->mutex);
+
+			if (this->num_elements == 0) {
+				return std::nullopt;
+			}
+
+			auto& e = this->element(this->head);
+			ret.emplace(std::move(e));
+			e.~value_type();
+
+			size_t old_num_elements = this->num_elements;
+			this->head = this->wrap(this->head + 1);
+			--this->num_elements;
+			readiness_changed = this->is_readiness_changed(old_num_elements);
+		}
+
+		if (readiness_changed) {
+			this->sync_readiness();
+		}
+
+		return ret;
+	}
+};
+
+} // namespace nitki
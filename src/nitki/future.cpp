@@ -0,0 +1,99 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#include "future.hpp"
+
+#include "waitable_event.hpp"
+
+using namespace nitki;
+
+namespace nitki {
+// event which stays set once the future is ready
+class future_event : public waitable_event
+{
+public:
+	future_event() :
+		waitable_event(opros::ready::read)
+	{}
+
+	using waitable_event::set;
+};
+} // namespace nitki
+
+future_state_base::future_state_base() = default;
+
+future_state_base::~future_state_base() = default;
+
+void future_state_base::set_ready() noexcept
+{
+	// sequentially consistent, pairs with event_ptr publishing in get_waitable()
+	this->ready.store(true);
+
+	this->sema.signal();
+
+	if (auto e = this->event_ptr.load()) {
+		e->set();
+	}
+}
+
+void future_state_base::wait()
+{
+	if (this->is_ready()) {
+		return;
+	}
+	this->sema.wait();
+
+	// pass the signal on to the next waiter
+	this->sema.signal();
+}
+
+bool future_state_base::wait(uint32_t timeout_ms)
+{
+	if (this->is_ready()) {
+		return true;
+	}
+	if (!this->sema.wait(timeout_ms)) {
+		return false;
+	}
+
+	// pass the signal on to the next waiter
+	this->sema.signal();
+	return true;
+}
+
+opros::waitable& future_state_base::get_waitable()
+{
+	if (!this->event) {
+		this->event = std::make_unique<future_event>();
+		this->event_ptr.store(this->event.get());
+
+		// in case the state became ready before the event was published
+		if (this->ready.load()) {
+			this->event->set();
+		}
+	}
+	return *this->event;
+}
@@ -0,0 +1,291 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include <opros/waitable.hpp>
+
+#include "procedure.hpp"
+#include "semaphore.hpp"
+
+namespace nitki {
+
+class future_event;
+
+/**
+ * @brief Base class of the shared state of a nitki::future.
+ * Holds the completion flag and the means of waiting for the completion.
+ * The result itself is stored in the derived class template.
+ */
+class future_state_base
+{
+	std::atomic_bool ready = false;
+
+	// signalled once on completion, every waiter passes the signal on to the next waiter
+	nitki::semaphore sema;
+
+	// created lazily, only if the waitable form of the future is requested
+	std::unique_ptr<future_event> event;
+	std::atomic<future_event*> event_ptr = nullptr;
+
+public:
+	std::exception_ptr exception;
+
+	future_state_base();
+
+	future_state_base(const future_state_base&) = delete;
+	future_state_base& operator=(const future_state_base&) = delete;
+
+	future_state_base(future_state_base&&) = delete;
+	future_state_base& operator=(future_state_base&&) = delete;
+
+	~future_state_base();
+
+	bool is_ready() const noexcept
+	{
+		return this->ready.load(std::memory_order_acquire);
+	}
+
+	/**
+	 * @brief Mark the state as completed and wake up the waiters.
+	 * Must be called only once, after the result or exception is stored.
+	 */
+	void set_ready() noexcept;
+
+	void wait();
+
+	bool wait(uint32_t timeout_ms);
+
+	opros::waitable& get_waitable();
+};
+
+/**
+ * @brief Future result of a procedure.
+ * The future is returned by queue::push_with_result() and loop_thread::call().
+ * Unlike std::future, the shared state is allocated together with the procedure's function object
+ * in a single memory allocation and the completion does not lock any mutex.
+ * @tparam value_type - type of the result.
+ */
+template <typename value_type>
+class future
+{
+	friend class queue;
+	friend class loop_thread;
+
+	class state : public future_state_base
+	{
+	public:
+		std::optional<std::conditional_t<std::is_void_v<value_type>, bool, value_type>> value;
+	};
+
+	template <typename function_type>
+	class call_state : public state
+	{
+		function_type func;
+
+	public:
+		call_state(function_type&& func) :
+			func(std::move(func))
+		{}
+
+		call_state(const function_type& func) :
+			func(func)
+		{}
+
+		void run() noexcept
+		{
+			try {
+				if constexpr (std::is_void_v<value_type>) {
+					this->func();
+					this->value.emplace(true);
+				} else {
+					this->value.emplace(this->func());
+				}
+			} catch (...) {
+				this->exception = std::current_exception();
+			}
+			this->set_ready();
+		}
+
+		void abandon() noexcept
+		{
+			if (this->is_ready()) {
+				return;
+			}
+			this->exception = std::make_exception_ptr(
+				std::logic_error("nitki::future: the procedure was destroyed without being run")
+			);
+			this->set_ready();
+		}
+	};
+
+	// the procedure which runs the function and completes the future,
+	// completes the future with exception if destroyed without being run
+	template <typename function_type>
+	class runner
+	{
+		std::shared_ptr<call_state<function_type>> s;
+
+	public:
+		runner(std::shared_ptr<call_state<function_type>> s) :
+			s(std::move(s))
+		{}
+
+		runner(const runner&) = delete;
+		runner& operator=(const runner&) = delete;
+
+		runner(runner&&) noexcept = default;
+		runner& operator=(runner&&) noexcept = default;
+
+		~runner()
+		{
+			if (this->s) {
+				this->s->abandon();
+			}
+		}
+
+		void operator()()
+		{
+			this->s->run();
+		}
+	};
+
+	std::shared_ptr<state> s;
+
+	future(std::shared_ptr<state> s) :
+		s(std::move(s))
+	{}
+
+	template <typename function_type>
+	static std::pair<procedure, future> package(function_type&& func)
+	{
+		auto cs = std::make_shared<call_state<std::decay_t<function_type>>>(std::forward<function_type>(func));
+		future f(cs);
+		return {procedure(runner<std::decay_t<function_type>>(std::move(cs))), std::move(f)};
+	}
+
+public:
+	/**
+	 * @brief Create an invalid future.
+	 */
+	future() = default;
+
+	/**
+	 * @brief Check if the future refers to a shared state.
+	 * @return true if the future refers to a shared state.
+	 * @return false if the future is default constructed or moved out.
+	 */
+	bool valid() const noexcept
+	{
+		return bool(this->s);
+	}
+
+	/**
+	 * @brief Check if the result is ready.
+	 * @return true if the procedure has completed.
+	 * @return false otherwise.
+	 */
+	bool is_ready() const noexcept
+	{
+		ASSERT(this->valid())
+		return this->s->is_ready();
+	}
+
+	/**
+	 * @brief Wait for the result to become ready.
+	 */
+	void wait() const
+	{
+		ASSERT(this->valid())
+		this->s->wait();
+	}
+
+	/**
+	 * @brief Wait for the result to become ready with timeout.
+	 * @param timeout_ms - waiting timeout in milliseconds.
+	 * @return true if the result is ready.
+	 * @return false if the timeout was hit.
+	 */
+	bool wait(uint32_t timeout_ms) const
+	{
+		ASSERT(this->valid())
+		return this->s->wait(timeout_ms);
+	}
+
+	/**
+	 * @brief Get the result.
+	 * Waits for the result to become ready and moves it out of the future.
+	 * Can be called only once.
+	 * @return the result of the procedure.
+	 * @throw the exception thrown by the procedure, if any.
+	 */
+	value_type get()
+	{
+		ASSERT(this->valid())
+		this->s->wait();
+
+		auto st = std::move(this->s);
+
+		if (st->exception) {
+			std::rethrow_exception(st->exception);
+		}
+
+		if constexpr (!std::is_void_v<value_type>) {
+			return std::move(st->value.value());
+		}
+	}
+
+	/**
+	 * @brief Get waitable form of the future.
+	 * The returned waitable becomes ready to read when the result is ready.
+	 * It can be added to an opros::wait_set with opros::ready::read flag.
+	 * The waitable is created on first call of this method and it is owned by the shared state,
+	 * so it remains valid while the future is valid.
+	 * @return waitable which is ready to read when the result is ready.
+	 */
+	opros::waitable& get_waitable()
+	{
+		ASSERT(this->valid())
+		return this->s->get_waitable();
+	}
+};
+
+/**
+ * @brief Type of the future result of a function.
+ * @tparam function_type - type of the function.
+ */
+template <typename function_type>
+using future_value_t = std::decay_t<std::invoke_result_t<std::decay_t<function_type>&>>;
+
+} // namespace nitki
@@ -26,11 +26,63 @@ SOFTWARE.
 
 #include "loop_thread.hpp"
 
+#include <algorithm>
+#include <limits>
+#include <mutex>
 #include <sstream>
 
+#include <utki/spin_lock.hpp>
+
+#include "util.hpp"
+
 using namespace nitki;
 
-loop_thread::loop_thread(unsigned wait_set_capacity) :
+struct loop_thread::timer {
+	clock::time_point deadline;
+
+	// zero for one-shot timers
+	clock::duration period;
+
+	// guards the procedure, which can be released by cancel() from any thread
+	utki::spin_lock mut;
+	procedure proc;
+
+	std::atomic_bool canceled = false;
+
+	timer(clock::time_point deadline, clock::duration period, procedure proc) :
+		deadline(deadline),
+		period(period),
+		proc(std::move(proc))
+	{}
+};
+
+namespace {
+// comparator for making min-heap of timers by deadline
+const auto later_deadline = [](const auto& a, const auto& b) {
+	return a->deadline > b->deadline;
+};
+} // namespace
+
+void loop_thread::timer_handle::cancel() noexcept
+{
+	if (!this->t) {
+		return;
+	}
+
+	this->t->canceled.store(true, std::memory_order_relaxed);
+
+	// release the captured state right away, the procedure is destroyed outside of the lock
+	procedure proc;
+	{
+		std::lock_guard<decltype(this->t->mut)> lock_guard(this->t->mut);
+		proc = std::move(this->t->proc);
+	}
+}
+
+loop_thread::loop_thread(unsigned wait_set_capacity, const nitki::queue::parameters& queue_params) :
+	queue(queue_params),
+	selector(queue_params.starvation_limit),
+	queue_in_wait_set(!queue_params.lazy_waitable),
 	wait_set([&]() {
 		auto max = std::numeric_limits<std::remove_reference_t<decltype(wait_set_capacity)>>::max();
 		if (wait_set_capacity == max) {
@@ -43,12 +95,16 @@ loop_thread::loop_thread(unsigned wait_set_capacity) :
 		return wait_set_capacity + 1; // +1 for the this->queue
 	}())
 {
-	this->wait_set.add(this->queue, opros::ready::read, nullptr);
+	if (this->queue_in_wait_set) {
+		this->wait_set.add(this->queue, opros::ready::read, nullptr);
+	}
 }
 
 loop_thread::~loop_thread()
 {
-	this->wait_set.remove(this->queue);
+	if (this->queue_in_wait_set) {
+		this->wait_set.remove(this->queue);
+	}
 }
 
 void loop_thread::quit() noexcept
@@ -59,19 +115,482 @@ void loop_thread::quit() noexcept
 
 void loop_thread::run()
 {
+	this->loop_thread_id.store(std::this_thread::get_id());
+
+	// while the thread is not blocked, producers do not signal the queue's waitable
+	this->queue.announce_awake();
+
+	auto iteration_start = clock::now();
+
 	while (!this->quit_flag.load()) {
 		std::optional<uint32_t> timeout = this->on_loop();
 
-		if (timeout.has_value()) {
-			this->wait_set.wait(timeout.value());
-		} else {
-			this->wait_set.wait();
+		auto on_loop_end = clock::now();
+
+		if (auto until = this->time_until_next_timer(); until.has_value()) {
+			using std::chrono::milliseconds;
+
+			// Round up, so that the thread does not wake up before the timer's deadline,
+			// otherwise the sub-millisecond remainder would be waited out by iterations with zero timeout.
+			auto ms = std::chrono::ceil<milliseconds>(std::max(until.value(), clock::duration::zero())).count();
+			auto timer_timeout = uint32_t(std::min<decltype(ms)>(ms, std::numeric_limits<uint32_t>::max() - 1));
+
+			if (!timeout.has_value() || timer_timeout < timeout.value()) {
+				timeout = timer_timeout;
+			}
 		}
 
-		while (auto proc = this->queue.pop_front()) {
-			proc.operator()();
+		this->wait(timeout);
+
+		auto wait_end = clock::now();
+
+		this->num_iteration_procedures = 0;
+
+		if (!this->awaited_waitables.empty()) {
+			this->resume_awaiting_coroutines();
 		}
+
+		// Run only the procedures which are in the queue at this moment,
+		// procedures pushed while running the batch will be run on next iteration,
+		// except for higher priority procedures.
+		this->queue.pop_all(this->batches);
+		this->run_batches();
+
+		this->fire_timers();
+
+		auto iteration_end = clock::now();
+
+		this->profiling.add_iteration(
+			on_loop_end - iteration_start,
+			wait_end - on_loop_end,
+			iteration_end - wait_end,
+			this->num_iteration_procedures
+		);
+
+		iteration_start = iteration_end;
 	}
 
+	// The queue is not consumed anymore, release its ready to read state.
+	// If there are procedures left, the thread remains awake from the queue's point of view,
+	// which is fine, since the procedures do not need to be signalled.
+	this->queue.announce_blocking();
+
 	this->on_quit();
+
+	// the OS thread can be reused for running other threads, see thread_cache,
+	// so calls made from it are not within the loop thread anymore
+	this->loop_thread_id.store(std::thread::id());
+}
+
+void loop_thread::wait(std::optional<uint32_t> timeout)
+{
+	if (!this->queue_in_wait_set && this->wait_set.size() != 0) {
+		// something was added to the wait_set, from now on the queue is waited on with the wait_set as well
+		this->queue.prepare_waitable();
+		this->wait_set.add(this->queue, opros::ready::read, nullptr);
+		this->queue_in_wait_set = true;
+	}
+
+	if (timeout.has_value() && timeout.value() == 0) {
+		if (this->queue_in_wait_set) {
+			this->wait_set.wait(0);
+		}
+		return;
+	}
+
+	auto budget = std::chrono::nanoseconds(this->spin_budget_ns.load(std::memory_order_relaxed));
+	if (budget.count() != 0 && this->busy_poll(budget, timeout)) {
+		return;
+	}
+
+	if (!this->queue.announce_blocking()) {
+		// there are procedures pushed while the thread was awake, do not block,
+		// but still poll the wait_set to not starve other waitables
+		this->poll_wait_set();
+		return;
+	}
+
+	this->profiling.add_park();
+
+	if (!this->queue_in_wait_set) {
+		// the wait_set is empty, wait on the queue's doorbell without system calls for epoll or alike
+		this->queue.wait_ready(timeout);
+	} else if (timeout.has_value()) {
+		this->wait_set.wait(timeout.value());
+	} else {
+		this->wait_set.wait();
+	}
+
+	this->queue.announce_awake();
+}
+
+bool loop_thread::busy_poll(clock::duration budget, std::optional<uint32_t>& timeout)
+{
+	// polling the wait_set is a system call, so it is done once per this number of spins
+	constexpr unsigned wait_set_poll_interval = 16;
+
+	auto start = clock::now();
+
+	auto deadline = start + budget;
+	bool timeout_expires = false;
+	std::optional<clock::time_point> timeout_deadline;
+	if (timeout.has_value()) {
+		timeout_deadline = start + std::chrono::milliseconds(timeout.value());
+		if (timeout_deadline.value() <= deadline) {
+			deadline = timeout_deadline.value();
+			timeout_expires = true;
+		}
+	}
+
+	// no need to poll the wait_set if there is nothing besides the queue
+	bool poll_others = this->num_other_waitables() != 0;
+
+	bool hit = false;
+
+	for (unsigned i = 0;; ++i) {
+		if (this->queue.has_procedures_hint() || this->quit_flag.load(std::memory_order_relaxed)) {
+			hit = true;
+			break;
+		}
+		if (poll_others && i % wait_set_poll_interval == 0 && this->wait_set.wait(0)) {
+			hit = true;
+			break;
+		}
+		if (clock::now() >= deadline) {
+			break;
+		}
+		cpu_relax();
+	}
+
+	if (hit) {
+		this->profiling.add_spin_hit();
+	}
+
+	if (hit || timeout_expires) {
+		this->poll_wait_set();
+		return true;
+	}
+
+	// the time spent spinning counts towards the timeout,
+	// the remaining time is rounded up to not wake up before the timeout expires
+	if (timeout_deadline.has_value()) {
+		auto remaining = std::chrono::ceil<std::chrono::milliseconds>(timeout_deadline.value() - clock::now());
+		timeout = uint32_t(std::max(remaining.count(), decltype(remaining.count())(0)));
+	}
+
+	return false;
+}
+
+void loop_thread::poll_wait_set()
+{
+	if (this->num_other_waitables() != 0 || !this->wait_set.get_triggered().empty()) {
+		this->wait_set.wait(0);
+	}
+}
+
+void loop_thread::profiling_counters::add_spin_hit() noexcept
+{
+	this->num_spin_hits.store(this->num_spin_hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void loop_thread::profiling_counters::add_park() noexcept
+{
+	this->num_parks.store(this->num_parks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void loop_thread::profiling_counters::add_iteration(
+	clock::duration on_loop,
+	clock::duration wait,
+	clock::duration procedures,
+	size_t num_procedures
+) noexcept
+{
+	// only written by the loop thread, so no read-modify-write operations are needed
+	auto add = [](auto& counter, auto value) {
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	};
+
+	auto to_ns = [](clock::duration d) {
+		return int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+	};
+
+	add(this->num_iterations, uint64_t(1));
+	add(this->num_procedures, uint64_t(num_procedures));
+	add(this->on_loop_ns, to_ns(on_loop));
+	add(this->wait_ns, to_ns(wait));
+	add(this->procedures_ns, to_ns(procedures));
+
+	this->last_on_loop_ns.store(to_ns(on_loop), std::memory_order_relaxed);
+	this->last_wait_ns.store(to_ns(wait), std::memory_order_relaxed);
+	this->last_procedures_ns.store(to_ns(procedures), std::memory_order_relaxed);
+	this->last_num_procedures.store(uint64_t(num_procedures), std::memory_order_relaxed);
+}
+
+loop_thread::profile loop_thread::get_profile() const noexcept
+{
+	using std::chrono::nanoseconds;
+
+	const auto& p = this->profiling;
+
+	profile ret;
+
+	ret.num_iterations = p.num_iterations.load(std::memory_order_relaxed);
+	ret.num_procedures = p.num_procedures.load(std::memory_order_relaxed);
+	ret.on_loop_time = nanoseconds(p.on_loop_ns.load(std::memory_order_relaxed));
+	ret.wait_time = nanoseconds(p.wait_ns.load(std::memory_order_relaxed));
+	ret.procedures_time = nanoseconds(p.procedures_ns.load(std::memory_order_relaxed));
+	ret.num_spin_hits = p.num_spin_hits.load(std::memory_order_relaxed);
+	ret.num_parks = p.num_parks.load(std::memory_order_relaxed);
+
+	ret.last_iteration.on_loop_time = nanoseconds(p.last_on_loop_ns.load(std::memory_order_relaxed));
+	ret.last_iteration.wait_time = nanoseconds(p.last_wait_ns.load(std::memory_order_relaxed));
+	ret.last_iteration.procedures_time = nanoseconds(p.last_procedures_ns.load(std::memory_order_relaxed));
+	ret.last_iteration.num_procedures = size_t(p.last_num_procedures.load(std::memory_order_relaxed));
+
+	return ret;
+}
+
+std::chrono::nanoseconds loop_thread::profile::get_total_time() const noexcept
+{
+	return this->on_loop_time + this->wait_time + this->procedures_time;
+}
+
+double loop_thread::profile::get_iterations_per_second() const noexcept
+{
+	auto total = this->get_total_time();
+	if (total.count() == 0) {
+		return 0;
+	}
+	return double(this->num_iterations) / std::chrono::duration<double>(total).count();
+}
+
+double loop_thread::profile::get_procedures_per_iteration() const noexcept
+{
+	if (this->num_iterations == 0) {
+		return 0;
+	}
+	return double(this->num_procedures) / double(this->num_iterations);
+}
+
+double loop_thread::profile::get_utilization() const noexcept
+{
+	auto total = this->get_total_time();
+	if (total.count() == 0) {
+		return 0;
+	}
+	return double((this->on_loop_time + this->procedures_time).count()) / double(total.count());
+}
+
+loop_thread::profile loop_thread::profile::operator-(const profile& p) const noexcept
+{
+	profile ret = *this;
+	ret.num_iterations -= p.num_iterations;
+	ret.num_procedures -= p.num_procedures;
+	ret.on_loop_time -= p.on_loop_time;
+	ret.wait_time -= p.wait_time;
+	ret.procedures_time -= p.procedures_time;
+	ret.num_spin_hits -= p.num_spin_hits;
+	ret.num_parks -= p.num_parks;
+	return ret;
+}
+
+void loop_thread::run_batches()
+{
+	for (;;) {
+		auto prio = this->selector.select([this](nitki::queue::priority p) {
+			return !this->batches[size_t(p)].empty();
+		});
+		if (!prio.has_value()) {
+			break;
+		}
+
+		auto& batch = this->batches[size_t(prio.value())];
+
+		auto proc = std::move(batch.front());
+		batch.pop_front();
+
+		// cancelled procedures are skipped without counting them and recording their latency
+		if (proc && nitki::queue::claim(proc)) {
+			++this->num_iteration_procedures;
+			this->queue.record_latency(proc);
+			proc.operator()();
+		}
+
+		// pick up higher priority procedures pushed while running the procedure
+		for (size_t i = size_t(prio.value()) + 1; i != this->batches.size(); ++i) {
+			auto p = nitki::queue::priority(i);
+			if (this->queue.size(p) != 0) {
+				this->queue.pop_all(this->batches[i], p);
+			}
+		}
+	}
+}
+
+loop_thread::timer_handle loop_thread::push_at(clock::time_point time_point, procedure proc)
+{
+	auto t = std::make_shared<timer>(time_point, clock::duration::zero(), std::move(proc));
+	this->schedule_timer(t);
+	return t;
+}
+
+loop_thread::timer_handle loop_thread::push_after(clock::duration delay, procedure proc)
+{
+	return this->push_at(clock::now() + delay, std::move(proc));
+}
+
+loop_thread::timer_handle loop_thread::push_every(clock::duration period, procedure proc)
+{
+	if (period <= clock::duration::zero()) {
+		throw std::invalid_argument("loop_thread::push_every(): period must be greater than zero");
+	}
+
+	auto t = std::make_shared<timer>(clock::now() + period, period, std::move(proc));
+	this->schedule_timer(t);
+	return t;
+}
+
+void loop_thread::schedule_timer(std::shared_ptr<timer> t)
+{
+	if (this->loop_thread_id.load() == std::this_thread::get_id()) {
+		this->insert_timer(std::move(t));
+		return;
+	}
+
+	// the timers heap is only accessed from within the loop thread, so pass the timer over via the queue
+	this->queue.push_back(
+		[this, t = std::move(t)]() mutable {
+			this->insert_timer(std::move(t));
+		},
+		nitki::queue::priority::high
+	);
+}
+
+void loop_thread::insert_timer(std::shared_ptr<timer> t)
+{
+	this->timers.push_back(std::move(t));
+	std::push_heap(this->timers.begin(), this->timers.end(), later_deadline);
+}
+
+std::optional<loop_thread::clock::duration> loop_thread::time_until_next_timer()
+{
+	// discard cancelled timers from the top of the heap
+	while (!this->timers.empty() && this->timers.front()->canceled.load(std::memory_order_relaxed)) {
+		std::pop_heap(this->timers.begin(), this->timers.end(), later_deadline);
+		this->timers.pop_back();
+	}
+
+	if (this->timers.empty()) {
+		return {};
+	}
+
+	return this->timers.front()->deadline - clock::now();
+}
+
+void loop_thread::fire_timers()
+{
+	if (this->timers.empty()) {
+		return;
+	}
+
+	auto now = clock::now();
+
+	while (!this->timers.empty()) {
+		auto& top = this->timers.front();
+		if (!top->canceled.load(std::memory_order_relaxed) && top->deadline > now) {
+			break;
+		}
+
+		std::pop_heap(this->timers.begin(), this->timers.end(), later_deadline);
+		auto t = std::move(this->timers.back());
+		this->timers.pop_back();
+
+		// the procedure is run outside of the lock, so that it can cancel its own timer
+		procedure proc;
+		{
+			std::lock_guard<decltype(t->mut)> lock_guard(t->mut);
+			proc = std::move(t->proc);
+		}
+
+		// cancelled procedures are skipped without counting them and recording their latency
+		if (proc && nitki::queue::claim(proc)) {
+			++this->num_iteration_procedures;
+			proc();
+		}
+
+		if (t->period == clock::duration::zero()) {
+			// the procedure's captured state is released, the timer object itself may still be referred by its handle
+			continue;
+		}
+
+		bool canceled = false;
+		{
+			std::lock_guard<decltype(t->mut)> lock_guard(t->mut);
+			canceled = t->canceled.load(std::memory_order_relaxed);
+			if (!canceled) {
+				t->proc = std::move(proc);
+			}
+		}
+
+		if (canceled) {
+			continue;
+		}
+
+		t->deadline += t->period;
+		if (t->deadline <= now) {
+			// skip missed periods
+			t->deadline += t->period * ((now - t->deadline) / t->period + 1);
+		}
+
+		this->insert_timer(std::move(t));
+	}
+}
+
+void loop_thread::await_waitable(awaited_waitable& aw)
+{
+	if (this->loop_thread_id.load() == std::this_thread::get_id()) {
+		this->add_awaited_waitable(aw);
+		return;
+	}
+
+	// the wait_set is only accessed from within the loop thread
+	this->queue.push_back([this, &aw]() {
+		this->add_awaited_waitable(aw);
+	});
+}
+
+void loop_thread::add_awaited_waitable(awaited_waitable& aw)
+{
+	this->wait_set.add(*aw.object, aw.wait_for, &aw);
+	this->awaited_waitables.push_back(&aw);
+}
+
+void loop_thread::resume_awaiting_coroutines()
+{
+	for (const auto& t : this->wait_set.get_triggered()) {
+		if (!t.user_data) {
+			// the queue
+			continue;
+		}
+
+		auto i = std::find(this->awaited_waitables.begin(), this->awaited_waitables.end(), t.user_data);
+		if (i == this->awaited_waitables.end()) {
+			continue;
+		}
+
+		auto aw = *i;
+		this->awaited_waitables.erase(i);
+
+		this->wait_set.remove(*aw->object);
+		aw->triggered = t.flags;
+
+		this->resumable.push_back(aw);
+	}
+
+	// the awaited_waitable objects reside in the coroutine frames and can be destroyed when the coroutine is resumed,
+	// so resume after collecting all the triggered ones
+	for (auto aw : this->resumable) {
+		++this->num_iteration_procedures;
+		aw->resume(aw->coroutine);
+	}
+	this->resumable.clear();
 }
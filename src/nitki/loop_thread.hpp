@@ -26,8 +26,18 @@ SOFTWARE.
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <iterator>
+#include <memory>
 #include <optional>
+#include <thread>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine)
+#	include <coroutine>
+#endif
 
 #include <opros/wait_set.hpp>
 
@@ -38,10 +48,116 @@ namespace nitki {
 
 class loop_thread : public nitki::thread
 {
+public:
+	/**
+	 * @brief Clock used for timers.
+	 * Monotonic clock, not affected by system time changes.
+	 */
+	using clock = std::chrono::steady_clock;
+
+private:
+	struct timer;
+
 	nitki::queue queue;
 
+	// procedures taken out from the queue on current iteration, by priority
+	std::array<std::deque<procedure>, nitki::queue::num_priorities> batches;
+
+	nitki::queue::priority_selector selector;
+
+	void run_batches();
+
+	// id of the thread running the main loop, used to detect calls made from within the loop thread
+	std::atomic<std::thread::id> loop_thread_id;
+
+	// binary min-heap of scheduled timers, ordered by deadline,
+	// only accessed from within the loop thread
+	std::vector<std::shared_ptr<timer>> timers;
+
+	void insert_timer(std::shared_ptr<timer> t);
+	void schedule_timer(std::shared_ptr<timer> t);
+	std::optional<clock::duration> time_until_next_timer();
+	void fire_timers();
+
+	// waitable awaited by a suspended coroutine
+	struct awaited_waitable {
+		opros::waitable* object;
+		utki::flags<opros::ready> wait_for;
+		utki::flags<opros::ready> triggered;
+
+		// address of the coroutine frame and function resuming the coroutine,
+		// type-erased so that the class layout does not depend on coroutine support
+		void* coroutine;
+		void (*resume)(void* coroutine);
+	};
+
+	// waitables added to the wait_set by awaiting coroutines, only accessed from within the loop thread
+	std::vector<awaited_waitable*> awaited_waitables;
+
+	// coroutines to be resumed on current iteration
+	std::vector<awaited_waitable*> resumable;
+
+	void await_waitable(awaited_waitable& aw);
+	void add_awaited_waitable(awaited_waitable& aw);
+	void resume_awaiting_coroutines();
+
+	// number of procedures run on current iteration, only accessed from within the loop thread
+	size_t num_iteration_procedures = 0;
+
+	// written only by the loop thread, read by get_profile() from any thread
+	struct profiling_counters {
+		std::atomic<uint64_t> num_iterations = 0;
+		std::atomic<uint64_t> num_procedures = 0;
+		std::atomic<int64_t> on_loop_ns = 0;
+		std::atomic<int64_t> wait_ns = 0;
+		std::atomic<int64_t> procedures_ns = 0;
+
+		std::atomic<int64_t> last_on_loop_ns = 0;
+		std::atomic<int64_t> last_wait_ns = 0;
+		std::atomic<int64_t> last_procedures_ns = 0;
+		std::atomic<uint64_t> last_num_procedures = 0;
+
+		std::atomic<uint64_t> num_spin_hits = 0;
+		std::atomic<uint64_t> num_parks = 0;
+
+		void add_iteration(
+			clock::duration on_loop,
+			clock::duration wait,
+			clock::duration procedures,
+			size_t num_procedures
+		) noexcept;
+
+		void add_spin_hit() noexcept;
+		void add_park() noexcept;
+	} profiling;
+
 	std::atomic_bool quit_flag = false;
 
+	// busy polling spin budget in nanoseconds, 0 means busy polling is disabled
+	std::atomic<int64_t> spin_budget_ns = 0;
+
+	void wait(std::optional<uint32_t> timeout);
+
+	// returns true if the wait is over, i.e. the thread has got work or the timeout has expired while spinning,
+	// otherwise the timeout is decreased by the time spent spinning
+	bool busy_poll(clock::duration budget, std::optional<uint32_t>& timeout);
+
+	// whether the queue is in the wait_set, with lazily waitable queue it is only added
+	// when something else is added to the wait_set, only accessed from within the loop thread
+	// after construction
+	bool queue_in_wait_set;
+
+	// number of waitables in the wait_set besides the queue
+	size_t num_other_waitables() const noexcept
+	{
+		return this->wait_set.size() - (this->queue_in_wait_set ? 1 : 0);
+	}
+
+	// Update the list of triggered waitables without blocking, when the wait_set is not waited on.
+	// Skipped if there is nothing besides the queue in the wait_set and nothing was triggered before,
+	// otherwise on_loop() would see the triggered waitables of the previous iteration.
+	void poll_wait_set();
+
 public:
 	/**
 	 * @brief wait_set of the thread.
@@ -56,10 +172,16 @@ public:
 	 * This is because internal loop_thread::queue is added to the wait_set as well.
 	 * The internal loop_thread::queue is added with nullptr user_data, so it will be easy
 	 * to identify the queue from the list returned by wait_set::get_triggered().
+	 * In case the queue is lazily waitable, see nitki::queue::parameters::lazy_waitable,
+	 * it is only added to the wait_set when anything else is added to the wait_set, until then
+	 * the thread waits on the queue without the wait_set.
 	 *
 	 * @param wait_set_capacity - requested capacity of the thread's wait_set.
+	 * @param queue_params - parameters of the thread's procedure queue.
+	 *                       Since the loop_thread is the only consumer of its queue, it is safe to use
+	 *                       nitki::queue::kind::lock_free queue storage.
 	 */
-	loop_thread(unsigned wait_set_capacity);
+	loop_thread(unsigned wait_set_capacity, const nitki::queue::parameters& queue_params = {});
 
 	~loop_thread() override;
 
@@ -100,13 +222,525 @@ public:
 
 	/**
 	 * @brief Pushes a new procedure to the end of the thread's queue.
+	 * See nitki::queue::push_back() for details.
 	 * @param proc - the procedure to push into the queue.
 	 */
-	void push_back(std::function<void()> proc)
+	void push_back(procedure proc)
 	{
 		this->queue.push_back(std::move(proc));
 	}
 
+	/**
+	 * @brief Pushes a new procedure of given priority to the end of the thread's queue.
+	 * Procedures of higher priority pushed while the thread is running lower priority procedures
+	 * are run before the rest of lower priority ones.
+	 * See nitki::queue::push_back() for details.
+	 * @param proc - the procedure to push into the queue.
+	 * @param prio - priority of the procedure.
+	 */
+	void push_back(procedure proc, nitki::queue::priority prio)
+	{
+		this->queue.push_back(std::move(proc), prio);
+	}
+
+	/**
+	 * @brief Pushes a callable object to the end of the thread's queue.
+	 * The callable object is allocated from the queue's memory pool, if any.
+	 * See nitki::queue::push_back(function_type&&, priority) for details.
+	 * @param func - the callable object to push into the queue.
+	 * @param prio - priority of the procedure.
+	 */
+	template <
+		typename function_type,
+		std::enable_if_t<
+			!std::is_same_v<std::decay_t<function_type>, procedure> &&
+				std::is_invocable_r_v<void, std::decay_t<function_type>&>,
+			bool> = true>
+	void push_back(function_type&& func, nitki::queue::priority prio = nitki::queue::priority::normal)
+	{
+		this->queue.push_back(std::forward<function_type>(func), prio);
+	}
+
+	/**
+	 * @brief Pushes a cancellable procedure to the end of the thread's queue.
+	 * Cancelled procedures are skipped by the thread.
+	 * See nitki::queue::push_cancellable() for details.
+	 * @param proc - the procedure to push into the queue.
+	 * @param prio - priority of the procedure.
+	 * @return handle for cancelling the procedure.
+	 */
+	cancellation_handle push_cancellable(
+		procedure proc,
+		nitki::queue::priority prio = nitki::queue::priority::normal
+	)
+	{
+		return this->queue.push_cancellable(std::move(proc), prio);
+	}
+
+	/**
+	 * @brief Pushes a procedure to the end of the thread's queue, merging it with the pending one of the same key.
+	 * See nitki::queue::push_coalesced() for details.
+	 * @param key - identity of the procedure.
+	 * @param proc - the procedure to push into the queue.
+	 * @param policy - what to do if there is a pending procedure with the same key.
+	 * @param prio - priority of the procedure.
+	 * @return true if the procedure was pushed to the queue.
+	 * @return false if the procedure was merged with the pending one.
+	 */
+	bool push_coalesced(
+		const void* key,
+		procedure proc,
+		nitki::queue::coalescing policy = nitki::queue::coalescing::replace,
+		nitki::queue::priority prio = nitki::queue::priority::normal
+	)
+	{
+		return this->queue.push_coalesced(key, std::move(proc), policy, prio);
+	}
+
+	/**
+	 * @brief Pushes a new procedure to the end of the thread's queue, waits for room with timeout.
+	 * See nitki::queue::push_back(procedure&&, uint32_t) for details.
+	 * @param proc - the procedure to push into the queue.
+	 * @param timeout_ms - waiting timeout in milliseconds.
+	 * @return true if the procedure was pushed to the queue.
+	 * @return false if the timeout was hit.
+	 */
+	bool push_back(procedure&& proc, uint32_t timeout_ms)
+	{
+		return this->queue.push_back(std::move(proc), timeout_ms);
+	}
+
+	/**
+	 * @brief Pushes a new procedure to the end of the thread's queue if there is room.
+	 * See nitki::queue::try_push_back() for details.
+	 * @param proc - the procedure to push into the queue.
+	 * @return true if the procedure was pushed to the queue.
+	 * @return false if the queue is full.
+	 */
+	bool try_push_back(procedure&& proc)
+	{
+		return this->queue.try_push_back(std::move(proc));
+	}
+
+	/**
+	 * @brief Run a function returning a result on the thread.
+	 * See nitki::queue::push_with_result() for details.
+	 * If called from within the loop thread itself, the function is run immediately,
+	 * before returning from this method, so the returned future is already completed.
+	 * @param func - the function to run.
+	 * @param prio - priority of the procedure.
+	 * @return future result of the function.
+	 */
+	template <typename function_type>
+	future<future_value_t<function_type>> call(
+		function_type&& func,
+		nitki::queue::priority prio = nitki::queue::priority::normal
+	)
+	{
+		if (this->loop_thread_id.load() == std::this_thread::get_id()) {
+			auto [proc, f] = future<future_value_t<function_type>>::package(std::forward<function_type>(func));
+			proc();
+			return std::move(f);
+		}
+		return this->queue.push_with_result(std::forward<function_type>(func), prio);
+	}
+
+	/**
+	 * @brief Get waitable which reports free space in the thread's bounded queue.
+	 * See nitki::queue::get_space_waitable() for details.
+	 * @return waitable for waiting for free space in the queue.
+	 */
+	opros::waitable& get_space_waitable()
+	{
+		return this->queue.get_space_waitable();
+	}
+
+	/**
+	 * @brief Pushes a range of procedures to the end of the thread's queue.
+	 * All the procedures are pushed at once and the thread is woken up at most once.
+	 * See nitki::queue::push_back(iterator_type, iterator_type) for details.
+	 * @param procs - range of procedures to push into the queue, e.g. std::vector<nitki::procedure>.
+	 *                The procedures are moved out of the range.
+	 */
+	template <
+		typename range_type,
+		typename = decltype(std::begin(std::declval<range_type&>()), std::end(std::declval<range_type&>()))>
+	void push_back(range_type&& procs)
+	{
+		this->queue.push_back(std::begin(procs), std::end(procs));
+	}
+
+	/**
+	 * @brief Handle of a scheduled timer.
+	 * Allows cancelling the timer. Destroying or discarding the handle does not cancel the timer.
+	 */
+	class timer_handle
+	{
+		friend class loop_thread;
+
+		std::shared_ptr<timer> t;
+
+		timer_handle(std::shared_ptr<timer> t) :
+			t(std::move(t))
+		{}
+
+	public:
+		timer_handle() = default;
+
+		/**
+		 * @brief Cancel the timer.
+		 * After this call the timer's procedure will not be run, unless it is being run
+		 * at the moment of the call. Cancelling a fired one-shot timer or
+		 * an already cancelled timer has no effect.
+		 * The timer's procedure, along with its captured state, is destroyed by this call,
+		 * unless the procedure is being run at the moment, in which case the loop thread
+		 * destroys it when it finishes running. The loop thread discards the cancelled timer itself later,
+		 * when the timer's deadline is reached.
+		 * Can be called from any thread.
+		 */
+		void cancel() noexcept;
+
+		/**
+		 * @brief Check if the handle refers to a timer.
+		 * @return true if the handle refers to a timer.
+		 * @return false if the handle is default constructed.
+		 */
+		explicit operator bool() const noexcept
+		{
+			return bool(this->t);
+		}
+	};
+
+	/**
+	 * @brief Schedule a procedure to be run by the thread at given time point.
+	 * The procedure is run on the first main loop iteration after the time point is reached.
+	 * The main loop's waiting timeout is adjusted automatically, so that on_loop() does not need
+	 * to account for the scheduled timers.
+	 * When called from a thread other than the loop thread, the timer is passed to the loop thread
+	 * via its queue, so for bounded queue the call may block waiting for room in the queue.
+	 * Can be called from any thread.
+	 * @param time_point - time point to run the procedure at.
+	 * @param proc - the procedure to run.
+	 * @return handle of the scheduled timer.
+	 */
+	timer_handle push_at(clock::time_point time_point, procedure proc);
+
+	/**
+	 * @brief Schedule a procedure to be run by the thread after given delay.
+	 * See push_at() for details.
+	 * @param delay - delay after which to run the procedure.
+	 * @param proc - the procedure to run.
+	 * @return handle of the scheduled timer.
+	 */
+	timer_handle push_after(clock::duration delay, procedure proc);
+
+	/**
+	 * @brief Schedule a procedure to be run by the thread periodically.
+	 * The procedure is first run after one period and then repeatedly every period
+	 * until the timer is cancelled. The deadlines are computed from the previous deadline,
+	 * not from the actual time of running the procedure, so the timer does not drift.
+	 * In case the thread falls behind by several periods, the missed runs are skipped.
+	 * See push_at() for details.
+	 * @param period - period of the timer, must be greater than zero.
+	 * @param proc - the procedure to run.
+	 * @return handle of the scheduled timer.
+	 */
+	timer_handle push_every(clock::duration period, procedure proc);
+
+#if defined(__cpp_impl_coroutine) || defined(DOXYGEN)
+	/**
+	 * @brief Awaitable which resumes the awaiting coroutine on the loop thread.
+	 */
+	class schedule_awaitable
+	{
+		friend class loop_thread;
+
+		loop_thread& loop;
+
+		schedule_awaitable(loop_thread& loop) :
+			loop(loop)
+		{}
+
+	public:
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			this->loop.push_back([h]() {
+				h.resume();
+			});
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	/**
+	 * @brief Resume the awaiting coroutine on this thread.
+	 * The coroutine is resumed by the loop thread as a procedure from its queue.
+	 * Awaiting from within the loop thread yields to the procedures already in the queue.
+	 * Only available when the code using it is compiled with C++20 coroutines support.
+	 * @return awaitable.
+	 */
+	schedule_awaitable schedule() noexcept
+	{
+		return {*this};
+	}
+
+	/**
+	 * @brief Awaitable which resumes the awaiting coroutine on the loop thread at given time point.
+	 */
+	class sleep_awaitable
+	{
+		friend class loop_thread;
+
+		loop_thread& loop;
+		clock::time_point time_point;
+
+		sleep_awaitable(loop_thread& loop, clock::time_point time_point) :
+			loop(loop),
+			time_point(time_point)
+		{}
+
+	public:
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			this->loop.push_at(this->time_point, [h]() {
+				h.resume();
+			});
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	/**
+	 * @brief Resume the awaiting coroutine on this thread after given delay.
+	 * See push_after() for details.
+	 * Only available when the code using it is compiled with C++20 coroutines support.
+	 * @param delay - delay after which to resume the coroutine.
+	 * @return awaitable.
+	 */
+	sleep_awaitable sleep_for(clock::duration delay)
+	{
+		return {*this, clock::now() + delay};
+	}
+
+	/**
+	 * @brief Resume the awaiting coroutine on this thread at given time point.
+	 * See push_at() for details.
+	 * Only available when the code using it is compiled with C++20 coroutines support.
+	 * @param time_point - time point at which to resume the coroutine.
+	 * @return awaitable.
+	 */
+	sleep_awaitable sleep_until(clock::time_point time_point) noexcept
+	{
+		return {*this, time_point};
+	}
+
+	/**
+	 * @brief Awaitable which resumes the awaiting coroutine on the loop thread when a waitable becomes ready.
+	 */
+	class waitable_awaitable : private awaited_waitable
+	{
+		friend class loop_thread;
+
+		loop_thread& loop;
+
+		waitable_awaitable(loop_thread& loop, opros::waitable& w, utki::flags<opros::ready> wait_for) :
+			awaited_waitable{&w, wait_for, {}, nullptr, nullptr},
+			loop(loop)
+		{}
+
+	public:
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			this->coroutine = h.address();
+			this->resume = [](void* coroutine) {
+				std::coroutine_handle<>::from_address(coroutine).resume();
+			};
+			this->loop.await_waitable(*this);
+		}
+
+		/**
+		 * @brief Get readiness flags of the waitable which triggered resuming.
+		 * @return readiness flags.
+		 */
+		utki::flags<opros::ready> await_resume() const noexcept
+		{
+			return this->triggered;
+		}
+	};
+
+	/**
+	 * @brief Resume the awaiting coroutine on this thread when the waitable becomes ready.
+	 * The waitable is added to the thread's wait_set for the time of awaiting, so the wait_set
+	 * capacity must account for it. The entries of the coroutine awaited waitables appear in the list
+	 * returned by wait_set::get_triggered() with user_data pointing to internal objects, so on_loop()
+	 * implementations should ignore triggered objects with unknown user_data.
+	 * Only available when the code using it is compiled with C++20 coroutines support.
+	 * @param w - waitable to wait for.
+	 * @param wait_for - readiness flags to wait for.
+	 * @return awaitable, the co_await expression gives the readiness flags of the waitable.
+	 */
+	waitable_awaitable wait_for(opros::waitable& w, utki::flags<opros::ready> wait_for)
+	{
+		return {*this, w, wait_for};
+	}
+#endif
+
+	/**
+	 * @brief Set busy polling spin budget.
+	 * When the spin budget is non-zero, the thread does not block on the wait_set right away
+	 * when it has nothing to do. Instead, it polls the queue and the wait_set without blocking
+	 * for up to the spin budget time before falling back to blocking wait.
+	 * While the thread is not blocked, procedures are pushed to the thread's queue without signalling
+	 * the queue's waitable (see queue::announce_awake()), so the thread picks up procedures pushed
+	 * while it is polling without a wake up, which reduces latency at the cost of burning CPU time.
+	 * See profile::num_spin_hits and profile::num_parks to tune the spin budget.
+	 * Can be called from any thread, takes effect on next main loop iteration.
+	 * @param budget - maximum time to spin before blocking. Zero disables busy polling, which is the default.
+	 */
+	void set_spin_budget(std::chrono::nanoseconds budget) noexcept
+	{
+		this->spin_budget_ns.store(
+			int64_t(std::max(budget, std::chrono::nanoseconds::zero()).count()),
+			std::memory_order_relaxed
+		);
+	}
+
+	/**
+	 * @brief Get busy polling spin budget.
+	 * @return current spin budget, zero if busy polling is disabled.
+	 */
+	std::chrono::nanoseconds get_spin_budget() const noexcept
+	{
+		return std::chrono::nanoseconds(this->spin_budget_ns.load(std::memory_order_relaxed));
+	}
+
+	/**
+	 * @brief Profile of the main loop.
+	 * Each main loop iteration consists of three phases: calling on_loop(), waiting on the wait_set
+	 * and running procedures, which includes running the queued procedures, fired timers and
+	 * resumed coroutines.
+	 */
+	struct profile {
+		/**
+		 * @brief Number of completed main loop iterations.
+		 */
+		uint64_t num_iterations = 0;
+
+		/**
+		 * @brief Number of procedures run.
+		 */
+		uint64_t num_procedures = 0;
+
+		/**
+		 * @brief Cumulative time spent in on_loop().
+		 */
+		std::chrono::nanoseconds on_loop_time{0};
+
+		/**
+		 * @brief Cumulative time spent waiting on the wait_set.
+		 * Includes time spent busy polling.
+		 */
+		std::chrono::nanoseconds wait_time{0};
+
+		/**
+		 * @brief Cumulative time spent running procedures.
+		 */
+		std::chrono::nanoseconds procedures_time{0};
+
+		/**
+		 * @brief Number of times the thread has got work while busy polling.
+		 * See set_spin_budget().
+		 */
+		uint64_t num_spin_hits = 0;
+
+		/**
+		 * @brief Number of times the thread has blocked waiting on the wait_set.
+		 * This includes falling back to blocking wait after the busy polling spin budget was exhausted.
+		 */
+		uint64_t num_parks = 0;
+
+		/**
+		 * @brief Profile of the last completed iteration.
+		 */
+		struct {
+			std::chrono::nanoseconds on_loop_time{0};
+			std::chrono::nanoseconds wait_time{0};
+			std::chrono::nanoseconds procedures_time{0};
+			size_t num_procedures = 0;
+		} last_iteration;
+
+		/**
+		 * @brief Get total time of the profiled iterations.
+		 * @return sum of the cumulative times of all phases.
+		 */
+		std::chrono::nanoseconds get_total_time() const noexcept;
+
+		/**
+		 * @brief Get main loop iterations rate.
+		 * @return number of iterations per second of the total time.
+		 */
+		double get_iterations_per_second() const noexcept;
+
+		/**
+		 * @brief Get average number of procedures run per iteration.
+		 * @return average number of procedures per iteration.
+		 */
+		double get_procedures_per_iteration() const noexcept;
+
+		/**
+		 * @brief Get utilization of the thread.
+		 * @return fraction of the total time the thread was busy, i.e. not waiting on the wait_set.
+		 */
+		double get_utilization() const noexcept;
+
+		/**
+		 * @brief Get difference of cumulative values of two profiles.
+		 * Useful to get profile of the time interval between two snapshots.
+		 * The last_iteration is taken from this profile.
+		 * @param p - earlier profile.
+		 * @return profile of the iterations made between the two snapshots.
+		 */
+		profile operator-(const profile& p) const noexcept;
+	};
+
+	/**
+	 * @brief Get snapshot of the main loop profile.
+	 * The values are updated at the end of each main loop iteration. The values are read without
+	 * synchronization with the loop thread, so they can be slightly inconsistent with each other.
+	 * Can be called from any thread.
+	 * @return snapshot of the main loop profile.
+	 */
+	profile get_profile() const noexcept;
+
+	/**
+	 * @brief Get snapshot of the thread's queue metrics.
+	 * The latency histogram measures time from pushing a procedure to the thread's queue
+	 * to starting its execution by the thread.
+	 * The queue collects metrics if the thread is constructed with
+	 * nitki::queue::parameters::collect_metrics set.
+	 * See nitki::queue::get_metrics() for details.
+	 * @return snapshot of the queue metrics.
+	 */
+	nitki::queue::metrics get_queue_metrics() const
+	{
+		return this->queue.get_metrics();
+	}
+
 	/**
 	 * @brief Trigger the queue ready to read.
 	 * This method triggers the thread's queue to be ready to read
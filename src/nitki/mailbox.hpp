@@ -0,0 +1,176 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#pragma once
+
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include <opros/waitable.hpp>
+#include <utki/spin_lock.hpp>
+
+#include "channel.hpp"
+
+namespace nitki {
+
+/**
+ * @brief Type independent part of nitki::mailbox.
+ * Keeps track of the readiness of the mailbox.
+ */
+class mailbox_base
+{
+	channel_end read_end;
+
+	// Serializes switching readiness of the mailbox. The switching involves system calls,
+	// so it is done after releasing the spin lock, see sync_readiness().
+	std::mutex readiness_mutex;
+
+protected:
+	utki::spin_lock mutex;
+
+	// whether the mailbox holds a value, guarded by the mutex
+	bool has_value = false;
+
+	mailbox_base();
+
+	~mailbox_base() = default;
+
+	/**
+	 * @brief Bring readiness of the mailbox in line with whether it holds a value.
+	 * Must be called with the mutex unlocked, after putting the value to the empty mailbox
+	 * or after taking the value.
+	 */
+	void sync_readiness();
+
+public:
+	mailbox_base(const mailbox_base&) = delete;
+	mailbox_base& operator=(const mailbox_base&) = delete;
+	mailbox_base(mailbox_base&&) = delete;
+	mailbox_base& operator=(mailbox_base&&) = delete;
+
+	/**
+	 * @brief Get waitable of the mailbox.
+	 * The returned waitable can be added to an opros::wait_set to wait for opros::ready::read,
+	 * it is ready when the mailbox holds a value.
+	 * @return waitable of the mailbox.
+	 */
+	opros::waitable& get_waitable() noexcept
+	{
+		return this->read_end;
+	}
+};
+
+/**
+ * @brief Single slot mailbox holding the latest value.
+ * Putting a value to the mailbox overwrites the value which was not taken yet,
+ * so that the consumer only sees the latest one. Useful for conflating high-rate updates,
+ * e.g. state snapshots, when only the most recent one matters.
+ * Any number of threads can put and take values.
+ * The mailbox is waitable with opros::wait_set, see get_waitable().
+ * @tparam value_type - type of the value.
+ */
+template <typename value_type>
+class mailbox : public mailbox_base
+{
+	static_assert(std::is_move_constructible_v<value_type>, "value_type must be move constructible");
+
+	std::optional<value_type> slot;
+
+public:
+	/**
+	 * @brief Constructor, creates empty mailbox.
+	 */
+	mailbox() = default;
+
+	/**
+	 * @brief Put value to the mailbox.
+	 * The value not yet taken from the mailbox, if any, is overwritten.
+	 * The overwritten value is destroyed outside of the mailbox lock.
+	 * @param value - value to put to the mailbox.
+	 * @return true if the value not yet taken from the mailbox was overwritten.
+	 * @return false if the mailbox was empty.
+	 */
+	bool put(value_type value)
+	{
+		std::optional<value_type> old;
+		{
+			std::lock_guard<decltype(this->mutex)> lock(this->mutex);
+
+			if (this->has_value) {
+				old = std::move(this->slot);
+			}
+			this->slot = std::move(value);
+			this->has_value = true;
+		}
+
+		if (!old.has_value()) {
+			this->sync_readiness();
+		}
+
+		return old.has_value();
+	}
+
+	/**
+	 * @brief Take value from the mailbox.
+	 * Never blocks. The mailbox becomes empty.
+	 * @return the latest value put to the mailbox.
+	 * @return empty std::optional if the mailbox is empty.
+	 */
+	std::optional<value_type> take()
+	{
+		std::optional<value_type> ret;
+		{
+			std::lock_guard<decltype(this->mutex)> lock(this->mutex);
+
+			if (!this->has_value) {
+				return std::nullopt;
+			}
+
+			ret = std::move(this->slot);
+			this->slot.reset();
+			this->has_value = false;
+		}
+
+		this->sync_readiness();
+
+		return ret;
+	}
+
+	/**
+	 * @brief Check if the mailbox is empty.
+	 * The value can be outdated by the time it is returned, if other threads use the mailbox.
+	 * @return true if the mailbox holds no value.
+	 */
+	bool empty() noexcept
+	{
+		std::lock_guard<decltype(this->mutex)> lock(this->mutex);
+		return !this->has_value;
+	}
+};
+
+} // namespace nitki
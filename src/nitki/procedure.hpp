@@ -0,0 +1,427 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <utki/debug.hpp>
+
+#include "slab_pool.hpp"
+
+namespace nitki {
+
+/**
+ * @brief Move-only procedure with inline storage.
+ * Type-erased holder of a callable object with signature void().
+ * Unlike std::function, the callable object is not required to be copyable,
+ * and callable objects which fit into the inline buffer are stored without
+ * any heap allocation.
+ * A callable object is stored inline if its size is not greater than buffer_size,
+ * its alignment is not greater than alignof(std::max_align_t) and its
+ * move constructor does not throw. Otherwise, the callable object is allocated on the heap,
+ * or from a nitki::slab_pool if the pool is given to the constructor.
+ * @tparam buffer_size - size of the inline buffer in bytes.
+ */
+template <size_t buffer_size>
+class basic_procedure
+{
+	struct operations {
+		void (*call)(void* storage);
+		void (*move)(void* to, void* from) noexcept;
+		void (*destroy)(void* storage) noexcept;
+	};
+
+	template <typename callable_type>
+	constexpr static bool is_stored_inline = //
+		sizeof(callable_type) <= buffer_size && //
+		alignof(callable_type) <= alignof(std::max_align_t) && //
+		std::is_nothrow_move_constructible_v<callable_type>;
+
+	template <typename callable_type>
+	struct inline_operations {
+		static callable_type& get(void* storage) noexcept
+		{
+			return *std::launder(static_cast<callable_type*>(storage));
+		}
+
+		static void call(void* storage)
+		{
+			get(storage)();
+		}
+
+		static void move(void* to, void* from) noexcept
+		{
+			new (to) callable_type(std::move(get(from)));
+			get(from).~callable_type();
+		}
+
+		static void destroy(void* storage) noexcept
+		{
+			get(storage).~callable_type();
+		}
+
+		constexpr static operations ops = {&call, &move, &destroy};
+	};
+
+	template <typename callable_type>
+	struct heap_operations {
+		static callable_type*& get(void* storage) noexcept
+		{
+			return *std::launder(static_cast<callable_type**>(storage));
+		}
+
+		static void call(void* storage)
+		{
+			(*get(storage))();
+		}
+
+		static void move(void* to, void* from) noexcept
+		{
+			new (to) callable_type*(get(from));
+		}
+
+		static void destroy(void* storage) noexcept
+		{
+			// NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
+			delete get(storage);
+		}
+
+		constexpr static operations ops = {&call, &move, &destroy};
+	};
+
+	template <typename callable_type>
+	struct pooled_operations {
+		struct pointer {
+			callable_type* callable;
+			slab_pool* pool;
+		};
+
+		static pointer& get(void* storage) noexcept
+		{
+			return *std::launder(static_cast<pointer*>(storage));
+		}
+
+		static void call(void* storage)
+		{
+			(*get(storage).callable)();
+		}
+
+		static void move(void* to, void* from) noexcept
+		{
+			new (to) pointer(get(from));
+		}
+
+		static void destroy(void* storage) noexcept
+		{
+			auto& p = get(storage);
+			p.callable->~callable_type();
+			p.pool->deallocate(p.callable, sizeof(callable_type));
+		}
+
+		constexpr static operations ops = {&call, &move, &destroy};
+	};
+
+	template <typename callable_type>
+	constexpr static bool can_be_pooled = //
+		sizeof(typename pooled_operations<callable_type>::pointer) <= buffer_size && //
+		alignof(callable_type) <= alignof(std::max_align_t) && //
+		sizeof(callable_type) <= slab_pool::max_block_size;
+
+	static_assert(buffer_size >= sizeof(void*), "buffer_size must be enough to hold a pointer");
+
+	alignas(std::max_align_t) std::byte buffer[buffer_size]; // NOLINT(modernize-avoid-c-arrays)
+
+	const operations* ops = nullptr;
+
+	// occupies the padding after the ops pointer, so it does not increase the procedure size
+	std::chrono::steady_clock::time_point push_time;
+
+	template <typename callable_type, typename decayed_type = std::decay_t<callable_type>>
+	void init(callable_type&& callable, slab_pool* pool)
+	{
+		if constexpr (std::is_pointer_v<decayed_type> ||
+					  std::is_same_v<decayed_type, std::function<void()>>)
+		{
+			if (!callable) {
+				return;
+			}
+		}
+
+		if constexpr (is_stored_inline<decayed_type>) {
+			new (this->buffer) decayed_type(std::forward<callable_type>(callable));
+			this->ops = &inline_operations<decayed_type>::ops;
+			return;
+		} else if constexpr (can_be_pooled<decayed_type>) {
+			if (pool) {
+				if (void* block = pool->allocate(sizeof(decayed_type))) {
+					decayed_type* c = nullptr;
+					try {
+						c = new (block) decayed_type(std::forward<callable_type>(callable));
+					} catch (...) {
+						pool->deallocate(block, sizeof(decayed_type));
+						throw;
+					}
+					using pointer = typename pooled_operations<decayed_type>::pointer;
+					new (this->buffer) pointer{c, pool};
+					this->ops = &pooled_operations<decayed_type>::ops;
+					return;
+				}
+			}
+		}
+
+		if constexpr (!is_stored_inline<decayed_type>) {
+			new (this->buffer) decayed_type*(new decayed_type(std::forward<callable_type>(callable)));
+			this->ops = &heap_operations<decayed_type>::ops;
+		}
+	}
+
+	void reset() noexcept
+	{
+		if (this->ops) {
+			this->ops->destroy(this->buffer);
+			this->ops = nullptr;
+		}
+	}
+
+public:
+	/**
+	 * @brief Size of the inline buffer.
+	 */
+	constexpr static size_t inline_buffer_size = buffer_size;
+
+	/**
+	 * @brief Check if callable object of given type will be stored without heap allocation.
+	 * @tparam callable_type - callable object type.
+	 */
+	template <typename callable_type>
+	constexpr static bool is_inline = is_stored_inline<std::decay_t<callable_type>>;
+
+	/**
+	 * @brief Construct empty procedure.
+	 */
+	basic_procedure() = default;
+
+	/**
+	 * @brief Construct empty procedure.
+	 */
+	basic_procedure(std::nullptr_t) {}
+
+	/**
+	 * @brief Construct procedure from callable object.
+	 * If the callable object is an empty std::function or a null function pointer,
+	 * then empty procedure is constructed.
+	 * @param callable - callable object to store in the procedure.
+	 */
+	template <
+		typename callable_type,
+		typename decayed_type = std::decay_t<callable_type>,
+		std::enable_if_t<
+			!std::is_same_v<decayed_type, basic_procedure> && std::is_invocable_r_v<void, decayed_type&>,
+			bool> = true>
+	// NOLINTNEXTLINE(bugprone-forwarding-reference-overload, "enable_if excludes basic_procedure")
+	basic_procedure(callable_type&& callable)
+	{
+		this->init(std::forward<callable_type>(callable), nullptr);
+	}
+
+	/**
+	 * @brief Construct procedure from callable object, allocating it from memory pool.
+	 * Callable objects which are not stored inline are allocated from the given pool.
+	 * If the pool cannot serve the allocation, the callable object is allocated on the heap.
+	 * The procedure must be destroyed before the pool.
+	 * If the callable object is an empty std::function or a null function pointer,
+	 * then empty procedure is constructed.
+	 * @param callable - callable object to store in the procedure.
+	 * @param pool - memory pool to allocate the callable object from.
+	 */
+	template <
+		typename callable_type,
+		typename decayed_type = std::decay_t<callable_type>,
+		std::enable_if_t<
+			!std::is_same_v<decayed_type, basic_procedure> && std::is_invocable_r_v<void, decayed_type&>,
+			bool> = true>
+	basic_procedure(callable_type&& callable, slab_pool& pool)
+	{
+		this->init(std::forward<callable_type>(callable), &pool);
+	}
+
+	basic_procedure(const basic_procedure&) = delete;
+	basic_procedure& operator=(const basic_procedure&) = delete;
+
+	basic_procedure(basic_procedure&& p) noexcept :
+		ops(p.ops),
+		push_time(p.push_time)
+	{
+		if (this->ops) {
+			this->ops->move(this->buffer, p.buffer);
+			p.ops = nullptr;
+		}
+	}
+
+	basic_procedure& operator=(basic_procedure&& p) noexcept
+	{
+		if (this == &p) {
+			return *this;
+		}
+		this->reset();
+		if (p.ops) {
+			p.ops->move(this->buffer, p.buffer);
+			this->ops = p.ops;
+			p.ops = nullptr;
+		}
+		this->push_time = p.push_time;
+		return *this;
+	}
+
+	basic_procedure& operator=(std::nullptr_t) noexcept
+	{
+		this->reset();
+		return *this;
+	}
+
+	~basic_procedure()
+	{
+		this->reset();
+	}
+
+	/**
+	 * @brief Check if procedure is not empty.
+	 * @return true if the procedure holds a callable object.
+	 * @return false if the procedure is empty.
+	 */
+	explicit operator bool() const noexcept
+	{
+		return this->ops != nullptr;
+	}
+
+	/**
+	 * @brief Invoke the procedure.
+	 * The procedure must not be empty.
+	 */
+	void operator()()
+	{
+		ASSERT(this->ops)
+		this->ops->call(this->buffer);
+	}
+
+	/**
+	 * @brief Get the stored callable object.
+	 * @tparam callable_type - type of the callable object.
+	 * @return pointer to the stored callable object.
+	 * @return nullptr if the procedure is empty or holds a callable object of a different type.
+	 */
+	template <typename callable_type>
+	callable_type* target() noexcept
+	{
+		if constexpr (is_stored_inline<callable_type>) {
+			if (this->ops == &inline_operations<callable_type>::ops) {
+				return &inline_operations<callable_type>::get(this->buffer);
+			}
+		} else {
+			if (this->ops == &heap_operations<callable_type>::ops) {
+				return heap_operations<callable_type>::get(this->buffer);
+			}
+			if constexpr (can_be_pooled<callable_type>) {
+				if (this->ops == &pooled_operations<callable_type>::ops) {
+					return pooled_operations<callable_type>::get(this->buffer).callable;
+				}
+			}
+		}
+		return nullptr;
+	}
+
+	/**
+	 * @brief Convert to std::function.
+	 * Allows storing procedures, e.g. popped from nitki::queue, in std::function:
+	 * @code{.cpp}
+	 * std::function<void()> f = q.pop_front();
+	 * @endcode
+	 * Since std::function requires copyable callable object, the procedure is moved to the heap
+	 * and shared by all copies of the resulting std::function.
+	 * @return std::function which invokes the procedure.
+	 * @return empty std::function if the procedure is empty.
+	 */
+	operator std::function<void()>() &&
+	{
+		if (!this->ops) {
+			return nullptr;
+		}
+		return [p = std::make_shared<basic_procedure>(std::move(*this))]() {
+			(*p)();
+		};
+	}
+
+	/**
+	 * @brief Get time when the procedure was pushed to a queue.
+	 * The time is only recorded by nitki::queue which collects metrics,
+	 * see nitki::queue::parameters::collect_metrics.
+	 * @return time point when the procedure was pushed to a queue.
+	 * @return default constructed time point if the time was not recorded.
+	 */
+	std::chrono::steady_clock::time_point get_push_time() const noexcept
+	{
+		return this->push_time;
+	}
+
+	/**
+	 * @brief Set time when the procedure was pushed to a queue.
+	 * @param time - time point when the procedure was pushed.
+	 */
+	void set_push_time(std::chrono::steady_clock::time_point time) noexcept
+	{
+		this->push_time = time;
+	}
+
+	friend bool operator==(const basic_procedure& p, std::nullptr_t) noexcept
+	{
+		return !p;
+	}
+
+	friend bool operator!=(const basic_procedure& p, std::nullptr_t) noexcept
+	{
+		return bool(p);
+	}
+};
+
+/**
+ * @brief Default inline buffer size of nitki::procedure.
+ * Chosen so that the whole procedure object occupies 64 bytes.
+ */
+constexpr size_t default_procedure_buffer_size = 48;
+
+/**
+ * @brief Procedure type used by nitki::queue.
+ */
+using procedure = basic_procedure<default_procedure_buffer_size>;
+
+} // namespace nitki
@@ -26,171 +26,983 @@ SOFTWARE.
 
 #include "queue.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <iterator>
+#include <limits>
 #include <mutex>
-
-#if CFG_OS == CFG_OS_LINUX
-#	include <sys/eventfd.h>
-#	include <cstring>
-#elif CFG_OS == CFG_OS_MACOSX
-#	include <array>
-#endif
+#include <unordered_map>
 
 using namespace nitki;
 
-queue::queue() :
-	queue([]() {
-#if CFG_OS == CFG_OS_WINDOWS
-		auto handle = CreateEvent(
-			nullptr, // security attributes
-			TRUE, // manual-reset
-			FALSE, // not signalled initially
-			nullptr // no name
-		);
-		if (handle == nullptr) {
-			throw std::system_error(
-				int(GetLastError()),
-				std::generic_category(),
-				"could not create event (Win32) for implementing Waitable"
-			);
-		}
-		return handle;
-#elif CFG_OS == CFG_OS_MACOSX
-		std::array<int, 2> ends{};
-		if (::pipe(ends.data()) < 0) {
-			throw std::system_error(
-				errno,
-				std::generic_category(),
-				"could not create pipe (*nix) for implementing Waitable"
-			);
-		}
-		return ends;
-#elif CFG_OS == CFG_OS_LINUX
-		int event_fd = eventfd(0, EFD_NONBLOCK);
-		if (event_fd < 0) {
-			throw std::system_error(
-				errno,
-				std::generic_category(),
-				"could not create eventfd (linux) for implementing Waitable"
-			);
-		}
-		return event_fd;
+struct queue::bound_state {
+	// Waitable which is ready to write when the queue is not full.
+	class space_waitable : public waitable_event
+	{
+	public:
+		space_waitable() :
+			waitable_event(opros::ready::write)
+		{}
+
+		void set_full(bool full) noexcept
+		{
+			if (full) {
+				this->reset();
+			} else {
+				this->set();
+			}
+		}
+	};
+
+	const size_t capacity;
+
+	std::mutex mut;
+	std::condition_variable cond_var;
+
+	// guarded by mut
+	bool is_full = false;
+
+	// same as is_full, but can be read without locking the mutex,
+	// set to true while some producer is checking the queue for being full
+	std::atomic_bool is_full_hint = false;
+
+	space_waitable space;
+
+	bound_state(size_t capacity) :
+		capacity(capacity)
+	{}
+};
+
+namespace {
+// index of the highest set bit, v must not be zero
+size_t log2_floor(uint64_t v) noexcept
+{
+	ASSERT(v != 0)
+#if defined(__GNUC__) || defined(__clang__)
+	return size_t(std::numeric_limits<unsigned long long>::digits - 1 - __builtin_clzll(v));
 #else
-#	error "Unsupported OS"
+	size_t ret = 0;
+	for (; v > 1; v >>= 1) {
+		++ret;
+	}
+	return ret;
 #endif
-	}())
-{}
+}
+
+} // namespace
+
+struct queue::metrics_state {
+	std::atomic_size_t max_depth = 0;
+
+	std::atomic_size_t num_coalesced = 0;
+
+	const std::shared_ptr<cancellation_handle::counters> cancellation =
+		std::make_shared<cancellation_handle::counters>();
+
+	// number of procedures in the queue minus the cancelled ones
+	size_t get_depth(size_t size) const noexcept
+	{
+		auto num_cancelled = this->cancellation->num_queued.load(std::memory_order_relaxed);
+		if (num_cancelled <= 0) {
+			return size;
+		}
+		return size > size_t(num_cancelled) ? size - size_t(num_cancelled) : 0;
+	}
+
+	std::array<std::atomic<uint64_t>, num_latency_buckets> latency_histogram{};
+};
+
+struct queue::coalescing_state {
+	utki::spin_lock mut;
+
+	// the entry exists as long as the runner pushed to the queue for that key is alive and has not been run
+	std::unordered_map<const void*, procedure> pending;
+};
+
+class queue::coalesced_runner
+{
+	std::shared_ptr<coalescing_state> state;
+	const void* key;
+
+public:
+	coalesced_runner(std::shared_ptr<coalescing_state> state, const void* key) :
+		state(std::move(state)),
+		key(key)
+	{}
+
+	coalesced_runner(const coalesced_runner&) = delete;
+	coalesced_runner& operator=(const coalesced_runner&) = delete;
+
+	coalesced_runner(coalesced_runner&&) noexcept = default;
+	coalesced_runner& operator=(coalesced_runner&&) = delete;
+
+	~coalesced_runner()
+	{
+		if (!this->state) {
+			// moved from or already run
+			return;
+		}
+
+		// dropped without running, e.g. the queue is destroyed
+		procedure proc;
+		{
+			std::lock_guard<decltype(this->state->mut)> lock_guard(this->state->mut);
+			auto i = this->state->pending.find(this->key);
+			ASSERT(i != this->state->pending.end())
+			proc = std::move(i->second);
+			this->state->pending.erase(i);
+		}
+	}
+
+	void operator()()
+	{
+		ASSERT(this->state)
+
+		procedure proc;
+		{
+			std::lock_guard<decltype(this->state->mut)> lock_guard(this->state->mut);
+			auto i = this->state->pending.find(this->key);
+			ASSERT(i != this->state->pending.end())
+			proc = std::move(i->second);
+			this->state->pending.erase(i);
+		}
+		this->state.reset();
+
+		if (proc) {
+			proc();
+		}
+	}
+};
+
+queue::queue(const parameters& params) :
+	waitable_event(opros::ready::read, !params.lazy_waitable),
+	storage(params.storage),
+	is_lazy_waitable(params.lazy_waitable),
+	has_handle(!params.lazy_waitable),
+	pool(params.pool),
+	selector(params.starvation_limit)
+{
+	if (params.capacity.has_value()) {
+		if (params.capacity.value() == 0) {
+			throw std::invalid_argument("queue::queue(): capacity must be greater than 0");
+		}
+		this->bound = std::make_unique<bound_state>(params.capacity.value());
+	}
+
+	if (params.collect_metrics) {
+		this->stats = std::make_unique<metrics_state>();
+	}
+}
 
 queue::~queue() noexcept
 {
-#if CFG_OS == CFG_OS_WINDOWS
-	CloseHandle(this->handle);
-#elif CFG_OS == CFG_OS_MACOSX
-	close(this->handle);
-	close(this->pipe_end);
-#elif CFG_OS == CFG_OS_LINUX
-	close(this->handle);
-#else
-#	error "Unsupported OS"
-#endif
+	for (auto& l : this->lanes) {
+		while (node* n = l.pop_node()) {
+			this->delete_node(n);
+		}
+	}
 }
 
 void queue::set_ready_to_read_state() noexcept
 {
-	if (this->is_ready_to_read) {
+	// NOTE: the load has to be sequentially consistent, see clear_ready_to_read_state()
+	if (this->is_ready_to_read.load()) {
 		return;
 	}
 
-#if CFG_OS == CFG_OS_WINDOWS
-	if (SetEvent(this->handle) == 0) {
-		ASSERT(false)
+	if (this->is_ready_to_read.exchange(true)) {
+		// someone else has already made the waitable signalled
+		return;
 	}
-#elif CFG_OS == CFG_OS_MACOSX
-	{
-		std::array<uint8_t, 1> one_byte_buf{};
-		if (write(this->pipe_end, one_byte_buf.data(), 1) != 1) {
-			ASSERT(false)
+
+	if (this->is_lazy_waitable) {
+		std::lock_guard<decltype(this->waitable_mut)> lock_guard(this->waitable_mut);
+		if (!this->has_handle) {
+			this->doorbell.signal();
+			return;
 		}
 	}
-#elif CFG_OS == CFG_OS_LINUX
-	if (eventfd_write(this->handle, 1) < 0) {
-		ASSERT(false)
+
+	this->set();
+}
+
+bool queue::clear_ready_to_read_state() noexcept
+{
+	// the ready state is held by the awake consumer, see announce_awake()
+	if (this->consumer_awake) {
+		return false;
+	}
+
+	// The ready state is set in two steps: first the flag, then the waitable is signalled.
+	// If the waitable is not signalled yet, then signalling is still in progress in another thread,
+	// in this case the ready state is left as is, it will be cleared next time.
+	//
+	// Otherwise, the waitable is reset before clearing the flag, so that if some other thread
+	// sees the flag cleared, then the waitable is already reset and that other thread can signal it again.
+	// Producers add procedures to the queue and then check the flag, while the consumer clears the flag
+	// and then checks the queue for procedures, all these operations are sequentially consistent,
+	// so either producer sees the flag cleared or the consumer sees the new procedure.
+
+	if (!this->reset_waitable()) {
+		return false;
 	}
-#else
-#	error "Unsupported OS"
-#endif
 
-	this->is_ready_to_read = true;
+	this->is_ready_to_read.store(false);
+	return true;
 }
 
-void queue::clear_ready_to_read_state() noexcept
+bool queue::reset_waitable() noexcept
 {
-#if CFG_OS == CFG_OS_WINDOWS
-	if (ResetEvent(this->handle) == 0) {
-		ASSERT(false)
+	if (this->is_lazy_waitable) {
+		std::lock_guard<decltype(this->waitable_mut)> lock_guard(this->waitable_mut);
+		if (!this->has_handle) {
+			return this->doorbell.try_wait();
+		}
+	}
+
+	return this->reset();
+}
+
+void queue::clear_ready_to_read_state_if_empty(std::optional<priority> drained) noexcept
+{
+	ASSERT(this->storage == kind::lock_free)
+
+	if (!this->is_ready_to_read.load()) {
+		return;
+	}
+
+	if (drained.has_value()) {
+		// check if other lanes have procedures
+		for (size_t i = 0; i != this->lanes.size(); ++i) {
+			if (i == size_t(drained.value())) {
+				continue;
+			}
+			const auto& l = this->lanes[i];
+			if (l.tail != &l.stub || l.tail->next.load(std::memory_order_relaxed)) {
+				return;
+			}
+		}
+	}
+
+	// the queue looks empty, reset the ready state and re-check for procedures which
+	// could have been pushed concurrently
+	if (this->clear_ready_to_read_state()) {
+		for (const auto& l : this->lanes) {
+			if (l.tail->next.load()) {
+				this->set_ready_to_read_state();
+				return;
+			}
+		}
+	}
+}
+
+size_t queue::num_procedures() const noexcept
+{
+	ASSERT(this->storage == kind::spin_lock)
+
+	size_t num = 0;
+	for (const auto& l : this->lanes) {
+		num += l.procedures.size();
+	}
+	return num;
+}
+
+bool queue::has_nodes() const noexcept
+{
+	ASSERT(this->storage == kind::lock_free)
+
+	for (const auto& l : this->lanes) {
+		if (l.tail != &l.stub || l.tail->next.load()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void queue::lane::push_nodes(node* first, node* last, size_t num) noexcept
+{
+	ASSERT(!last->next.load(std::memory_order_relaxed))
+
+	this->num_pushed.fetch_add(num, std::memory_order_relaxed);
+
+	node* prev = this->head.exchange(last, std::memory_order_acq_rel);
+
+	// NOTE: between the exchange above and the store below the list is disconnected,
+	//       the consumer will see the list ending at 'prev' until the store is done.
+	//       The store has to be sequentially consistent, see clear_ready_to_read_state().
+	prev->next.store(first);
+}
+
+queue::node* queue::lane::pop_node() noexcept
+{
+	node* t = this->tail;
+	node* next = t->next.load(std::memory_order_acquire);
+
+	if (t == &this->stub) {
+		if (!next) {
+			return nullptr;
+		}
+		this->tail = next;
+		t = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+
+	if (next) {
+		this->tail = next;
+		return t;
+	}
+
+	if (t != this->head.load(std::memory_order_acquire)) {
+		// some producer is in the middle of pushing a node right after 't'
+		return nullptr;
+	}
+
+	// 't' is the last node in the list, put the stub after it to be able to detach 't'
+	this->stub.next.store(nullptr, std::memory_order_relaxed);
+	node* prev = this->head.exchange(&this->stub, std::memory_order_acq_rel);
+	prev->next.store(&this->stub, std::memory_order_release);
+
+	next = t->next.load(std::memory_order_acquire);
+	if (next) {
+		this->tail = next;
+		return t;
+	}
+
+	return nullptr;
+}
+
+std::optional<size_t> queue::get_capacity() const noexcept
+{
+	if (!this->bound) {
+		return {};
+	}
+	return this->bound->capacity;
+}
+
+opros::waitable& queue::get_space_waitable()
+{
+	if (!this->bound) {
+		throw std::logic_error("queue::get_space_waitable(): the queue is unbounded");
+	}
+	return this->bound->space;
+}
+
+void queue::update_full_state()
+{
+	ASSERT(this->bound)
+	auto& b = *this->bound;
+
+	std::lock_guard<decltype(b.mut)> lock(b.mut);
+
+	// Set the hint before checking the size, while the consumer updates the size and then
+	// checks the hint. So, either this thread sees the new size or the consumer sees the hint.
+	b.is_full_hint.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	bool full = this->size() >= b.capacity;
+
+	if (full != b.is_full) {
+		b.is_full = full;
+		b.space.set_full(full);
+		if (!full) {
+			b.cond_var.notify_all();
+		}
+	}
+
+	b.is_full_hint.store(full, std::memory_order_relaxed);
+}
+
+void queue::on_popped()
+{
+	if (!this->bound) {
+		return;
+	}
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (this->bound->is_full_hint.load(std::memory_order_relaxed)) {
+		this->update_full_state();
 	}
-#elif CFG_OS == CFG_OS_MACOSX
+}
+
+bool queue::wait_for_space(std::optional<std::chrono::steady_clock::time_point> deadline)
+{
+	ASSERT(this->bound)
+	auto& b = *this->bound;
+
+	for (;;) {
+		this->update_full_state();
+
+		std::unique_lock<decltype(b.mut)> lock(b.mut);
+
+		if (!b.is_full) {
+			return true;
+		}
+
+		if (deadline.has_value()) {
+			if (b.cond_var.wait_until(lock, deadline.value()) == std::cv_status::timeout) {
+				return !b.is_full;
+			}
+		} else {
+			b.cond_var.wait(lock);
+		}
+
+		if (!b.is_full) {
+			return true;
+		}
+	}
+}
+
+void queue::prepare_waitable()
+{
+	// the flag is only changed by the consumer, i.e. by this thread
+	if (this->has_handle) {
+		return;
+	}
+
+	// producers do not use the kernel object until they see the has_handle flag set under the lock
+	this->create();
+
+	std::lock_guard<decltype(this->waitable_mut)> lock_guard(this->waitable_mut);
+
+	this->has_handle = true;
+
+	// carry the signalled state over from the doorbell to the kernel object,
+	// producers signal the waitable under the same lock, so the state cannot change meanwhile
+	if (this->doorbell.try_wait()) {
+		this->set();
+	}
+}
+
+bool queue::wait_ready(std::optional<uint32_t> timeout_ms)
+{
+	if (this->has_handle) {
+		throw std::logic_error("queue::wait_ready(): the queue's waitable is not lazy or is already prepared");
+	}
+
+	bool signalled = true;
+	if (timeout_ms.has_value()) {
+		signalled = this->doorbell.wait(timeout_ms.value());
+	} else {
+		this->doorbell.wait();
+	}
+
+	if (signalled) {
+		// Unlike waiting on the kernel object, waiting on the doorbell consumes the signal,
+		// put it back, it is reset along with the ready to read state.
+		this->doorbell.signal();
+	}
+
+	return signalled;
+}
+
+void queue::poke() noexcept
+{
+	// NOTE: the store has to be sequentially consistent, see announce_blocking()
+	this->poked.store(true);
+	this->set_ready_to_read_state();
+}
+
+void queue::announce_awake() noexcept
+{
+	if (this->consumer_awake) {
+		return;
+	}
+	this->consumer_awake = true;
+
+	if (!this->is_ready_to_read.exchange(true)) {
+		// the flag is held without signalling the waitable
+		this->awake_holds_ready_flag = true;
+		return;
+	}
+
+	// The waitable is signalled or is about to be signalled by the producer which has set the flag.
+	// If it is already signalled, reset it and hold the flag, otherwise leave the ready state as is,
+	// it will be taken over next time.
+	this->awake_holds_ready_flag = this->reset_waitable();
+}
+
+bool queue::announce_blocking() noexcept
+{
+	ASSERT(this->consumer_awake)
+
+	if (this->awake_holds_ready_flag) {
+		// no need to block if there is something to do
+		if (this->has_procedures_hint() || this->poked.exchange(false)) {
+			return false;
+		}
+
+		// Release the flag and re-check for procedures pushed while the flag was held.
+		// Producers add procedures to the queue and then check the flag, while here the flag is cleared
+		// and then the queue is checked, all these operations are sequentially consistent,
+		// so the procedures are either seen here or the producer signals the waitable.
+		// Same for poking.
+		bool has_work = false;
+		if (this->storage == kind::lock_free) {
+			this->is_ready_to_read.store(false);
+			has_work = this->has_nodes();
+		} else {
+			std::lock_guard<decltype(this->mut)> mutex_guard(this->mut);
+			this->is_ready_to_read.store(false);
+			has_work = this->num_procedures() != 0;
+		}
+		has_work = has_work || this->poked.exchange(false);
+
+		if (has_work && !this->is_ready_to_read.exchange(true)) {
+			// the flag is taken back before any producer has set it, stay awake
+			return false;
+		}
+
+		// otherwise, some producer is signalling the waitable, so waiting on it will not block
+	}
+
+	this->consumer_awake = false;
+	this->awake_holds_ready_flag = false;
+	return true;
+}
+
+queue::node* queue::new_node(procedure&& proc)
+{
+	if (this->pool) {
+		if (void* block = this->pool->allocate(sizeof(node))) {
+			return new (block) node{nullptr, std::move(proc), true};
+		}
+	}
+
+	// NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
+	return new node{nullptr, std::move(proc)};
+}
+
+void queue::delete_node(node* n) noexcept
+{
+	if (n->is_pooled) {
+		n->~node();
+		this->pool->deallocate(n, sizeof(node));
+	} else {
+		// NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
+		delete n;
+	}
+}
+
+bool queue::push(procedure& proc, priority prio)
+{
+	size_t new_size = 0;
+
+	auto& l = this->lanes[size_t(prio)];
+
+	if (this->stats) {
+		proc.set_push_time(std::chrono::steady_clock::now());
+	}
+
+	if (this->storage == kind::lock_free) {
+		if (this->bound && this->size() >= this->bound->capacity) {
+			return false;
+		}
+
+		auto n = this->new_node(std::move(proc));
+		l.push_nodes(n, n, 1);
+		this->set_ready_to_read_state();
+
+		if (this->bound || this->stats) {
+			new_size = this->size();
+		}
+	} else {
+		std::lock_guard<decltype(this->mut)> mutex_guard(this->mut);
+
+		new_size = this->num_procedures();
+
+		if (this->bound && new_size >= this->bound->capacity) {
+			return false;
+		}
+
+		l.procedures.push_back(std::move(proc));
+		l.num_pushed.store(l.num_pushed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		++new_size;
+
+		this->set_ready_to_read_state();
+	}
+
+	if (this->bound && new_size >= this->bound->capacity) {
+		this->update_full_state();
+	}
+
+	if (this->stats) {
+		this->update_max_depth(new_size);
+	}
+
+	return true;
+}
+
+size_t queue::get_room(size_t size) const noexcept
+{
+	if (!this->bound) {
+		return std::numeric_limits<size_t>::max();
+	}
+	if (size >= this->bound->capacity) {
+		return 0;
+	}
+	return this->bound->capacity - size;
+}
+
+void queue::push_back(procedure proc, priority prio)
+{
+	while (!this->push(proc, prio)) {
+		this->wait_for_space(std::nullopt);
+	}
+}
+
+bool queue::push_back(procedure&& proc, uint32_t timeout_ms, priority prio)
+{
+	if (!this->bound) {
+		this->push(proc, prio);
+		return true;
+	}
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+	while (!this->push(proc, prio)) {
+		if (!this->wait_for_space(deadline)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+cancellation_handle queue::push_cancellable(procedure proc, priority prio)
+{
+	auto [p, h] = cancellation_handle::make(std::move(proc), this->stats ? this->stats->cancellation : nullptr);
+	this->push_back(std::move(p), prio);
+	return std::move(h);
+}
+
+bool queue::push_coalesced(const void* key, procedure proc, coalescing policy, priority prio)
+{
+	std::call_once(this->coalescer_created, [this]() {
+		this->coalescer = std::make_shared<coalescing_state>();
+	});
+
+	auto& c = *this->coalescer;
+
+	// replaced procedure is destroyed outside of the lock
+	procedure replaced;
 	{
-		std::array<uint8_t, 1> one_byte_buf{};
-		// NOLINTNEXTLINE(clang-analyzer-unix.BlockInCriticalSection, "should not block")
-		if (read(this->handle, one_byte_buf.data(), 1) != 1) {
-			ASSERT(false)
+		std::lock_guard<decltype(c.mut)> lock_guard(c.mut);
+
+		auto i = c.pending.find(key);
+		if (i != c.pending.end()) {
+			if (policy == coalescing::replace) {
+				replaced = std::move(i->second);
+				i->second = std::move(proc);
+			}
+			if (this->stats) {
+				this->stats->num_coalesced.fetch_add(1, std::memory_order_relaxed);
+			}
+			return false;
 		}
+
+		c.pending.emplace(key, std::move(proc));
 	}
-#elif CFG_OS == CFG_OS_LINUX
+
+	static_assert(procedure::is_inline<coalesced_runner>, "coalesced procedure wrapper must not allocate");
+
+	// in case of exception the runner removes the pending entry
+	this->push_back(coalesced_runner(this->coalescer, key), prio);
+
+	return true;
+}
+
+bool queue::try_push_back(procedure&& proc, priority prio)
+{
+	if (this->push(proc, prio)) {
+		return true;
+	}
+
+	// make sure the space waitable reflects the full state
+	this->update_full_state();
+
+	return false;
+}
+
+procedure queue::pop_front()
+{
+	if (this->storage == kind::lock_free) {
+		node* n = nullptr;
+
+		auto prio = this->selector.select([this](priority p) {
+			return this->lanes[size_t(p)].size() != 0;
+		});
+		if (prio.has_value()) {
+			n = this->lanes[size_t(prio.value())].pop_node();
+		}
+
+		if (!n) {
+			// the counters can be inaccurate while procedures are being pushed, check all the lanes
+			for (auto i = this->lanes.rbegin(); i != this->lanes.rend(); ++i) {
+				n = i->pop_node();
+				if (n) {
+					prio = priority(std::distance(i, this->lanes.rend()) - 1);
+					break;
+				}
+			}
+		}
+
+		if (!n) {
+			this->clear_ready_to_read_state_if_empty(std::nullopt);
+			return nullptr;
+		}
+
+		auto& l = this->lanes[size_t(prio.value())];
+
+		node_ptr popped(n, node_deleter{this});
+		l.num_popped.store(l.num_popped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		auto ret = std::move(popped->proc);
+		this->on_popped();
+		return ret;
+	}
+
+	procedure ret;
+
 	{
-		eventfd_t value{};
-		if (eventfd_read(this->handle, &value) < 0) {
-			ASSERT(false)
+		std::lock_guard<decltype(this->mut)> mutex_guard(this->mut);
+
+		auto prio = this->selector.select([this](priority p) {
+			return !this->lanes[size_t(p)].procedures.empty();
+		});
+
+		if (!prio.has_value()) {
+			// the queue could have been poked
+			if (this->is_ready_to_read.load()) {
+				this->clear_ready_to_read_state();
+			}
+			return nullptr;
+		}
+
+		if (this->num_procedures() == 1) { // if we are taking away the last message from the queue
+			this->clear_ready_to_read_state();
 		}
-		ASSERT(value == 1)
+
+		auto& l = this->lanes[size_t(prio.value())];
+
+		ret = std::move(l.procedures.front());
+
+		l.procedures.pop_front();
+		l.num_popped.store(l.num_popped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
 	}
-#else
-#	error "Unsupported OS"
-#endif
 
-	this->is_ready_to_read = false;
+	this->on_popped();
+
+	return ret;
 }
 
-void queue::poke() noexcept
+void queue::pop_all(std::deque<procedure>& out)
 {
-	std::lock_guard<decltype(this->mut)> mutex_guard(this->mut);
+	if (this->storage == kind::lock_free) {
+		for (auto i = this->lanes.rbegin(); i != this->lanes.rend(); ++i) {
+			auto& l = *i;
+			size_t num_popped = l.num_popped.load(std::memory_order_relaxed);
+			while (node* n = l.pop_node()) {
+				node_ptr popped(n, node_deleter{this});
+				++num_popped;
+				out.push_back(std::move(popped->proc));
+			}
+			l.num_popped.store(num_popped, std::memory_order_relaxed);
+		}
 
-	this->set_ready_to_read_state();
+		this->clear_ready_to_read_state_if_empty(std::nullopt);
+	} else {
+		std::lock_guard<decltype(this->mut)> mutex_guard(this->mut);
+
+		for (auto i = this->lanes.rbegin(); i != this->lanes.rend(); ++i) {
+			auto& l = *i;
+			if (out.empty()) {
+				std::swap(out, l.procedures);
+			} else {
+				std::move(l.procedures.begin(), l.procedures.end(), std::back_inserter(out));
+				l.procedures.clear();
+			}
+			l.num_popped.store(l.num_pushed.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		}
+
+		if (this->is_ready_to_read.load()) {
+			this->clear_ready_to_read_state();
+		}
+	}
+
+	this->on_popped();
 }
 
-void queue::push_back(std::function<void()> proc)
+void queue::pop_all(std::array<std::deque<procedure>, num_priorities>& out)
 {
-	std::lock_guard<decltype(this->mut)> mutex_guard(this->mut);
+	if (this->storage == kind::lock_free) {
+		for (size_t i = 0; i != this->lanes.size(); ++i) {
+			auto& l = this->lanes[i];
+			size_t num_popped = l.num_popped.load(std::memory_order_relaxed);
+			while (node* n = l.pop_node()) {
+				node_ptr popped(n, node_deleter{this});
+				++num_popped;
+				out[i].push_back(std::move(popped->proc));
+			}
+			l.num_popped.store(num_popped, std::memory_order_relaxed);
+		}
 
-	this->procedures.push_back(std::move(proc));
+		this->clear_ready_to_read_state_if_empty(std::nullopt);
+	} else {
+		std::lock_guard<decltype(this->mut)> mutex_guard(this->mut);
 
-	this->set_ready_to_read_state();
+		for (size_t i = 0; i != this->lanes.size(); ++i) {
+			auto& l = this->lanes[i];
+			if (out[i].empty()) {
+				std::swap(out[i], l.procedures);
+			} else {
+				std::move(l.procedures.begin(), l.procedures.end(), std::back_inserter(out[i]));
+				l.procedures.clear();
+			}
+			l.num_popped.store(l.num_pushed.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		}
+
+		if (this->is_ready_to_read.load()) {
+			this->clear_ready_to_read_state();
+		}
+	}
+
+	this->on_popped();
 }
 
-std::function<void()> queue::pop_front()
+void queue::pop_all(std::deque<procedure>& out, priority prio)
 {
-	std::lock_guard<decltype(this->mut)> mutex_guard(this->mut);
+	auto& l = this->lanes[size_t(prio)];
 
-	if (this->procedures.empty()) {
-		return nullptr;
+	if (this->storage == kind::lock_free) {
+		size_t num_popped = l.num_popped.load(std::memory_order_relaxed);
+		while (node* n = l.pop_node()) {
+			node_ptr popped(n, node_deleter{this});
+			++num_popped;
+			out.push_back(std::move(popped->proc));
+		}
+		l.num_popped.store(num_popped, std::memory_order_relaxed);
+
+		this->clear_ready_to_read_state_if_empty(prio);
+	} else {
+		std::lock_guard<decltype(this->mut)> mutex_guard(this->mut);
+
+		if (out.empty()) {
+			std::swap(out, l.procedures);
+		} else {
+			std::move(l.procedures.begin(), l.procedures.end(), std::back_inserter(out));
+			l.procedures.clear();
+		}
+		l.num_popped.store(l.num_pushed.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+		if (this->is_ready_to_read.load() && this->num_procedures() == 0) {
+			this->clear_ready_to_read_state();
+		}
+	}
+
+	this->on_popped();
+}
+
+void queue::update_max_depth(size_t depth) noexcept
+{
+	ASSERT(this->stats)
+	depth = this->stats->get_depth(depth);
+	auto& max_depth = this->stats->max_depth;
+	auto cur = max_depth.load(std::memory_order_relaxed);
+	while (depth > cur) {
+		if (max_depth.compare_exchange_weak(cur, depth, std::memory_order_relaxed)) {
+			break;
+		}
+	}
+}
+
+bool queue::claim(procedure& proc) noexcept
+{
+	if (auto r = proc.target<cancellation_handle::runner>()) {
+		return r->claim();
+	}
+	return true;
+}
+
+void queue::record_latency_internal(const procedure& proc) noexcept
+{
+	ASSERT(this->stats)
+
+	auto push_time = proc.get_push_time();
+	if (push_time == std::chrono::steady_clock::time_point()) {
+		return;
 	}
 
-	if (this->procedures.size() == 1) { // if we are taking away the last message from the queue
-		this->clear_ready_to_read_state();
+	auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - push_time)
+					   .count();
+
+	auto bucket = std::min(log2_floor(uint64_t(std::max(decltype(latency)(1), latency))), num_latency_buckets - 1);
+
+	this->stats->latency_histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+queue::metrics queue::get_metrics() const
+{
+	if (!this->stats) {
+		throw std::logic_error("queue::get_metrics(): the queue does not collect metrics");
 	}
 
-	auto ret = std::move(this->procedures.front());
+	metrics ret;
 
-	this->procedures.pop_front();
+	for (const auto& l : this->lanes) {
+		// read popped counter first, so that the depth is not underestimated
+		ret.num_popped += l.num_popped.load(std::memory_order_relaxed);
+		ret.num_pushed += l.num_pushed.load(std::memory_order_relaxed);
+	}
+
+	ret.depth = this->stats->get_depth(ret.num_pushed >= ret.num_popped ? ret.num_pushed - ret.num_popped : 0);
+	ret.num_cancelled = size_t(this->stats->cancellation->num_cancelled.load(std::memory_order_relaxed));
+	ret.num_coalesced = this->stats->num_coalesced.load(std::memory_order_relaxed);
+	ret.max_depth = std::max(ret.depth, this->stats->max_depth.load(std::memory_order_relaxed));
+
+	for (size_t i = 0; i != ret.latency_histogram.size(); ++i) {
+		ret.latency_histogram[i] = this->stats->latency_histogram[i].load(std::memory_order_relaxed);
+	}
 
 	return ret;
 }
 
+std::chrono::nanoseconds queue::metrics::get_latency_percentile(double fraction) const noexcept
+{
+	uint64_t total = 0;
+	for (auto n : this->latency_histogram) {
+		total += n;
+	}
+	if (total == 0) {
+		return std::chrono::nanoseconds(0);
+	}
+
+	auto threshold = uint64_t(std::ceil(double(total) * std::clamp(fraction, 0.0, 1.0)));
+
+	uint64_t cumulative = 0;
+	size_t i = 0;
+	for (; i != this->latency_histogram.size() - 1; ++i) {
+		cumulative += this->latency_histogram[i];
+		if (cumulative >= threshold && cumulative != 0) {
+			break;
+		}
+	}
+
+	return std::chrono::nanoseconds(uint64_t(1) << (i + 1));
+}
+
 size_t queue::size() const noexcept
 {
+	if (this->storage == kind::lock_free) {
+		size_t num = 0;
+		for (const auto& l : this->lanes) {
+			num += l.size();
+		}
+		return num;
+	}
+
 	std::lock_guard<decltype(this->mut)> mutex_guard(this->mut);
 
-	return this->procedures.size();
+	return this->num_procedures();
 }
 
 #if CFG_OS == CFG_OS_WINDOWS
@@ -26,14 +26,27 @@ SOFTWARE.
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <deque>
-#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
 
 #include <opros/wait_set.hpp>
 #include <utki/config.hpp>
 #include <utki/debug.hpp>
 #include <utki/spin_lock.hpp>
 
+#include "cancellation_handle.hpp"
+#include "future.hpp"
+#include "procedure.hpp"
+#include "semaphore.hpp"
+#include "slab_pool.hpp"
+#include "util.hpp"
+#include "waitable_event.hpp"
+
 namespace nitki {
 
 /**
@@ -44,41 +57,356 @@ namespace nitki {
  * NOTE: queue implements waitable interface which means that it can be used in conjunction
  * with opros::wait_set. But, note, that the implementation of the waitable is that it
  * shall only be used to wait for read. If you are trying to wait for write the behavior will be
- * undefined.
+ * undefined. To wait until a bounded queue has room for more procedures use the waitable
+ * returned by queue::get_space_waitable().
  */
-class queue : public opros::waitable
+class queue : public waitable_event
 {
+public:
+	/**
+	 * @brief Queue storage implementation kind.
+	 */
+	enum class kind {
+		/**
+		 * @brief Procedures are stored in std::deque protected by spin lock.
+		 * Any number of threads can push and pop procedures.
+		 */
+		spin_lock,
+
+		/**
+		 * @brief Lock-free multi-producer/single-consumer list.
+		 * Procedures are stored in intrusive linked list nodes. Producers never take a lock,
+		 * neither against each other nor against the consumer.
+		 * Only one thread at a time is allowed to pop procedures from the queue.
+		 */
+		lock_free
+	};
+
+	/**
+	 * @brief Priority of a procedure.
+	 * Each priority has its own lane in the queue. Procedures of higher priority are
+	 * taken out of the queue before procedures of lower priority. Procedures of the same
+	 * priority are taken out of the queue in FIFO order.
+	 */
+	enum class priority {
+		low,
+		normal,
+		high,
+
+		enum_size
+	};
+
+	/**
+	 * @brief Number of priority lanes in the queue.
+	 */
+	constexpr static size_t num_priorities = size_t(priority::enum_size);
+
+	/**
+	 * @brief Default starvation limit.
+	 * See queue::parameters::starvation_limit.
+	 */
+	constexpr static unsigned default_starvation_limit = 32;
+
+	/**
+	 * @brief Selector of the priority lane to take next procedure from.
+	 * Higher priority lanes are served first. To avoid starvation of lower priority lanes,
+	 * a non-empty lane which has been skipped more than starvation limit times in a row
+	 * is served before higher priority lanes.
+	 */
+	class priority_selector
+	{
+		std::array<unsigned, num_priorities> num_skipped{};
+
+		unsigned starvation_limit;
+
+	public:
+		/**
+		 * @brief Constructor.
+		 * @param starvation_limit - starvation limit.
+		 */
+		priority_selector(unsigned starvation_limit) :
+			starvation_limit(starvation_limit)
+		{}
+
+		/**
+		 * @brief Select lane to serve.
+		 * @param has_procedures - function which tells if lane of given priority has procedures.
+		 * @return priority of the lane to serve.
+		 * @return empty std::optional if all lanes are empty.
+		 */
+		template <typename has_procedures_type>
+		std::optional<priority> select(const has_procedures_type& has_procedures) noexcept
+		{
+			std::optional<priority> highest;
+			std::optional<priority> starving;
+
+			for (size_t i = num_priorities; i != 0;) {
+				--i;
+				auto prio = priority(i);
+
+				if (!has_procedures(prio)) {
+					this->num_skipped[i] = 0;
+					continue;
+				}
+
+				if (!highest.has_value()) {
+					highest = prio;
+					continue;
+				}
+
+				++this->num_skipped[i];
+				if (!starving.has_value() && this->num_skipped[i] > this->starvation_limit) {
+					starving = prio;
+				}
+			}
+
+			auto selected = starving.has_value() ? starving : highest;
+			if (selected.has_value()) {
+				this->num_skipped[size_t(selected.value())] = 0;
+			}
+			return selected;
+		}
+	};
+
+	/**
+	 * @brief Policy of merging procedures pushed with push_coalesced().
+	 */
+	enum class coalescing {
+		/**
+		 * @brief The pending procedure is replaced by the new one.
+		 * The new procedure takes the place of the pending one in the queue.
+		 */
+		replace,
+
+		/**
+		 * @brief The pending procedure is kept and the new one is dropped.
+		 */
+		keep
+	};
+
+	/**
+	 * @brief Queue construction parameters.
+	 */
+	struct parameters {
+		/**
+		 * @brief Storage implementation to use.
+		 */
+		kind storage = kind::spin_lock;
+
+		/**
+		 * @brief Maximum number of procedures in the queue.
+		 * Empty std::optional means the queue is unbounded.
+		 * In case of kind::lock_free queue the capacity can be exceeded by
+		 * the number of threads pushing to the queue concurrently.
+		 */
+		std::optional<size_t> capacity;
+
+		/**
+		 * @brief Starvation limit for lower priority procedures.
+		 * When procedures are taken out of the queue one by one, a non-empty lower priority lane
+		 * is served after it has been skipped this number of times in favour of higher priority lanes.
+		 */
+		unsigned starvation_limit = default_starvation_limit;
+
+		/**
+		 * @brief Collect queue metrics.
+		 * See queue::get_metrics().
+		 */
+		bool collect_metrics = false;
+
+		/**
+		 * @brief Memory pool for the queued procedures.
+		 * If set, the queue nodes of the kind::lock_free queue, and the callable objects which
+		 * do not fit into the procedure inline buffer and are pushed as callable objects,
+		 * i.e. not wrapped into nitki::procedure by the caller, are allocated from the pool.
+		 * The pool can be shared by several queues. nullptr means the general purpose allocator is used.
+		 * The procedures taken out of the queue must be destroyed before the pool.
+		 */
+		std::shared_ptr<slab_pool> pool;
+
+		/**
+		 * @brief Create the queue's kernel object lazily.
+		 * The kernel object, e.g. eventfd on Linux, is needed to wait on the queue with opros::wait_set.
+		 * If set, the queue is constructed without the kernel object, and the consumer waits
+		 * on the queue with wait_ready(), which uses a futex based doorbell and does not involve
+		 * any system calls unless the consumer actually blocks. The kernel object is only created
+		 * by prepare_waitable(), which has to be called before adding the queue to an opros::wait_set.
+		 * loop_thread does it automatically when anything besides the queue is added to its wait_set.
+		 */
+		bool lazy_waitable = false;
+	};
+
+	/**
+	 * @brief Number of buckets in the latency histogram.
+	 */
+	constexpr static size_t num_latency_buckets = 40;
+
+	/**
+	 * @brief Snapshot of queue metrics.
+	 */
+	struct metrics {
+		/**
+		 * @brief Total number of procedures pushed to the queue.
+		 */
+		size_t num_pushed = 0;
+
+		/**
+		 * @brief Total number of procedures popped from the queue.
+		 */
+		size_t num_popped = 0;
+
+		/**
+		 * @brief Number of procedures in the queue.
+		 * Cancelled procedures are not counted, see queue::push_cancellable().
+		 */
+		size_t depth = 0;
+
+		/**
+		 * @brief Total number of cancelled procedures.
+		 */
+		size_t num_cancelled = 0;
+
+		/**
+		 * @brief Total number of procedures merged into pending ones by push_coalesced().
+		 */
+		size_t num_coalesced = 0;
+
+		/**
+		 * @brief Maximum number of procedures in the queue ever observed.
+		 */
+		size_t max_depth = 0;
+
+		/**
+		 * @brief Histogram of time from pushing a procedure to the queue to running it.
+		 * The bucket i counts the procedures with latency in range [2^i, 2^(i+1)) nanoseconds,
+		 * the bucket 0 also counts zero latencies, the last bucket also counts all greater latencies.
+		 */
+		std::array<uint64_t, num_latency_buckets> latency_histogram{};
+
+		/**
+		 * @brief Get latency percentile.
+		 * @param fraction - percentile as fraction, e.g. 0.99 for 99th percentile.
+		 * @return upper bound of the histogram bucket containing the percentile.
+		 * @return zero if the histogram is empty.
+		 */
+		std::chrono::nanoseconds get_latency_percentile(double fraction) const noexcept;
+	};
+
+private:
+	const kind storage;
+
+	// queue is ready to read if this flag is set, the flag is set by the one who
+	// has made the waitable signalled and cleared by the one who has reset it
+	alignas(cache_line_size) std::atomic_bool is_ready_to_read = false;
+
+	// guards kind::spin_lock storage
 	mutable utki::spin_lock mut;
 
-	bool is_ready_to_read = false;
+	// only accessed by the consumer, see announce_awake()
+	bool consumer_awake = false;
+	// whether the ready to read flag is held by the awake consumer while the waitable is not signalled
+	bool awake_holds_ready_flag = false;
 
-	std::deque<std::function<void()>> procedures;
+	// set by poke(), so that the poke is not lost if the ready to read flag is held by the awake consumer
+	std::atomic_bool poked = false;
 
-#if CFG_OS == CFG_OS_WINDOWS
-#elif CFG_OS == CFG_OS_MACOSX
-	// use pipe to implement waitable in *nix systems
-	// one end will be saved in waitable::handle
-	// and the other one in this member variable
-	int pipe_end;
-#elif CFG_OS == CFG_OS_LINUX
-#else
-#	error "Unsupported OS"
-#endif
+	// see parameters::lazy_waitable
+	const bool is_lazy_waitable;
 
-#if CFG_OS == CFG_OS_MACOSX
-	queue(std::array<int, 2> ends) :
-		opros::waitable(ends[0]),
-		pipe_end(ends[1])
-	{}
-#elif CFG_OS == CFG_OS_WINDOWS
-	queue(HANDLE handle) :
-		opros::waitable(handle)
-	{}
-#else
-	queue(int handle) :
-		opros::waitable(handle)
-	{}
-#endif
+	// guards creation of the kernel object of the lazily waitable queue and signalling its waitable
+	utki::spin_lock waitable_mut;
+
+	// whether the kernel object is created, only changed by the consumer under the waitable_mut
+	bool has_handle;
+
+	// signalled instead of the kernel object until it is created
+	nitki::semaphore doorbell;
+
+	// kind::lock_free storage list node
+	struct node {
+		std::atomic<node*> next = nullptr;
+		procedure proc;
+		bool is_pooled = false;
+	};
+
+	// memory pool for nodes and procedures, nullptr if not used
+	const std::shared_ptr<slab_pool> pool;
+
+	// pending procedures pushed with push_coalesced(), created on first use
+	struct coalescing_state;
+	std::shared_ptr<coalescing_state> coalescer;
+	std::once_flag coalescer_created;
+
+	// pushed to the queue in place of the procedures pushed with push_coalesced()
+	class coalesced_runner;
+
+	node* new_node(procedure&& proc);
+	void delete_node(node* n) noexcept;
+
+	struct node_deleter {
+		queue* owner;
+
+		void operator()(node* n) const noexcept
+		{
+			this->owner->delete_node(n);
+		}
+	};
+
+	using node_ptr = std::unique_ptr<node, node_deleter>;
+
+	// storage of procedures of single priority
+	struct lane {
+		// kind::spin_lock storage
+		std::deque<procedure> procedures;
+
+		// producer side of the kind::lock_free storage
+		alignas(cache_line_size) std::atomic<node*> head;
+		std::atomic_size_t num_pushed = 0;
+
+		// consumer side of the kind::lock_free storage
+		alignas(cache_line_size) node* tail;
+		std::atomic_size_t num_popped = 0;
+		node stub;
+
+		lane() :
+			head(&this->stub),
+			tail(&this->stub)
+		{}
+
+		lane(const lane&) = delete;
+		lane& operator=(const lane&) = delete;
+		lane(lane&&) = delete;
+		lane& operator=(lane&&) = delete;
+
+		~lane() = default;
+
+		// number of procedures in the lane, approximate if there are concurrent pushes or pops
+		size_t size() const noexcept
+		{
+			size_t popped = this->num_popped.load(std::memory_order_relaxed);
+			size_t pushed = this->num_pushed.load(std::memory_order_relaxed);
+			if (pushed < popped) {
+				return 0;
+			}
+			return pushed - popped;
+		}
+
+		void push_nodes(node* first, node* last, size_t num) noexcept;
+		node* pop_node() noexcept;
+	};
+
+	std::array<lane, num_priorities> lanes;
+
+	// chooses lane for pop_front(), guarded by mut in case of kind::spin_lock storage
+	priority_selector selector;
+
+	// state of the bounded queue, nullptr for unbounded queue
+	struct bound_state;
+	std::unique_ptr<bound_state> bound;
+
+	// metrics state, nullptr if metrics are not collected
+	struct metrics_state;
+	std::unique_ptr<metrics_state> stats;
 
 public:
 	queue(const queue&) = delete;
@@ -88,8 +416,17 @@ public:
 
 	/**
 	 * @brief Constructor, creates empty message queue.
+	 * The queue uses kind::spin_lock storage.
+	 */
+	queue() :
+		queue(parameters())
+	{}
+
+	/**
+	 * @brief Constructor, creates empty message queue.
+	 * @param params - queue parameters.
 	 */
-	queue();
+	queue(const parameters& params);
 
 	/**
 	 * @brief Destructor.
@@ -101,6 +438,129 @@ public:
 #endif
 		;
 
+	/**
+	 * @brief Get capacity of the queue.
+	 * @return capacity of the bounded queue.
+	 * @return empty std::optional if the queue is unbounded.
+	 */
+	std::optional<size_t> get_capacity() const noexcept;
+
+	/**
+	 * @brief Get waitable which reports free space in the bounded queue.
+	 * The returned waitable is ready to write when the queue has room for more procedures.
+	 * It is only allowed to wait for opros::ready::write on this waitable.
+	 * This allows a producer thread to wait for space in the queue within its opros::wait_set,
+	 * and then call try_push_back().
+	 * @return waitable for waiting for free space in the queue.
+	 * @throw std::logic_error - if the queue is unbounded.
+	 */
+	opros::waitable& get_space_waitable();
+
+	/**
+	 * @brief Check if the queue collects metrics.
+	 * @return true if the queue collects metrics.
+	 */
+	bool is_collecting_metrics() const noexcept
+	{
+		return bool(this->stats);
+	}
+
+	/**
+	 * @brief Get snapshot of the queue metrics.
+	 * Counters are read without locking the queue, so the values can be slightly
+	 * inconsistent with each other if there are concurrent pushes or pops.
+	 * Can be called from any thread.
+	 * @return snapshot of the metrics.
+	 * @throw std::logic_error - if the queue does not collect metrics.
+	 */
+	metrics get_metrics() const;
+
+	/**
+	 * @brief Record latency of the procedure into the queue metrics.
+	 * Should be called by the consumer right before running the procedure popped from the queue,
+	 * loop_thread does this automatically.
+	 * Does nothing if the queue does not collect metrics.
+	 * @param proc - the procedure popped from the queue.
+	 */
+	void record_latency(const procedure& proc) noexcept
+	{
+		if (this->stats) {
+			this->record_latency_internal(proc);
+		}
+	}
+
+	/**
+	 * @brief Claim the procedure popped from the queue for running.
+	 * Should be called by the consumer right before running the procedure popped from the queue,
+	 * loop_thread does this automatically. A cancellable procedure, see push_cancellable(),
+	 * cannot be cancelled after it is claimed.
+	 * The consumer can skip procedures which failed to be claimed, as running them does nothing,
+	 * and exclude them from its statistics, e.g. not record their latency.
+	 * @param proc - the procedure popped from the queue.
+	 * @return true if the procedure is to be run.
+	 * @return false if the procedure was cancelled.
+	 */
+	static bool claim(procedure& proc) noexcept;
+
+	/**
+	 * @brief Get memory pool of the queue.
+	 * See queue::parameters::pool.
+	 * @return the memory pool.
+	 * @return nullptr if the queue does not use memory pool.
+	 */
+	const std::shared_ptr<slab_pool>& get_pool() const noexcept
+	{
+		return this->pool;
+	}
+
+	/**
+	 * @brief Create procedure from callable object.
+	 * If the queue uses memory pool, the callable object which does not fit
+	 * into the procedure inline buffer is allocated from the pool.
+	 * @param func - callable object.
+	 * @return procedure holding the callable object.
+	 */
+	template <typename function_type>
+	procedure make_procedure(function_type&& func)
+	{
+		if (this->pool) {
+			return procedure(std::forward<function_type>(func), *this->pool);
+		}
+		return procedure(std::forward<function_type>(func));
+	}
+
+	/**
+	 * @brief Get storage kind of the queue.
+	 * @return storage kind the queue was constructed with.
+	 */
+	kind get_kind() const noexcept
+	{
+		return this->storage;
+	}
+
+	/**
+	 * @brief Create the kernel object of the lazily waitable queue.
+	 * See queue::parameters::lazy_waitable.
+	 * Must be called before adding the queue to an opros::wait_set.
+	 * Does nothing if the kernel object already exists.
+	 * Must only be called by the only consumer of the queue.
+	 * @throw std::system_error - if the kernel object could not be created.
+	 */
+	void prepare_waitable();
+
+	/**
+	 * @brief Wait for the lazily waitable queue to become ready to read.
+	 * The waiting does not involve the kernel object, see queue::parameters::lazy_waitable.
+	 * As with waiting on the queue's waitable, the consumer has to call announce_blocking()
+	 * before waiting, if it has announced being awake.
+	 * Must only be called by the only consumer of the queue.
+	 * @param timeout_ms - waiting timeout in milliseconds, empty std::optional means infinite.
+	 * @return true if the queue is ready to read.
+	 * @return false if the timeout was hit.
+	 * @throw std::logic_error - if the queue is not lazily waitable or prepare_waitable() was called.
+	 */
+	bool wait_ready(std::optional<uint32_t> timeout_ms);
+
 	/**
 	 * @brief Trigger the waitable ready to read.
 	 * This method triggers the waitable to be ready to read.
@@ -108,31 +568,366 @@ public:
 	 */
 	void poke() noexcept;
 
+	/**
+	 * @brief Announce that the consumer is awake and draining the queue.
+	 * While the consumer is awake, it holds the ready to read state of the queue, so that
+	 * producers do not signal the queue's waitable and popping procedures does not reset it.
+	 * This saves the system calls of signalling and resetting the waitable for each procedure
+	 * when procedures are pushed while the consumer is processing previous ones.
+	 * Before waiting on the queue's waitable the consumer has to call announce_blocking().
+	 * Does nothing if the consumer is already awake.
+	 * Must only be called by the only consumer of the queue.
+	 */
+	void announce_awake() noexcept;
+
+	/**
+	 * @brief Announce that the consumer is about to block waiting on the queue's waitable.
+	 * If there are procedures in the queue or the queue was poked while the consumer was awake,
+	 * then the consumer remains awake and shall not block, but process the procedures instead.
+	 * Otherwise, the ready to read state of the queue is released, so that producers signal
+	 * the queue's waitable again, and the consumer has to call announce_awake() after the waiting.
+	 * Must only be called by the only consumer of the queue after announce_awake().
+	 * @return true if the consumer can block waiting on the queue's waitable.
+	 * @return false if the consumer remains awake and shall not block.
+	 */
+	bool announce_blocking() noexcept;
+
+	/**
+	 * @brief Check if the queue has procedures, without resetting the ready to read state.
+	 * The check does not involve mutex acquisition and can give false positives
+	 * if there are concurrent pushes or pops. Intended for busy polling.
+	 * @return true if the queue seems to have procedures.
+	 */
+	bool has_procedures_hint() const noexcept
+	{
+		for (const auto& l : this->lanes) {
+			if (l.size() != 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
 	/**
 	 * @brief Pushes a new procedure to the end of the queue.
+	 * Any callable object, including std::function<void()>, can be passed as the procedure.
+	 * Callable objects which fit into the nitki::procedure inline buffer
+	 * are pushed without heap allocation of the callable object.
+	 * In case of bounded queue, this method blocks until there is room in the queue.
+	 * @param proc - the procedure to push into the queue.
+	 * @param prio - priority of the procedure.
+	 */
+	void push_back(procedure proc, priority prio = priority::normal);
+
+	/**
+	 * @brief Pushes a callable object to the end of the queue.
+	 * Same as push_back(procedure, priority), but the procedure is created with make_procedure(),
+	 * so that the callable object is allocated from the queue's memory pool, if any.
+	 * @param func - callable object to push into the queue.
+	 * @param prio - priority of the procedure.
+	 */
+	template <
+		typename function_type,
+		std::enable_if_t<
+			!std::is_same_v<std::decay_t<function_type>, procedure> &&
+				std::is_invocable_r_v<void, std::decay_t<function_type>&>,
+			bool> = true>
+	void push_back(function_type&& func, priority prio = priority::normal)
+	{
+		this->push_back(this->make_procedure(std::forward<function_type>(func)), prio);
+	}
+
+	/**
+	 * @brief Pushes a new procedure to the end of the queue, waits for room with timeout.
+	 * In case of bounded queue, if the queue is full, this method blocks until there is
+	 * room in the queue or until the timeout is hit.
+	 * In case of unbounded queue, this method is same as push_back(procedure).
+	 * @param proc - the procedure to push into the queue.
+	 *               The procedure is moved from only if it was pushed to the queue.
+	 * @param timeout_ms - waiting timeout in milliseconds.
+	 * @param prio - priority of the procedure.
+	 * @return true if the procedure was pushed to the queue.
+	 * @return false if the timeout was hit.
+	 */
+	bool push_back(procedure&& proc, uint32_t timeout_ms, priority prio = priority::normal);
+
+	/**
+	 * @brief Pushes a new procedure to the end of the queue if there is room.
+	 * Never blocks.
+	 * In case of unbounded queue, this method always succeeds.
+	 * @param proc - the procedure to push into the queue.
+	 *               The procedure is moved from only if it was pushed to the queue.
+	 * @param prio - priority of the procedure.
+	 * @return true if the procedure was pushed to the queue.
+	 * @return false if the queue is full.
+	 */
+	bool try_push_back(procedure&& proc, priority prio = priority::normal);
+
+	/**
+	 * @brief Pushes a cancellable procedure to the end of the queue.
+	 * Same as push_back(procedure, priority), but the procedure can be cancelled
+	 * with the returned handle as long as it has not started running.
+	 * Cancelled procedure stays in the queue until the consumer takes it out, but running it
+	 * does nothing, and the callable object is destroyed at the moment of cancellation.
+	 * Cancelled procedures still count towards the queue size and capacity,
+	 * but are not counted in the queue metrics depth.
+	 * @param proc - the procedure to push into the queue.
+	 * @param prio - priority of the procedure.
+	 * @return handle for cancelling the procedure.
+	 */
+	cancellation_handle push_cancellable(procedure proc, priority prio = priority::normal);
+
+	/**
+	 * @brief Pushes a procedure to the end of the queue, merging it with the pending one of the same key.
+	 * If a procedure pushed with the same key is still waiting in the queue, the new procedure does not
+	 * grow the queue. Instead, it replaces the pending one or is dropped, depending on the policy.
+	 * The procedure stays pending until the consumer starts running it, taking it out of the queue
+	 * with pop_front() or pop_all() does not end the pending state. Once the consumer has started
+	 * running the procedure, the next push with the same key pushes a new procedure.
+	 * In case of bounded queue, this method blocks until there is room in the queue,
+	 * unless the procedure was merged.
+	 * @param key - identity of the procedure, e.g. address of the object the procedure refreshes.
 	 * @param proc - the procedure to push into the queue.
+	 * @param policy - what to do if there is a pending procedure with the same key.
+	 * @param prio - priority of the procedure, ignored if the procedure is merged into the pending one.
+	 * @return true if the procedure was pushed to the queue.
+	 * @return false if the procedure was merged with the pending one.
+	 */
+	bool push_coalesced(
+		const void* key,
+		procedure proc,
+		coalescing policy = coalescing::replace,
+		priority prio = priority::normal
+	);
+
+	/**
+	 * @brief Pushes a function returning a result to the end of the queue.
+	 * The function is run by the consumer of the queue as a procedure and its result,
+	 * or the exception thrown by it, is passed to the returned future.
+	 * The function object and the future's shared state are stored in a single memory allocation.
+	 * If the procedure is destroyed without being run, e.g. because the queue is destroyed,
+	 * the future is completed with std::logic_error exception.
+	 * In case of bounded queue, this method blocks until there is room in the queue.
+	 * @param func - the function to run.
+	 * @param prio - priority of the procedure.
+	 * @return future result of the function.
+	 */
+	template <typename function_type>
+	future<future_value_t<function_type>> push_with_result(function_type&& func, priority prio = priority::normal)
+	{
+		auto [proc, f] = future<future_value_t<function_type>>::package(std::forward<function_type>(func));
+		this->push_back(std::move(proc), prio);
+		return std::move(f);
+	}
+
+	/**
+	 * @brief Pushes a range of procedures to the end of the queue.
+	 * All the procedures are appended to the queue at once, i.e. under single lock acquisition in case
+	 * of kind::spin_lock queue, or by single atomic operation in case of kind::lock_free queue.
+	 * The queue waitable is signalled at most once.
+	 * In case of bounded queue, the procedures are appended in chunks which fit into the free room of the queue,
+	 * waiting for room in between, so the capacity is not exceeded. If an exception is thrown,
+	 * the chunks appended before remain in the queue.
+	 * The procedures are moved out of the range.
+	 * @param begin - iterator to the first procedure of the range.
+	 * @param end - iterator to the end of the range.
+	 * @param prio - priority of the procedures.
 	 */
-	void push_back(std::function<void()> proc);
+	template <typename iterator_type>
+	void push_back(iterator_type begin, iterator_type end, priority prio = priority::normal)
+	{
+		while (begin != end) {
+			begin = this->push_range(begin, end, prio);
+			if (begin != end) {
+				// the bounded queue is full
+				this->wait_for_space(std::nullopt);
+			}
+		}
+	}
 
 	/**
 	 * @brief Get procedure from queue, does not block if no procedures queued.
-	 * This method gets a procedure from the front of the queue. If there are no procedures on the queue
-	 * it will return nullptr.
+	 * This method gets a procedure from the front of the highest priority non-empty lane of the queue,
+	 * unless some lower priority lane is starving, see queue::parameters::starvation_limit.
+	 * If there are no procedures on the queue it will return nullptr.
+	 * In case of kind::lock_free queue, this method must not be called concurrently from different threads.
 	 * @return procedure.
 	 * @return nullptr if there are no procedures in the queue.
 	 */
-	std::function<void()> pop_front();
+	procedure pop_front();
+
+	/**
+	 * @brief Get all procedures from the queue, does not block if no procedures queued.
+	 * This method moves all the procedures currently queued to the end of the given container.
+	 * Procedures of higher priority go first.
+	 * The ready to read state of the queue is cleared at most once per call.
+	 * In case of kind::spin_lock queue, the procedures are taken out under single lock acquisition,
+	 * and if the given container is empty then no procedures are moved, the containers are swapped instead.
+	 * In case of kind::lock_free queue, this method must not be called concurrently with other consuming methods.
+	 * @param out - container to append the procedures to.
+	 */
+	void pop_all(std::deque<procedure>& out);
+
+	/**
+	 * @brief Get all procedures from the queue sorted by priority, does not block if no procedures queued.
+	 * Same as pop_all(std::deque<procedure>&), but procedures of each priority are appended to
+	 * separate containers.
+	 * @param out - containers to append the procedures to, indexed by priority.
+	 */
+	void pop_all(std::array<std::deque<procedure>, num_priorities>& out);
+
+	/**
+	 * @brief Get all procedures of given priority from the queue, does not block if no procedures queued.
+	 * Same as pop_all(std::deque<procedure>&), but only takes procedures of the given priority.
+	 * @param out - container to append the procedures to.
+	 * @param prio - priority of the procedures to take.
+	 */
+	void pop_all(std::deque<procedure>& out, priority prio);
 
 	/**
 	 * @brief Get number of procedures in the queue.
-	 * This function involves mutex acquisition.
+	 * In case of kind::spin_lock queue this function involves mutex acquisition.
+	 * In case of kind::lock_free queue the returned value is approximate
+	 * if there are concurrent pushes or pops.
 	 * @return number of procedures in the queue.
 	 */
 	size_t size() const noexcept;
 
+	/**
+	 * @brief Get number of procedures of given priority in the queue.
+	 * This function does not involve mutex acquisition. The returned value is
+	 * approximate if there are concurrent pushes or pops.
+	 * @param prio - priority to get number of procedures for.
+	 * @return number of procedures of the given priority in the queue.
+	 */
+	size_t size(priority prio) const noexcept
+	{
+		return this->lanes[size_t(prio)].size();
+	}
+
 private:
 	void set_ready_to_read_state() noexcept;
-	void clear_ready_to_read_state() noexcept;
+	bool clear_ready_to_read_state() noexcept;
+	// resets the waitable, returns false if the waitable is not signalled
+	bool reset_waitable() noexcept;
+	// for kind::lock_free storage, called after all the nodes were popped from the 'drained' lane,
+	// or from all the lanes if 'drained' is empty
+	void clear_ready_to_read_state_if_empty(std::optional<priority> drained) noexcept;
+
+	// for kind::spin_lock storage, must be called under the lock
+	size_t num_procedures() const noexcept;
+
+	// for kind::lock_free storage, must be called by the consumer
+	bool has_nodes() const noexcept;
+
+	// returns false if the bounded queue is full
+	bool push(procedure& proc, priority prio);
+
+	// number of procedures which can be added to the queue of the given size without exceeding the capacity
+	size_t get_room(size_t size) const noexcept;
+
+	// pushes procedures from the range while there is room in the queue,
+	// returns iterator to the first procedure which was not pushed
+	template <typename iterator_type>
+	iterator_type push_range(iterator_type begin, iterator_type end, priority prio)
+	{
+		ASSERT(begin != end)
+
+		auto& l = this->lanes[size_t(prio)];
+
+		auto push_time = this->stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+		if (this->storage == kind::lock_free) {
+			size_t room = this->get_room(this->size());
+			if (room == 0) {
+				return begin;
+			}
+
+			// link all the nodes first and then put the whole chain to the list at once
+			node* first = this->new_node(procedure(std::move(*begin)));
+			first->proc.set_push_time(push_time);
+			++begin;
+			node* last = first;
+			size_t num = 1;
+			try {
+				for (; begin != end && num != room; ++begin) {
+					auto n = this->new_node(procedure(std::move(*begin)));
+					n->proc.set_push_time(push_time);
+					last->next.store(n, std::memory_order_relaxed);
+					last = n;
+					++num;
+				}
+			} catch (...) {
+				while (first) {
+					node_ptr n(first, node_deleter{this});
+					first = n->next.load(std::memory_order_relaxed);
+				}
+				throw;
+			}
+			l.push_nodes(first, last, num);
+			this->set_ready_to_read_state();
+			if (this->bound) {
+				this->update_full_state();
+			}
+			if (this->stats) {
+				this->update_max_depth(this->size());
+			}
+			return begin;
+		}
+
+		size_t new_size = 0;
+
+		{
+			std::lock_guard<decltype(this->mut)> mutex_guard(this->mut);
+
+			size_t room = this->get_room(this->num_procedures());
+
+			size_t old_size = l.procedures.size();
+			try {
+				for (; begin != end && l.procedures.size() - old_size != room; ++begin) {
+					l.procedures.emplace_back(std::move(*begin)).set_push_time(push_time);
+				}
+			} catch (...) {
+				l.procedures.resize(old_size);
+				throw;
+			}
+
+			size_t num = l.procedures.size() - old_size;
+			if (num == 0) {
+				return begin;
+			}
+
+			l.num_pushed.store(l.num_pushed.load(std::memory_order_relaxed) + num, std::memory_order_relaxed);
+
+			if (this->stats) {
+				new_size = this->num_procedures();
+			}
+
+			this->set_ready_to_read_state();
+		}
+
+		if (this->stats) {
+			this->update_max_depth(new_size);
+		}
+
+		if (this->bound) {
+			this->update_full_state();
+		}
+
+		return begin;
+	}
+
+	// for bounded queue, wait until the queue is not full,
+	// returns false if the deadline is hit
+	bool wait_for_space(std::optional<std::chrono::steady_clock::time_point> deadline);
+
+	// for bounded queue, update the full state according to actual queue size
+	void update_full_state();
+
+	void on_popped();
+
+	void update_max_depth(size_t depth) noexcept;
+	void record_latency_internal(const procedure& proc) noexcept;
 
 #if CFG_OS == CFG_OS_WINDOWS
 
@@ -32,16 +32,76 @@ SOFTWARE.
 #	include <cerrno>
 #	include <sys/time.h>
 #elif CFG_OS == CFG_OS_WINDOWS
+#	include <chrono>
 #	include <limits>
 #	include <sstream>
+#elif CFG_OS == CFG_OS_LINUX
+#	include <algorithm>
+#	include <climits>
+#	include <limits>
+#	include <thread>
+
+#	include <linux/futex.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
 #endif
 
 #include <utki/util.hpp>
 
+#include "util.hpp"
+
 using namespace nitki;
 
+#if CFG_OS == CFG_OS_LINUX
+namespace {
+static_assert(
+	sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && std::atomic<uint32_t>::is_always_lock_free,
+	"std::atomic<uint32_t> cannot be used as futex word"
+);
+
+constexpr uint32_t initial_spin_limit = 100;
+constexpr uint32_t max_spin_count = 400;
+
+const bool is_multi_core = std::thread::hardware_concurrency() > 1;
+
+long futex(std::atomic<uint32_t>* word, int op, uint32_t val, const timespec* timeout = nullptr)
+{
+	return syscall(
+		SYS_futex,
+		word,
+		op | FUTEX_PRIVATE_FLAG,
+		val,
+		timeout,
+		nullptr, // second futex word, not used
+		FUTEX_BITSET_MATCH_ANY
+	);
+}
+
+timespec monotonic_deadline(uint32_t timeout_ms)
+{
+	timespec ts{};
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		throw std::system_error(errno, std::generic_category(), "semaphore::wait(): clock_gettime() returned error");
+	}
+
+	ts.tv_sec += decltype(ts.tv_sec)(timeout_ms / std::milli::den);
+	ts.tv_nsec += decltype(ts.tv_nsec)(long(timeout_ms % std::milli::den) * std::micro::den);
+	ts.tv_sec += decltype(ts.tv_sec)(ts.tv_nsec / std::nano::den);
+	ts.tv_nsec = decltype(ts.tv_nsec)(ts.tv_nsec % std::nano::den);
+
+	return ts;
+}
+} // namespace
+#endif
+
 // NOLINTNEXTLINE(cppcoreguidelines-pro-type-member-init)
 semaphore::semaphore(unsigned initial_value)
+#if CFG_OS == CFG_OS_LINUX
+	:
+	v(initial_value),
+	spin_limit(initial_spin_limit)
+#endif
 {
 #if CFG_OS == CFG_OS_WINDOWS
 	using namespace std::string_literals;
@@ -62,7 +122,8 @@ semaphore::semaphore(unsigned initial_value)
 		pthread_mutex_destroy(&this->m);
 	}
 #elif CFG_OS == CFG_OS_LINUX
-	if (sem_init(&this->s, 0, initial_value) < 0)
+	// futex word needs no initialization
+	return;
 #else
 #	error "unknown OS"
 #endif
@@ -82,7 +143,7 @@ semaphore::~semaphore() noexcept
 	pthread_cond_destroy(&this->c);
 	pthread_mutex_destroy(&this->m);
 #elif CFG_OS == CFG_OS_LINUX
-	sem_destroy(&this->s);
+	ASSERT(this->num_waiters.load() == 0)
 #else
 #	error "unknown OS"
 #endif
@@ -90,33 +151,126 @@ semaphore::~semaphore() noexcept
 
 void semaphore::wait()
 {
-#if CFG_OS == CFG_OS_WINDOWS
-	switch (WaitForSingleObject(this->s, DWORD(INFINITE))) {
-		// NOLINTNEXTLINE(bugprone-branch-clone)
-		default:
-			[[fallthrough]];
-		// NOLINTNEXTLINE(bugprone-branch-clone)
-		case WAIT_TIMEOUT:
-			[[fallthrough]];
-		case WAIT_ABANDONED:
-			ASSERT(false)
-			[[fallthrough]];
-		case WAIT_OBJECT_0:
+	this->wait_permits(1);
+}
+
+bool semaphore::wait(uint32_t timeout_ms)
+{
+	return this->wait_permits(1, timeout_ms);
+}
+
+#if CFG_OS == CFG_OS_LINUX
+bool semaphore::spin(unsigned num)
+{
+	if (!is_multi_core) {
+		return false;
+	}
+
+	// adapt the spin limit towards the number of iterations it took to acquire the permits,
+	// similar to glibc's adaptive mutex
+	auto limit = this->spin_limit.load(std::memory_order_relaxed);
+	auto max_count = std::min(max_spin_count, limit * 2 + 10);
+
+	bool acquired = false;
+	uint32_t count = 0;
+	for (; count != max_count; ++count) {
+		cpu_relax();
+		if (this->v.load(std::memory_order_relaxed) >= num && this->try_wait(num)) {
+			acquired = true;
 			break;
-		case WAIT_FAILED:
-			throw std::system_error(
-				int(GetLastError()),
-				std::generic_category(),
-				"semaphore::wait(): WaitForSingleObject() failed"
-			);
+		}
+	}
+
+	this->spin_limit.store(uint32_t(int(limit) + (int(count) - int(limit)) / 8), std::memory_order_relaxed);
+
+	return acquired;
+}
+
+bool semaphore::wait_internal(unsigned num, const timespec* deadline)
+{
+	if (this->try_wait(num) || this->spin(num)) {
+		return true;
+	}
+
+	if (num > 1) {
+		this->num_multi_waiters.fetch_add(1);
+	}
+	this->num_waiters.fetch_add(1);
+
+	auto restore_counters = [this, num]() {
+		this->num_waiters.fetch_sub(1, std::memory_order_relaxed);
+		if (num > 1) {
+			this->num_multi_waiters.fetch_sub(1, std::memory_order_relaxed);
+		}
+	};
+
+	for (;;) {
+		// sequentially consistent, pairs with the signal()
+		auto value = this->v.load();
+		if (value >= num) {
+			if (this->v.compare_exchange_weak(value, value - num, std::memory_order_acquire)) {
+				restore_counters();
+				return true;
+			}
+			continue;
+		}
+
+		// the waiting is performed only if the futex word still equals to the value
+		if (futex(&this->v, FUTEX_WAIT_BITSET, value, deadline) != 0) {
+			switch (errno) {
+				case EAGAIN:
+					[[fallthrough]];
+				case EINTR:
+					continue;
+				case ETIMEDOUT:
+					restore_counters();
+					// the permits could have been added right at the timeout
+					return this->try_wait(num);
+				default:
+					restore_counters();
+					throw std::system_error(errno, std::generic_category(), "semaphore::wait(): futex() failed");
+			}
+		}
+	}
+}
+#endif
+
+void semaphore::wait_permits(unsigned num)
+{
+#if CFG_OS == CFG_OS_WINDOWS
+	for (unsigned i = 0; i != num; ++i) {
+		switch (WaitForSingleObject(this->s, DWORD(INFINITE))) {
+			// NOLINTNEXTLINE(bugprone-branch-clone)
+			default:
+				[[fallthrough]];
+			// NOLINTNEXTLINE(bugprone-branch-clone)
+			case WAIT_TIMEOUT:
+				[[fallthrough]];
+			case WAIT_ABANDONED:
+				ASSERT(false)
+				[[fallthrough]];
+			case WAIT_OBJECT_0:
+				break;
+			case WAIT_FAILED:
+				throw std::system_error(
+					int(GetLastError()),
+					std::generic_category(),
+					"semaphore::wait(): WaitForSingleObject() failed"
+				);
+		}
 	}
 #elif CFG_OS == CFG_OS_MACOSX
 	if (int error = pthread_mutex_lock(&this->m)) {
 		throw std::system_error(error, std::generic_category(), "semaphore::wait(): pthread_mutex_lock() failed");
 	}
 
-	if (this->v == 0) {
+	// see signal()
+	unsigned multi_waiter = num > 1 ? 1 : 0;
+	this->num_multi_waiters += multi_waiter;
+
+	while (this->v < num) {
 		if (int error = pthread_cond_wait(&this->c, &this->m)) {
+			this->num_multi_waiters -= multi_waiter;
 			if (pthread_mutex_unlock(&this->m) != 0) {
 				ASSERT(false)
 			}
@@ -124,39 +278,46 @@ void semaphore::wait()
 		}
 	}
 
-	--this->v;
+	this->num_multi_waiters -= multi_waiter;
+	this->v -= num;
 
 	if (pthread_mutex_unlock(&this->m) != 0) {
 		ASSERT(false)
 	}
 #elif CFG_OS == CFG_OS_LINUX
-	int res = 0;
-	for (;;) {
-		res = sem_wait(&this->s);
-		if ((res == -1 && errno == EINTR)) {
-			continue;
-		}
-		break;
-	}
-	if (res < 0) {
-		throw std::system_error(errno, std::generic_category(), "semaphore::wait(): sem_wait() failed");
-	}
+	this->wait_internal(num, nullptr);
 #else
 #	error "unknown OS"
 #endif
 }
 
-bool semaphore::wait(uint32_t timeout_ms)
+bool semaphore::wait_permits(unsigned num, uint32_t timeout_ms)
 {
 #if CFG_OS == CFG_OS_WINDOWS
 	static_assert(INFINITE == std::numeric_limits<DWORD>::max(), "error");
-	switch (WaitForSingleObject(this->s, DWORD(timeout_ms == INFINITE ? INFINITE - 1 : timeout_ms))) {
-		case WAIT_OBJECT_0:
-			return true;
-		case WAIT_TIMEOUT:
-			return false;
-		default:
-			throw std::system_error(int(GetLastError()), std::generic_category(), "semaphore::wait(): wait failed");
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	for (unsigned i = 0; i != num; ++i) {
+		auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+							 deadline - std::chrono::steady_clock::now()
+		)
+							 .count();
+		auto timeout = DWORD(std::max(decltype(remaining)(0), remaining));
+		switch (WaitForSingleObject(this->s, timeout == INFINITE ? INFINITE - 1 : timeout)) {
+			case WAIT_OBJECT_0:
+				break;
+			case WAIT_TIMEOUT:
+				// give back the taken permits
+				if (i != 0) {
+					this->signal(i);
+				}
+				return false;
+			default:
+				throw std::system_error(
+					int(GetLastError()),
+					std::generic_category(),
+					"semaphore::wait(): wait failed"
+				);
+		}
 	}
 #elif CFG_OS == CFG_OS_MACOSX
 	timeval tv{};
@@ -177,8 +338,13 @@ bool semaphore::wait(uint32_t timeout_ms)
 		throw std::system_error(error, std::generic_category(), "semaphore::wait(): failed to lock the mutex");
 	}
 
-	if (this->v == 0) {
+	// see signal()
+	unsigned multi_waiter = num > 1 ? 1 : 0;
+	this->num_multi_waiters += multi_waiter;
+
+	while (this->v < num) {
 		if (int error = pthread_cond_timedwait(&this->c, &this->m, &ts)) {
+			this->num_multi_waiters -= multi_waiter;
 			if (pthread_mutex_unlock(&this->m) != 0) {
 				utki::assert(false, SL);
 			}
@@ -197,56 +363,80 @@ bool semaphore::wait(uint32_t timeout_ms)
 		}
 	}
 
-	--this->v;
+	this->num_multi_waiters -= multi_waiter;
+	this->v -= num;
 
 	if (pthread_mutex_unlock(&this->m) != 0) {
 		ASSERT(false)
 	}
 #elif CFG_OS == CFG_OS_LINUX
-	// if timeout is 0 then use sem_trywait() to avoid unnecessary time calculation for sem_timedwait()
+	// if timeout is 0 then avoid unnecessary time calculation
 	if (timeout_ms == 0) {
-		if (sem_trywait(&this->s) == -1) {
-			if (errno == EAGAIN) {
+		return this->try_wait(num);
+	}
+
+	auto deadline = monotonic_deadline(timeout_ms);
+	return this->wait_internal(num, &deadline);
+#else
+#	error "unknown OS"
+#endif
+	return true;
+}
+
+bool semaphore::try_wait(unsigned num)
+{
+#if CFG_OS == CFG_OS_WINDOWS
+	for (unsigned i = 0; i != num; ++i) {
+		switch (WaitForSingleObject(this->s, 0)) {
+			case WAIT_OBJECT_0:
+				break;
+			case WAIT_TIMEOUT:
+				// give back the taken permits
+				if (i != 0) {
+					this->signal(i);
+				}
 				return false;
-			} else {
-				throw std::system_error(errno, std::generic_category(), "semaphore::wait(): sem_trywait() failed");
-			}
-		}
-	} else {
-		timespec ts{};
-
-		if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {
-			throw std::system_error(
-				errno,
-				std::generic_category(),
-				"semaphore::wait(): clock_gettime() returned error"
-			);
+			default:
+				throw std::system_error(
+					int(GetLastError()),
+					std::generic_category(),
+					"semaphore::try_wait(): wait failed"
+				);
 		}
+	}
+	return true;
+#elif CFG_OS == CFG_OS_MACOSX
+	if (int error = pthread_mutex_lock(&this->m)) {
+		throw std::system_error(error, std::generic_category(), "semaphore::try_wait(): failed to lock the mutex");
+	}
 
-		ts.tv_sec += decltype(ts.tv_sec)(timeout_ms / std::milli::den);
-		ts.tv_nsec += decltype(ts.tv_nsec)(long(timeout_ms % std::milli::den) * std::micro::den);
-		ts.tv_sec += decltype(ts.tv_sec)(ts.tv_nsec / std::nano::den);
-		ts.tv_nsec = decltype(ts.tv_nsec)(ts.tv_nsec % std::nano::den);
+	bool acquired = this->v >= num;
+	if (acquired) {
+		this->v -= num;
+	}
 
-		if (sem_timedwait(&this->s, &ts) == -1) {
-			if (errno == ETIMEDOUT) {
-				return false;
-			} else {
-				throw std::system_error(errno, std::generic_category(), "semaphore::wait(): sem_timedwait() failed");
-			}
+	if (pthread_mutex_unlock(&this->m) != 0) {
+		ASSERT(false)
+	}
+	return acquired;
+#elif CFG_OS == CFG_OS_LINUX
+	auto value = this->v.load(std::memory_order_relaxed);
+	while (value >= num) {
+		if (this->v.compare_exchange_weak(value, value - num, std::memory_order_acquire, std::memory_order_relaxed)) {
+			return true;
 		}
 	}
+	return false;
 #else
 #	error "unknown OS"
 #endif
-	return true;
 }
 
-void semaphore::signal()
+void semaphore::signal(unsigned num)
 {
 	//		TRACE(<< "semaphore::signal(): invoked" << std::endl)
 #if CFG_OS == CFG_OS_WINDOWS
-	if (ReleaseSemaphore(this->s, 1, nullptr) == 0) {
+	if (ReleaseSemaphore(this->s, LONG(num), nullptr) == 0) {
 		throw std::system_error(int(GetLastError()), std::generic_category(), "ReleaseSemaphore() failed");
 	}
 #elif CFG_OS == CFG_OS_MACOSX
@@ -254,23 +444,46 @@ void semaphore::signal()
 		throw std::system_error(error, std::generic_category(), "pthread_mutex_lock() failed");
 	}
 
-	if (this->v < std::uint32_t(-1)) {
-		++this->v;
-	} else {
-		throw std::logic_error("semaphore::signal(): semaphore value is already at maximum");
+	if (this->v > std::uint32_t(-1) - num) {
+		if (pthread_mutex_unlock(&this->m) != 0) {
+			ASSERT(false)
+		}
+		throw std::logic_error("semaphore::signal(): semaphore value would exceed maximum");
 	}
 
-	if (this->v - 1 == 0) {
-		// someone is waiting on the semaphore
+	this->v += num;
+
+	// A single wakeup could go to a multi-permit waiter which still cannot proceed, while a waiter
+	// which could proceed remains sleeping, so wake up all the waiters in case there are multi-permit ones.
+	// Also wake up all of them in case of several permits, as several waiters can proceed.
+	if (num == 1 && this->num_multi_waiters == 0) {
 		pthread_cond_signal(&this->c);
+	} else {
+		pthread_cond_broadcast(&this->c);
 	}
 
 	if (int error = pthread_mutex_unlock(&this->m)) {
 		throw std::system_error(error, std::generic_category(), "pthread_mutex_unlock() failed");
 	}
 #elif CFG_OS == CFG_OS_LINUX
-	if (sem_post(&this->s) < 0) {
-		throw std::system_error(errno, std::generic_category(), "sem_post() failed");
+	auto value = this->v.load(std::memory_order_relaxed);
+	do {
+		if (value > std::numeric_limits<uint32_t>::max() - num) {
+			throw std::logic_error("semaphore::signal(): semaphore value would exceed maximum");
+		}
+		// sequentially consistent, pairs with the waiter
+	} while (!this->v.compare_exchange_weak(value, value + num));
+
+	if (this->num_waiters.load() == 0) {
+		return;
+	}
+
+	// In case some waiter waits for several permits, wake up all the waiters, so that
+	// the waiters which cannot take the permits do not swallow the wake ups.
+	if (futex(&this->v, FUTEX_WAKE, this->num_multi_waiters.load() == 0 ? std::min(num, unsigned(INT_MAX)) : INT_MAX)
+		< 0)
+	{
+		throw std::system_error(errno, std::generic_category(), "semaphore::signal(): futex() failed");
 	}
 #else
 #	error "unknown OS"
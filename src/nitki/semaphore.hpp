@@ -33,8 +33,9 @@ SOFTWARE.
 #	include <utki/windows.hpp>
 
 #elif CFG_OS == CFG_OS_LINUX || CFG_OS == CFG_OS_UNIX
-#	include <semaphore.h>
+#	include <atomic>
 #	include <cerrno>
+#	include <ctime>
 
 #elif CFG_OS == CFG_OS_MACOSX
 #	include <pthread.h>
@@ -54,6 +55,9 @@ namespace nitki {
  * decrement it. If there are several threads waiting for semaphore decrement and
  * some other thread increments it then only one of the hanging threads will be
  * resumed, other threads will remain waiting for next increment.
+ * On Linux the semaphore is implemented with futex. Waiting threads spin for a short,
+ * adaptively adjusted, time before going to sleep, and waiting timeouts are measured
+ * by monotonic clock.
  */
 class semaphore
 {
@@ -64,8 +68,24 @@ class semaphore
 	pthread_mutex_t m;
 	pthread_cond_t c;
 	unsigned v; // current semaphore value
+
+	// number of threads waiting on the condition variable for more than one permit, guarded by the mutex
+	unsigned num_multi_waiters = 0;
 #elif CFG_OS == CFG_OS_LINUX
-	sem_t s;
+	// number of available permits, also used as the futex word
+	std::atomic<uint32_t> v;
+
+	// number of threads sleeping or about to sleep on the futex
+	std::atomic<uint32_t> num_waiters = 0;
+
+	// number of threads sleeping or about to sleep on the futex waiting for more than one permit
+	std::atomic<uint32_t> num_multi_waiters = 0;
+
+	// adaptively adjusted number of spinning iterations before going to sleep
+	std::atomic<uint32_t> spin_limit;
+
+	bool spin(unsigned num);
+	bool wait_internal(unsigned num, const timespec* deadline);
 #else
 #	error "unknown OS"
 #endif
@@ -106,11 +126,43 @@ public:
 	 */
 	bool wait(uint32_t timeout_ms);
 
+	/**
+	 * @brief Wait for several permits.
+	 * Decrements semaphore value by given number. If current value is less than the number,
+	 * then this method waits until other threads signal the semaphore enough.
+	 * On Windows the permits are taken one by one.
+	 * @param num - number of permits to take.
+	 */
+	void wait_permits(unsigned num);
+
+	/**
+	 * @brief Wait for several permits with timeout.
+	 * Decrements semaphore value by given number. If current value is less than the number,
+	 * then this method waits until other threads signal the semaphore enough or until the timeout is hit.
+	 * In case the timeout is hit, the semaphore value is not changed.
+	 * @param num - number of permits to take.
+	 * @param timeout_ms - waiting timeout.
+	 * @return true if the semaphore value was decremented.
+	 * @return false if the timeout was hit.
+	 */
+	bool wait_permits(unsigned num, uint32_t timeout_ms);
+
+	/**
+	 * @brief Try to take several permits without waiting.
+	 * Decrements semaphore value by given number if current value is not less than the number.
+	 * @param num - number of permits to take.
+	 * @return true if the semaphore value was decremented.
+	 * @return false if the semaphore value is less than the number.
+	 */
+	bool try_wait(unsigned num = 1);
+
 	/**
 	 * @brief Signal the semaphore.
-	 * Increments the semaphore value.
+	 * Increments the semaphore value by given number, waking up the waiting threads
+	 * with a single system call.
+	 * @param num - number of permits to add.
 	 */
-	void signal();
+	void signal(unsigned num = 1);
 };
 
 } // namespace nitki
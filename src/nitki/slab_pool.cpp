@@ -0,0 +1,517 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#include "slab_pool.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+
+#include <utki/debug.hpp>
+
+using namespace nitki;
+
+namespace {
+// approximate number of bytes in a batch of free blocks moved between a magazine and the shared free lists
+constexpr size_t batch_bytes = 4 * 1024;
+
+constexpr auto batch_sizes = []() {
+	std::array<size_t, slab_pool::block_sizes.size()> ret{};
+	for (size_t i = 0; i != ret.size(); ++i) {
+		ret[i] = std::max(batch_bytes / slab_pool::block_sizes[i], size_t(2));
+	}
+	return ret;
+}();
+
+// for counters only written by one thread
+template <typename value_type>
+void add(std::atomic<value_type>& counter, value_type value) noexcept
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+} // namespace
+
+struct slab_pool::magazine {
+	// the pool the magazine belongs to, set to nullptr when the pool is destroyed
+	std::atomic<slab_pool*> pool;
+
+	// serializes releasing the magazine on thread exit with the pool destruction
+	utki::spin_lock mut;
+
+	struct list {
+		free_block* head = nullptr;
+		size_t size = 0;
+	};
+
+	// Free blocks are taken from and returned to the loaded list, when the loaded list is full
+	// it becomes the previous list, which is either empty or full, so that whole batches are
+	// moved to and from the shared free lists without walking through the blocks.
+	struct class_lists {
+		list loaded;
+		list previous;
+	};
+
+	// only accessed by the owner thread
+	std::array<class_lists, block_sizes.size()> lists;
+
+	// Only written by the owner thread, so no read-modify-write operations are needed.
+	// Can be negative, if the thread deallocates blocks allocated by other threads.
+	std::array<std::atomic<ptrdiff_t>, block_sizes.size()> num_blocks_in_use;
+	std::atomic<uint64_t> num_allocations = 0;
+
+	magazine(slab_pool* pool) :
+		pool(pool)
+	{
+		for (auto& n : this->num_blocks_in_use) {
+			n.store(0, std::memory_order_relaxed);
+		}
+	}
+};
+
+slab_pool::slab_pool(const parameters& params) :
+	slab_size(params.slab_size),
+	max_num_slabs(params.slab_size == 0 ? 0 : params.max_footprint / params.slab_size)
+{
+	if (this->slab_size < max_block_size) {
+		throw std::invalid_argument("slab_pool::slab_pool(): slab size must not be less than max_block_size");
+	}
+	if (this->max_num_slabs == 0) {
+		throw std::invalid_argument("slab_pool::slab_pool(): maximum footprint must not be less than slab size");
+	}
+
+	this->slabs.reserve(this->max_num_slabs);
+}
+
+slab_pool::~slab_pool() noexcept
+{
+	decltype(this->magazines) ms;
+	{
+		std::lock_guard<decltype(this->magazines_mut)> lock_guard(this->magazines_mut);
+		ms = std::move(this->magazines);
+	}
+
+#ifdef DEBUG
+	std::array<ptrdiff_t, block_sizes.size()> num_blocks_in_use{};
+#endif
+
+	// detach the magazines of the threads which are still running,
+	// the blocks in the magazines are released together with the slabs
+	for (auto& m : ms) {
+		std::lock_guard<decltype(m->mut)> lock_guard(m->mut);
+		m->pool.store(nullptr, std::memory_order_release);
+
+#ifdef DEBUG
+		for (size_t i = 0; i != num_blocks_in_use.size(); ++i) {
+			num_blocks_in_use[i] += m->num_blocks_in_use[i].load(std::memory_order_relaxed);
+		}
+#endif
+	}
+
+#ifdef DEBUG
+	// the magazines released by exiting threads are added to the size class counters
+	for (size_t i = 0; i != this->classes.size(); ++i) {
+		num_blocks_in_use[i] += this->classes[i].num_blocks_in_use;
+	}
+	for (auto n : num_blocks_in_use) {
+		ASSERT(n == 0, [](auto& o) {
+			o << "slab_pool::~slab_pool(): not all the blocks were returned to the pool";
+		})
+	}
+#endif
+
+	for (auto s : this->slabs) {
+		::operator delete(s, std::align_val_t(alignof(std::max_align_t)));
+	}
+}
+size_t slab_pool::get_size_class_index(size_t size) noexcept
+{
+	ASSERT(size <= max_block_size)
+	auto i = std::lower_bound(block_sizes.begin(), block_sizes.end(), size);
+	return size_t(std::distance(block_sizes.begin(), i));
+}
+
+void* slab_pool::reserve_slab() noexcept
+{
+	std::lock_guard<decltype(this->slabs_mut)> lock_guard(this->slabs_mut);
+
+	if (this->slabs.size() == this->max_num_slabs) {
+		return nullptr;
+	}
+
+	void* s = ::operator new(this->slab_size, std::align_val_t(alignof(std::max_align_t)), std::nothrow);
+	if (!s) {
+		return nullptr;
+	}
+
+	// capacity is reserved in constructor, so it does not throw
+	this->slabs.push_back(s);
+
+	return s;
+}
+
+slab_pool::magazine* slab_pool::get_magazine() noexcept
+{
+	// magazines of the current thread in all the pools it uses
+	struct thread_magazines {
+		std::vector<std::shared_ptr<magazine>> magazines;
+
+		// the most recently used magazine, in most cases the thread uses just one pool
+		magazine* last = nullptr;
+
+		thread_magazines() = default;
+
+		thread_magazines(const thread_magazines&) = delete;
+		thread_magazines& operator=(const thread_magazines&) = delete;
+		thread_magazines(thread_magazines&&) = delete;
+		thread_magazines& operator=(thread_magazines&&) = delete;
+
+		~thread_magazines()
+		{
+			for (auto& m : this->magazines) {
+				std::lock_guard<decltype(m->mut)> lock_guard(m->mut);
+				if (auto p = m->pool.load(std::memory_order_acquire)) {
+					p->release_magazine(*m);
+				}
+			}
+		}
+	};
+
+	thread_local thread_magazines tm;
+
+	if (tm.last && tm.last->pool.load(std::memory_order_acquire) == this) {
+		return tm.last;
+	}
+	tm.last = nullptr;
+
+	for (auto i = tm.magazines.begin(); i != tm.magazines.end();) {
+		auto p = (*i)->pool.load(std::memory_order_acquire);
+		if (p == this) {
+			tm.last = i->get();
+			return tm.last;
+		}
+		if (!p) {
+			// the pool is destroyed
+			i = tm.magazines.erase(i);
+			continue;
+		}
+		++i;
+	}
+
+	try {
+		auto m = std::make_shared<magazine>(this);
+
+		// reserve, so that adding the magazine to the thread's list after adding it to the pool does not throw
+		tm.magazines.reserve(tm.magazines.size() + 1);
+		{
+			std::lock_guard<decltype(this->magazines_mut)> lock_guard(this->magazines_mut);
+			this->magazines.push_back(m);
+		}
+		tm.magazines.push_back(m);
+
+		tm.last = m.get();
+		return tm.last;
+	} catch (...) {
+		// fall back to the shared free lists
+		return nullptr;
+	}
+}
+
+void slab_pool::release_magazine(magazine& m) noexcept
+{
+	std::lock_guard<decltype(this->magazines_mut)> lock_guard(this->magazines_mut);
+
+	for (size_t i = 0; i != this->classes.size(); ++i) {
+		auto& c = this->classes[i];
+
+		std::lock_guard<decltype(c.mut)> class_lock_guard(c.mut);
+
+		for (auto l : {&m.lists[i].loaded, &m.lists[i].previous}) {
+			while (l->head) {
+				auto b = l->head;
+				l->head = b->next;
+				b->next = c.free_list;
+				c.free_list = b;
+			}
+			l->size = 0;
+		}
+
+		c.num_blocks_in_use += m.num_blocks_in_use[i].load(std::memory_order_relaxed);
+		m.num_blocks_in_use[i].store(0, std::memory_order_relaxed);
+	}
+
+	this->num_allocations.fetch_add(m.num_allocations.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	m.num_allocations.store(0, std::memory_order_relaxed);
+
+	// the magazine is not in the list if the pool is being destroyed, the destructor waits for it to be released
+	auto i = std::find_if(this->magazines.begin(), this->magazines.end(), [&m](const auto& p) {
+		return p.get() == &m;
+	});
+	if (i != this->magazines.end()) {
+		this->magazines.erase(i);
+	}
+
+	m.pool.store(nullptr, std::memory_order_relaxed);
+}
+
+void slab_pool::refill(magazine& m, size_t index) noexcept
+{
+	auto& c = this->classes[index];
+	auto& l = m.lists[index].loaded;
+
+	size_t block_size = block_sizes[index];
+	size_t batch_size = batch_sizes[index];
+
+	ASSERT(!l.head && l.size == 0)
+	ASSERT(!m.lists[index].previous.head)
+
+	std::lock_guard<decltype(c.mut)> lock_guard(c.mut);
+
+	if (c.full_batches) {
+		l.head = c.full_batches;
+		l.size = batch_size;
+		c.full_batches = c.full_batches->next_batch;
+		return;
+	}
+
+	for (; l.size != batch_size && c.free_list; ++l.size) {
+		auto b = c.free_list;
+		c.free_list = b->next;
+		b->next = l.head;
+		l.head = b;
+	}
+
+	if (l.size != 0) {
+		return;
+	}
+
+	if (size_t(c.slab_end - c.slab_cur) < block_size) {
+		// the rest of the current slab, if any, is too small for a block and is left unused
+		auto s = static_cast<std::byte*>(this->reserve_slab());
+		if (!s) {
+			return;
+		}
+		c.slab_cur = s;
+		c.slab_end = s + this->slab_size;
+	}
+
+	for (; l.size != batch_size && size_t(c.slab_end - c.slab_cur) >= block_size; ++l.size) {
+		l.head = new (c.slab_cur) free_block{l.head, nullptr};
+		c.slab_cur += block_size;
+	}
+}
+
+void slab_pool::flush(magazine& m, size_t index) noexcept
+{
+	auto& c = this->classes[index];
+	auto& l = m.lists[index].previous;
+
+	ASSERT(l.size == batch_sizes[index])
+
+	std::lock_guard<decltype(c.mut)> lock_guard(c.mut);
+
+	l.head->next_batch = c.full_batches;
+	c.full_batches = l.head;
+
+	l = {};
+}
+
+void* slab_pool::allocate_shared(size_t index) noexcept
+{
+	auto& c = this->classes[index];
+
+	void* ret = nullptr;
+	{
+		std::lock_guard<decltype(c.mut)> lock_guard(c.mut);
+
+		if (!c.free_list && c.full_batches) {
+			// break the batch up into single blocks
+			c.free_list = c.full_batches;
+			c.full_batches = c.full_batches->next_batch;
+		}
+
+		if (c.free_list) {
+			ret = c.free_list;
+			c.free_list = c.free_list->next;
+		} else {
+			size_t block_size = block_sizes[index];
+
+			if (size_t(c.slab_end - c.slab_cur) < block_size) {
+				// the rest of the current slab, if any, is too small for a block and is left unused
+				auto s = static_cast<std::byte*>(this->reserve_slab());
+				if (s) {
+					c.slab_cur = s;
+					c.slab_end = s + this->slab_size;
+				}
+			}
+
+			if (size_t(c.slab_end - c.slab_cur) >= block_size) {
+				ret = c.slab_cur;
+				c.slab_cur += block_size;
+			}
+		}
+
+		if (ret) {
+			++c.num_blocks_in_use;
+		}
+	}
+
+	if (ret) {
+		this->num_allocations.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	return ret;
+}
+
+void slab_pool::deallocate_shared(void* block, size_t index) noexcept
+{
+	auto& c = this->classes[index];
+
+	std::lock_guard<decltype(c.mut)> lock_guard(c.mut);
+
+	--c.num_blocks_in_use;
+
+	auto b = new (block) free_block{c.free_list, nullptr};
+	c.free_list = b;
+}
+
+void* slab_pool::allocate(size_t size) noexcept
+{
+	if (size > max_block_size) {
+		this->num_fallbacks.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	size_t index = get_size_class_index(size);
+
+	void* ret = nullptr;
+
+	if (auto m = this->get_magazine()) {
+		auto& ml = m->lists[index];
+		auto& l = ml.loaded;
+		if (!l.head) {
+			if (ml.previous.head) {
+				std::swap(l, ml.previous);
+			} else {
+				this->refill(*m, index);
+			}
+		}
+		if (l.head) {
+			ret = l.head;
+			l.head = l.head->next;
+			--l.size;
+
+			add(m->num_blocks_in_use[index], ptrdiff_t(1));
+			add(m->num_allocations, uint64_t(1));
+		}
+	} else {
+		ret = this->allocate_shared(index);
+	}
+
+	if (!ret) {
+		this->num_fallbacks.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	return ret;
+}
+
+void slab_pool::deallocate(void* block, size_t size) noexcept
+{
+	ASSERT(block)
+
+	size_t index = get_size_class_index(size);
+
+	auto m = this->get_magazine();
+	if (!m) {
+		this->deallocate_shared(block, index);
+		return;
+	}
+
+	auto& ml = m->lists[index];
+	auto& l = ml.loaded;
+
+	if (l.size == batch_sizes[index]) {
+		if (ml.previous.head) {
+			this->flush(*m, index);
+		}
+		ml.previous = l;
+		l = {};
+	}
+
+	l.head = new (block) free_block{l.head, nullptr};
+	++l.size;
+
+	add(m->num_blocks_in_use[index], ptrdiff_t(-1));
+}
+
+slab_pool::stats slab_pool::get_stats() const noexcept
+{
+	stats ret;
+
+	{
+		std::lock_guard<decltype(this->slabs_mut)> lock_guard(this->slabs_mut);
+		ret.num_slabs = this->slabs.size();
+	}
+	ret.footprint = ret.num_slabs * this->slab_size;
+	ret.max_footprint = this->max_num_slabs * this->slab_size;
+
+	uint64_t num_allocs = 0;
+	ptrdiff_t num_blocks = 0;
+	ptrdiff_t num_bytes = 0;
+	{
+		// magazines are released under this lock, so their blocks are counted once
+		std::lock_guard<decltype(this->magazines_mut)> lock_guard(this->magazines_mut);
+
+		for (size_t i = 0; i != this->classes.size(); ++i) {
+			auto& c = this->classes[i];
+
+			ptrdiff_t n = 0;
+			{
+				std::lock_guard<decltype(c.mut)> class_lock_guard(c.mut);
+				n = c.num_blocks_in_use;
+			}
+			for (const auto& m : this->magazines) {
+				n += m->num_blocks_in_use[i].load(std::memory_order_relaxed);
+			}
+
+			num_blocks += n;
+			num_bytes += n * ptrdiff_t(block_sizes[i]);
+		}
+
+		for (const auto& m : this->magazines) {
+			num_allocs += m->num_allocations.load(std::memory_order_relaxed);
+		}
+		num_allocs += this->num_allocations.load(std::memory_order_relaxed);
+	}
+
+	// counters of different threads are not read at once, so the sums can be off while the pool is in use
+	ret.num_blocks_in_use = size_t(std::max(num_blocks, ptrdiff_t(0)));
+	ret.bytes_in_use = size_t(std::max(num_bytes, ptrdiff_t(0)));
+	ret.num_allocations = num_allocs;
+	ret.num_fallbacks = this->num_fallbacks.load(std::memory_order_relaxed);
+
+	return ret;
+}
@@ -0,0 +1,268 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <utki/spin_lock.hpp>
+
+#include "util.hpp"
+
+namespace nitki {
+
+/**
+ * @brief Thread-safe pool of fixed size memory blocks.
+ * The memory is reserved from the system in big chunks, slabs, each slab is carved
+ * into blocks of single size class. Freed blocks are kept in a free list of its size class
+ * and are reused by subsequent allocations, so the memory is never returned to the system
+ * until the pool is destroyed.
+ * Each thread using the pool has its own magazine of free blocks per size class, so that
+ * most allocations and deallocations do not touch the shared free lists. Blocks are moved between
+ * the magazine and the shared free list in batches, so the blocks deallocated by one thread,
+ * e.g. the consumer of a queue, are returned to the shared free list and reused by another thread,
+ * e.g. the producer. Magazine of the exited thread is returned to the shared free lists.
+ * The number of slabs is limited, so the memory footprint of the pool is bounded.
+ * When the request cannot be served from the pool, i.e. the requested size is greater
+ * than the maximum block size or the footprint limit is reached, the allocate() returns nullptr
+ * and the caller is supposed to fall back to the general purpose allocator.
+ *
+ * Intended for use with nitki::queue, see nitki::queue::parameters::pool,
+ * so that the memory for the queued procedures, released by the consumer after running
+ * the procedures, is reused by the producers.
+ *
+ * All the blocks must be deallocated before the pool is destroyed.
+ * Blocks are aligned to alignof(std::max_align_t).
+ */
+class slab_pool
+{
+public:
+	/**
+	 * @brief Block sizes of the size classes.
+	 * The request is served from the smallest size class with big enough blocks.
+	 */
+	constexpr static std::array<size_t, 11> block_sizes = {32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+
+	/**
+	 * @brief Maximum size of memory block which can be allocated from the pool.
+	 */
+	constexpr static size_t max_block_size = block_sizes.back();
+
+	/**
+	 * @brief Default slab size in bytes.
+	 */
+	constexpr static size_t default_slab_size = 64 * 1024;
+
+	/**
+	 * @brief Default maximum memory footprint of the pool in bytes.
+	 */
+	constexpr static size_t default_max_footprint = 1024 * 1024;
+
+	/**
+	 * @brief Pool construction parameters.
+	 */
+	struct parameters {
+		/**
+		 * @brief Size of the memory chunk reserved from the system at once.
+		 * Must not be less than slab_pool::max_block_size.
+		 */
+		size_t slab_size = default_slab_size;
+
+		/**
+		 * @brief Maximum number of bytes reserved by the pool.
+		 * Rounded down to the whole number of slabs. Must not be less than slab_size.
+		 */
+		size_t max_footprint = default_max_footprint;
+	};
+
+	/**
+	 * @brief Snapshot of the pool usage statistics.
+	 */
+	struct stats {
+		/**
+		 * @brief Number of slabs reserved from the system.
+		 */
+		size_t num_slabs = 0;
+
+		/**
+		 * @brief Number of bytes reserved from the system.
+		 */
+		size_t footprint = 0;
+
+		/**
+		 * @brief Maximum number of bytes the pool is allowed to reserve.
+		 */
+		size_t max_footprint = 0;
+
+		/**
+		 * @brief Number of blocks currently allocated from the pool.
+		 */
+		size_t num_blocks_in_use = 0;
+
+		/**
+		 * @brief Number of bytes in the blocks currently allocated from the pool.
+		 */
+		size_t bytes_in_use = 0;
+
+		/**
+		 * @brief Total number of allocations served by the pool.
+		 */
+		uint64_t num_allocations = 0;
+
+		/**
+		 * @brief Total number of allocation requests which could not be served by the pool.
+		 */
+		uint64_t num_fallbacks = 0;
+	};
+
+private:
+	const size_t slab_size;
+	const size_t max_num_slabs;
+
+	// guards slabs
+	mutable utki::spin_lock slabs_mut;
+	// memory of the reserved slabs, capacity is reserved upfront so that adding a slab does not throw
+	std::vector<void*> slabs;
+
+	struct free_block {
+		free_block* next;
+
+		// links batches of blocks, only used in the first block of the batch
+		free_block* next_batch;
+	};
+
+	struct size_class {
+		alignas(cache_line_size) mutable utki::spin_lock mut;
+
+		// blocks returned to the pool
+		free_block* free_list = nullptr;
+
+		// full batches of blocks returned to the pool by the thread magazines
+		free_block* full_batches = nullptr;
+
+		// not yet used part of the last slab of this size class
+		std::byte* slab_cur = nullptr;
+		std::byte* slab_end = nullptr;
+
+		// Blocks allocated minus blocks deallocated through the shared free list and the magazines
+		// of exited threads. Can be negative, if the blocks were allocated by a thread which is still running.
+		ptrdiff_t num_blocks_in_use = 0;
+	};
+
+	std::array<size_class, block_sizes.size()> classes;
+
+	// per-thread cache of free blocks, defined in the .cpp file
+	struct magazine;
+
+	// guards magazines
+	mutable utki::spin_lock magazines_mut;
+	// magazines of the threads using the pool
+	std::vector<std::shared_ptr<magazine>> magazines;
+
+	// allocations made through the shared free lists and by the exited threads
+	alignas(cache_line_size) std::atomic<uint64_t> num_allocations = 0;
+	std::atomic<uint64_t> num_fallbacks = 0;
+
+	static size_t get_size_class_index(size_t size) noexcept;
+
+	void* reserve_slab() noexcept;
+
+	// get magazine of the current thread, creates it on first use,
+	// returns nullptr if the magazine could not be created
+	magazine* get_magazine() noexcept;
+
+	// move free blocks of the magazine to the shared free lists, called on thread exit
+	void release_magazine(magazine& m) noexcept;
+
+	// move a batch of free blocks from the shared free lists to the empty magazine
+	void refill(magazine& m, size_t index) noexcept;
+
+	// move the full batch of free blocks from the magazine to the shared free lists
+	void flush(magazine& m, size_t index) noexcept;
+
+	void* allocate_shared(size_t index) noexcept;
+	void deallocate_shared(void* block, size_t index) noexcept;
+
+public:
+	slab_pool(const slab_pool&) = delete;
+	slab_pool& operator=(const slab_pool&) = delete;
+	slab_pool(slab_pool&&) = delete;
+	slab_pool& operator=(slab_pool&&) = delete;
+
+	/**
+	 * @brief Constructor, creates pool with default parameters.
+	 */
+	slab_pool() :
+		slab_pool(parameters())
+	{}
+
+	/**
+	 * @brief Constructor.
+	 * No memory is reserved for slabs until the first allocation.
+	 * @param params - pool parameters.
+	 * @throw std::invalid_argument - if the slab size is less than max_block_size
+	 *                                or the maximum footprint is less than the slab size.
+	 */
+	slab_pool(const parameters& params);
+
+	/**
+	 * @brief Destructor.
+	 * Releases all the slabs to the system.
+	 */
+	~slab_pool() noexcept;
+
+	/**
+	 * @brief Allocate memory block.
+	 * Thread-safe.
+	 * @param size - required size of the block in bytes.
+	 * @return pointer to the allocated block.
+	 * @return nullptr if the block cannot be allocated from the pool.
+	 */
+	void* allocate(size_t size) noexcept;
+
+	/**
+	 * @brief Return memory block to the pool.
+	 * Thread-safe, the block can be deallocated from a thread different from the one
+	 * which has allocated it.
+	 * @param block - pointer to the block previously returned by allocate().
+	 * @param size - size of the block, must be same as was passed to allocate().
+	 */
+	void deallocate(void* block, size_t size) noexcept;
+
+	/**
+	 * @brief Get snapshot of the pool usage statistics.
+	 * Can be called from any thread.
+	 * @return the usage statistics.
+	 */
+	stats get_stats() const noexcept;
+};
+
+} // namespace nitki
@@ -0,0 +1,67 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#include "spsc_ring.hpp"
+
+using namespace nitki;
+
+spsc_ring_base::spsc_ring_base(size_t capacity) :
+	waitable_event(opros::ready::read),
+	mask(capacity - 1)
+{
+	ASSERT(capacity != 0)
+	ASSERT((capacity & (capacity - 1)) == 0, [&](auto& o) {
+		o << "capacity = " << capacity;
+	})
+}
+
+bool spsc_ring_base::prepare_to_park() noexcept
+{
+	// fast path, no need to park if there are elements known to be ready
+	if (this->get_num_cached_readable() != 0) {
+		return false;
+	}
+
+	// The doorbell can be not rung, then resetting it has no effect.
+	// The doorbell rung by a producer which has not yet seen the consumer's previous
+	// parking can be rung after the resetting, that results in a harmless spurious wake up.
+	this->reset();
+
+	// The producer stores the tail and then checks the flag, while here the flag is set and then
+	// the tail is checked, all these operations are sequentially consistent,
+	// so either the producer sees the flag set or the new tail is seen here.
+	this->consumer_parked.store(true);
+
+	this->cached_tail = this->tail.load();
+	if (this->get_num_cached_readable() == 0) {
+		return true;
+	}
+
+	// the producer could have already taken the flag, then the doorbell is rung and will be
+	// cleared on next parking
+	this->consumer_parked.store(false);
+	return false;
+}
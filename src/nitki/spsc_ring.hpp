@@ -0,0 +1,303 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <opros/waitable.hpp>
+#include <utki/config.hpp>
+#include <utki/debug.hpp>
+#include <utki/span.hpp>
+
+#include "util.hpp"
+#include "waitable_event.hpp"
+
+namespace nitki {
+
+/**
+ * @brief Type independent part of nitki::spsc_ring.
+ * Holds the ring indices and the consumer's doorbell.
+ */
+class spsc_ring_base : public waitable_event
+{
+	const size_t mask;
+
+	// Head and tail are never wrapped, the element index is obtained by masking.
+
+	// consumer side
+	alignas(cache_line_size) std::atomic_size_t head = 0;
+	size_t cached_tail = 0;
+
+	// producer side
+	alignas(cache_line_size) std::atomic_size_t tail = 0;
+	size_t cached_head = 0;
+
+	// set by the consumer before it parks, the producer rings the doorbell only if the flag is set
+	alignas(cache_line_size) std::atomic_bool consumer_parked = false;
+
+protected:
+	spsc_ring_base(size_t capacity);
+
+	size_t to_index(size_t position) const noexcept
+	{
+		return position & this->mask;
+	}
+
+	size_t get_tail() const noexcept
+	{
+		// tail is only modified by the producer
+		return this->tail.load(std::memory_order_relaxed);
+	}
+
+	size_t get_head() const noexcept
+	{
+		// head is only modified by the consumer
+		return this->head.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * @brief Get number of contiguous free slots starting at the tail.
+	 * Called by the producer. The consumer's head is only re-read if the cached value
+	 * shows less free slots than requested.
+	 * @param num - maximum number of slots needed.
+	 * @return number of contiguous free slots, not more than num.
+	 */
+	size_t get_num_writable(size_t num) noexcept
+	{
+		size_t t = this->get_tail();
+		if (this->capacity() - (t - this->cached_head) < num) {
+			this->cached_head = this->head.load(std::memory_order_acquire);
+		}
+		return std::min({num, this->capacity() - (t - this->cached_head), this->capacity() - this->to_index(t)});
+	}
+
+	/**
+	 * @brief Get number of contiguous ready elements starting at the head.
+	 * Called by the consumer. The producer's tail is only re-read if the cached value
+	 * shows less elements than requested.
+	 * @param num - maximum number of elements needed.
+	 * @return number of contiguous ready elements, not more than num.
+	 */
+	size_t get_num_readable(size_t num) noexcept
+	{
+		size_t h = this->get_head();
+		if (this->cached_tail - h < num) {
+			this->cached_tail = this->tail.load(std::memory_order_acquire);
+		}
+		return std::min({num, this->cached_tail - h, this->capacity() - this->to_index(h)});
+	}
+
+	size_t get_num_cached_readable() const noexcept
+	{
+		return this->cached_tail - this->get_head();
+	}
+
+	void commit_internal(size_t num) noexcept
+	{
+		// NOTE: the store and the following load have to be sequentially consistent, see prepare_to_park()
+		this->tail.store(this->get_tail() + num);
+
+		if (this->consumer_parked.load() && this->consumer_parked.exchange(false)) {
+			this->set();
+		}
+	}
+
+	void release_internal(size_t num) noexcept
+	{
+		this->head.store(this->get_head() + num, std::memory_order_release);
+	}
+
+public:
+	spsc_ring_base(const spsc_ring_base&) = delete;
+	spsc_ring_base& operator=(const spsc_ring_base&) = delete;
+	spsc_ring_base(spsc_ring_base&&) = delete;
+	spsc_ring_base& operator=(spsc_ring_base&&) = delete;
+
+	/**
+	 * @brief Get maximum number of elements in the ring.
+	 * @return capacity of the ring.
+	 */
+	size_t capacity() const noexcept
+	{
+		return this->mask + 1;
+	}
+
+	/**
+	 * @brief Prepare consumer for waiting on the doorbell.
+	 * The ring is ready to read only when the producer has committed elements after the consumer
+	 * has called this function, the producer does not make any system calls otherwise.
+	 * So, the consumer shall call this function before waiting on a wait_set the ring is added to,
+	 * and it shall only wait if the function returned true.
+	 * Must only be called by the consumer.
+	 * @return true if the ring is empty and the consumer can wait for the doorbell.
+	 * @return false if the ring is not empty, the consumer shall not wait and process the elements instead.
+	 */
+	bool prepare_to_park() noexcept;
+};
+
+/**
+ * @brief Single-producer/single-consumer fixed capacity ring.
+ * The ring holds default-constructed elements which are reused, the producer writes elements in place
+ * and the consumer reads them in place, so that no copying or memory allocation is involved:
+ * - producer obtains a span of free slots with reserve(), fills them and publishes them with commit();
+ * - consumer obtains a span of ready elements with peek() and frees them with release() after use.
+ * Head and tail indices are located in separate cache lines, and each side caches the other side's
+ * index, so that the other side's cache line is only read when the cached value is exhausted.
+ * The ring is an opros::waitable, ready to read when the producer has committed elements
+ * while the consumer was parked, see prepare_to_park(). So, the ring can be added to
+ * a consumer loop_thread's wait_set. Committing elements while the consumer is not parked
+ * does not involve any system calls.
+ * NOTE: the ring shall only be used to wait for read, see opros::ready::read.
+ * @tparam value_type - type of the elements, must be default constructible.
+ */
+template <typename value_type>
+class spsc_ring : public spsc_ring_base
+{
+	std::vector<value_type> elements;
+
+	static size_t round_up_to_power_of_2(size_t capacity)
+	{
+		if (capacity == 0) {
+			throw std::invalid_argument("spsc_ring::spsc_ring(): capacity must be greater than 0");
+		}
+		size_t ret = 1;
+		while (ret < capacity) {
+			if (ret > std::numeric_limits<size_t>::max() / 2) {
+				throw std::invalid_argument("spsc_ring::spsc_ring(): capacity is too big");
+			}
+			ret *= 2;
+		}
+		return ret;
+	}
+
+public:
+	/**
+	 * @brief Create ring.
+	 * @param capacity - requested capacity of the ring. Actual capacity is rounded up to a power of 2.
+	 * @throw std::invalid_argument - if capacity is 0.
+	 */
+	spsc_ring(size_t capacity) :
+		spsc_ring_base(round_up_to_power_of_2(capacity)),
+		elements(this->capacity())
+	{}
+
+	/**
+	 * @brief Reserve free slots for writing.
+	 * The returned span is contiguous, so it can contain less slots than requested because
+	 * the ring is nearly full or the slots wrap around the end of the ring buffer.
+	 * The slots contain the elements previously released by the consumer.
+	 * Must only be called by the producer.
+	 * @param num - maximum number of slots to reserve.
+	 * @return span of free slots, empty if the ring is full.
+	 */
+	utki::span<value_type> reserve(size_t num = 1) noexcept
+	{
+		num = this->get_num_writable(num);
+		return utki::span<value_type>(&this->elements[this->to_index(this->get_tail())], num);
+	}
+
+	/**
+	 * @brief Publish written slots to the consumer.
+	 * Rings the doorbell if the consumer is parked.
+	 * Must only be called by the producer.
+	 * @param num - number of slots from the beginning of the span returned by last reserve() to publish.
+	 */
+	void commit(size_t num = 1) noexcept
+	{
+		ASSERT(num <= this->capacity() - (this->get_tail() - this->get_head()))
+		this->commit_internal(num);
+	}
+
+	/**
+	 * @brief Push element if the ring is not full.
+	 * Must only be called by the producer.
+	 * @param value - element to push.
+	 * @return true if the element was pushed.
+	 * @return false if the ring is full.
+	 */
+	bool try_push(value_type value)
+	{
+		auto slots = this->reserve(1);
+		if (slots.empty()) {
+			return false;
+		}
+		slots[0] = std::move(value);
+		this->commit(1);
+		return true;
+	}
+
+	/**
+	 * @brief Get ready elements.
+	 * The returned span is contiguous, so it can contain less elements than available
+	 * if the elements wrap around the end of the ring buffer.
+	 * Must only be called by the consumer.
+	 * @param num - maximum number of elements to get.
+	 * @return span of ready elements, empty if the ring is empty.
+	 */
+	utki::span<value_type> peek(size_t num = std::numeric_limits<size_t>::max()) noexcept
+	{
+		num = this->get_num_readable(num);
+		return utki::span<value_type>(&this->elements[this->to_index(this->get_head())], num);
+	}
+
+	/**
+	 * @brief Return consumed elements to the producer.
+	 * Must only be called by the consumer.
+	 * @param num - number of elements from the beginning of the span returned by last peek() to release.
+	 */
+	void release(size_t num = 1) noexcept
+	{
+		ASSERT(num <= this->get_num_cached_readable())
+		this->release_internal(num);
+	}
+
+	/**
+	 * @brief Pop element if the ring is not empty.
+	 * Must only be called by the consumer.
+	 * @return the popped element.
+	 * @return std::nullopt if the ring is empty.
+	 */
+	std::optional<value_type> try_pop()
+	{
+		auto elems = this->peek(1);
+		if (elems.empty()) {
+			return std::nullopt;
+		}
+		std::optional<value_type> ret(std::move(elems[0]));
+		this->release(1);
+		return ret;
+	}
+};
+
+} // namespace nitki
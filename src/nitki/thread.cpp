@@ -26,27 +26,349 @@ SOFTWARE.
 
 #include "thread.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+
+#include "semaphore.hpp"
+#include "thread_cache.hpp"
+
+#if CFG_OS == CFG_OS_LINUX
+#	include <sched.h>
+#	include <sys/mman.h>
+#	include <sys/resource.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#elif CFG_OS == CFG_OS_MACOSX
+#	include <sys/mman.h>
+#endif
+
 using namespace nitki;
 
 namespace {
-void run_thread(void* data)
+// data passed to the thread which applies some attributes from within itself,
+// shared by the starting and the started threads, because the semaphore can still be in use
+// by the started thread when the starting thread returns from waiting on it
+struct start_context {
+	thread* thr;
+	const thread::attributes& attrs;
+
+	// signalled when the attributes are applied, or failed to apply
+	nitki::semaphore applied;
+	std::exception_ptr error;
+};
+
+#if CFG_OS == CFG_OS_WINDOWS
+DWORD WINAPI run_thread(LPVOID data)
 {
 	auto thr = static_cast<thread*>(data);
 
 	thr->run();
+
+	return 0;
 }
+#else
+bool needs_applying_from_within(const thread::attributes& attrs)
+{
+	return !attrs.name.empty() || attrs.nice.has_value() || attrs.lock_stack;
+}
+
+void apply_from_within(const thread::attributes& attrs)
+{
+	if (!attrs.name.empty()) {
+#	if CFG_OS == CFG_OS_LINUX
+		// linux limits thread name to 16 bytes including terminating zero
+		constexpr size_t max_name_length = 15;
+		auto name = attrs.name.substr(0, max_name_length);
+		if (int error = pthread_setname_np(pthread_self(), name.c_str())) {
+			throw std::system_error(error, std::generic_category(), "thread::start(): pthread_setname_np() failed");
+		}
+#	elif CFG_OS == CFG_OS_MACOSX
+		if (int error = pthread_setname_np(attrs.name.c_str())) {
+			throw std::system_error(error, std::generic_category(), "thread::start(): pthread_setname_np() failed");
+		}
+#	endif
+	}
+
+#	if CFG_OS == CFG_OS_LINUX
+	if (attrs.nice.has_value()) {
+		// on linux the nice value is per thread
+		if (setpriority(PRIO_PROCESS, id_t(syscall(SYS_gettid)), attrs.nice.value()) != 0) {
+			throw std::system_error(errno, std::generic_category(), "thread::start(): setpriority() failed");
+		}
+	}
+#	endif
+
+	if (attrs.lock_stack) {
+		void* stack_addr = nullptr;
+		size_t stack_size = 0;
+#	if CFG_OS == CFG_OS_LINUX
+		pthread_attr_t attr;
+		if (int error = pthread_getattr_np(pthread_self(), &attr)) {
+			throw std::system_error(error, std::generic_category(), "thread::start(): pthread_getattr_np() failed");
+		}
+		int error = pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+		pthread_attr_destroy(&attr);
+		if (error) {
+			throw std::system_error(error, std::generic_category(), "thread::start(): pthread_attr_getstack() failed");
+		}
+#	elif CFG_OS == CFG_OS_MACOSX
+		// pthread_get_stackaddr_np() returns the top of the stack
+		stack_size = pthread_get_stacksize_np(pthread_self());
+		stack_addr = static_cast<uint8_t*>(pthread_get_stackaddr_np(pthread_self())) - stack_size;
+#	endif
+		if (mlock(stack_addr, stack_size) != 0) {
+			throw std::system_error(errno, std::generic_category(), "thread::start(): mlock() failed");
+		}
+	}
+}
+
+void* run_thread(void* data)
+{
+	auto thr = static_cast<thread*>(data);
+
+	thr->run();
+
+	return nullptr;
+}
+
+void* run_thread_with_attributes(void* data)
+{
+	std::shared_ptr<start_context> ctx;
+	{
+		auto ctx_ptr = static_cast<std::shared_ptr<start_context>*>(data);
+		ctx = std::move(*ctx_ptr);
+		delete ctx_ptr;
+	}
+
+	auto thr = ctx->thr;
+
+	try {
+		apply_from_within(ctx->attrs);
+	} catch (...) {
+		ctx->error = std::current_exception();
+		ctx->applied.signal();
+		return nullptr;
+	}
+
+	// the attributes object is owned by the starting thread and must not be accessed after this signal
+	ctx->applied.signal();
+	ctx.reset();
+
+	thr->run();
+
+	return nullptr;
+}
+#endif
 } // namespace
 
 void thread::start()
 {
-	if (this->thr.joinable()) {
+	this->start(attributes());
+}
+
+void thread::start(const attributes& attrs)
+{
+	if (this->is_joinable()) {
+		throw std::logic_error("thread::start(): thread is already started");
+	}
+
+#if CFG_OS == CFG_OS_WINDOWS
+	if (attrs.policy != attributes::scheduling_policy::other || attrs.nice.has_value() || attrs.lock_stack) {
+		throw std::invalid_argument(
+			"thread::start(): scheduling policy, nice value and stack locking are not supported on Windows"
+		);
+	}
+
+	DWORD_PTR affinity_mask = 0;
+	for (auto cpu : attrs.cpus) {
+		if (cpu >= std::numeric_limits<DWORD_PTR>::digits) {
+			throw std::invalid_argument("thread::start(): CPU index is out of range");
+		}
+		affinity_mask |= DWORD_PTR(1) << cpu;
+	}
+
+	// create suspended to apply the attributes before the thread starts running
+	HANDLE handle = CreateThread(
+		nullptr, // security attributes
+		attrs.stack_size,
+		&run_thread,
+		this,
+		CREATE_SUSPENDED | (attrs.stack_size == 0 ? 0 : STACK_SIZE_PARAM_IS_A_RESERVATION),
+		nullptr // thread id
+	);
+	if (handle == nullptr) {
+		throw std::system_error(int(GetLastError()), std::generic_category(), "thread::start(): CreateThread() failed");
+	}
+
+	auto fail = [handle](const char* what) {
+		auto error = int(GetLastError());
+		// the thread has never run, so it is safe to terminate it
+		TerminateThread(handle, 0);
+		CloseHandle(handle);
+		throw std::system_error(error, std::generic_category(), what);
+	};
+
+	if (affinity_mask != 0 && SetThreadAffinityMask(handle, affinity_mask) == 0) {
+		fail("thread::start(): SetThreadAffinityMask() failed");
+	}
+
+	if (!attrs.name.empty()) {
+		std::wstring name(attrs.name.begin(), attrs.name.end());
+		if (FAILED(SetThreadDescription(handle, name.c_str()))) {
+			fail("thread::start(): SetThreadDescription() failed");
+		}
+	}
+
+	if (ResumeThread(handle) == DWORD(-1)) {
+		fail("thread::start(): ResumeThread() failed");
+	}
+
+	this->thr = handle;
+#else
+#	if CFG_OS == CFG_OS_MACOSX
+	if (!attrs.cpus.empty() || attrs.nice.has_value()) {
+		throw std::invalid_argument("thread::start(): CPU affinity and nice value are not supported on macOS");
+	}
+#	endif
+
+	pthread_attr_t attr;
+	if (int error = pthread_attr_init(&attr)) {
+		throw std::system_error(error, std::generic_category(), "thread::start(): pthread_attr_init() failed");
+	}
+
+	int error = [&]() {
+		if (attrs.stack_size != 0) {
+			if (int error = pthread_attr_setstacksize(&attr, std::max(attrs.stack_size, size_t(PTHREAD_STACK_MIN)))) {
+				return error;
+			}
+		}
+
+#	if CFG_OS == CFG_OS_LINUX
+		if (!attrs.cpus.empty()) {
+			cpu_set_t cpu_set;
+			CPU_ZERO(&cpu_set);
+			for (auto cpu : attrs.cpus) {
+				if (cpu >= CPU_SETSIZE) {
+					return EINVAL;
+				}
+				CPU_SET(cpu, &cpu_set);
+			}
+			if (int error = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set), &cpu_set)) {
+				return error;
+			}
+		}
+#	endif
+
+		if (attrs.policy != attributes::scheduling_policy::other) {
+			if (int error = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED)) {
+				return error;
+			}
+			if (int error = pthread_attr_setschedpolicy(
+					&attr,
+					attrs.policy == attributes::scheduling_policy::fifo ? SCHED_FIFO : SCHED_RR
+				))
+			{
+				return error;
+			}
+			sched_param param{};
+			param.sched_priority = attrs.priority;
+			if (int error = pthread_attr_setschedparam(&attr, &param)) {
+				return error;
+			}
+		}
+
+		return 0;
+	}();
+	if (error) {
+		pthread_attr_destroy(&attr);
+		throw std::system_error(error, std::generic_category(), "thread::start(): could not set thread attributes");
+	}
+
+	pthread_t handle{};
+
+	if (!needs_applying_from_within(attrs)) {
+		error = pthread_create(&handle, &attr, &run_thread, this);
+		pthread_attr_destroy(&attr);
+		if (error) {
+			throw std::system_error(error, std::generic_category(), "thread::start(): pthread_create() failed");
+		}
+		this->thr = handle;
+		return;
+	}
+
+	std::shared_ptr<start_context> ctx(new start_context{this, attrs, {}, {}});
+
+	// the started thread takes over this reference
+	auto ctx_ptr = new std::shared_ptr<start_context>(ctx);
+
+	error = pthread_create(&handle, &attr, &run_thread_with_attributes, ctx_ptr);
+	pthread_attr_destroy(&attr);
+	if (error) {
+		delete ctx_ptr;
+		throw std::system_error(error, std::generic_category(), "thread::start(): pthread_create() failed");
+	}
+
+	ctx->applied.wait();
+
+	if (ctx->error) {
+		pthread_join(handle, nullptr);
+		std::rethrow_exception(ctx->error);
+	}
+
+	this->thr = handle;
+#endif
+}
+
+struct thread::cached_run_state {
+	// signalled when the run() returns
+	nitki::semaphore done;
+};
+
+void thread::start(thread_cache& cache)
+{
+	if (this->is_joinable()) {
 		throw std::logic_error("thread::start(): thread is already started");
 	}
 
-	this->thr = std::thread(&run_thread, this);
+	// the state is shared, because the semaphore can still be in use by the signalling OS thread
+	// when join() returns and the thread object is destroyed
+	auto state = std::make_shared<cached_run_state>();
+
+	cache.launch(
+		[this]() {
+			this->run();
+		},
+		[state]() {
+			state->done.signal();
+		}
+	);
+
+	this->cached_run = std::move(state);
 }
 
 void thread::join() noexcept
 {
-	this->thr.join();
+	if (this->cached_run) {
+		this->cached_run->done.wait();
+		this->cached_run.reset();
+		return;
+	}
+
+#if CFG_OS == CFG_OS_WINDOWS
+	if (WaitForSingleObject(this->thr, INFINITE) != WAIT_OBJECT_0) {
+		ASSERT(false)
+	}
+	CloseHandle(this->thr);
+	this->thr = nullptr;
+#else
+	if (pthread_join(this->thr.value(), nullptr) != 0) {
+		ASSERT(false)
+	}
+	this->thr.reset();
+#endif
 }
@@ -26,14 +26,26 @@ SOFTWARE.
 
 #pragma once
 
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include <utki/config.hpp>
 #include <utki/debug.hpp>
 
+#if CFG_OS == CFG_OS_WINDOWS
+#	include <utki/windows.hpp>
+#else
+#	include <pthread.h>
+#endif
+
 namespace nitki {
 
+class thread_cache;
+
 /**
  * @brief a base class for threads.
  * This class should be used as a base class for thread objects, one should override the
@@ -41,9 +53,101 @@ namespace nitki {
  */
 class thread
 {
-	std::thread thr;
+#if CFG_OS == CFG_OS_WINDOWS
+	HANDLE thr = nullptr;
+#else
+	std::optional<pthread_t> thr;
+#endif
+
+	// set if the thread is run by an OS thread from a thread_cache
+	struct cached_run_state;
+	std::shared_ptr<cached_run_state> cached_run;
+
+	bool is_joinable() const noexcept
+	{
+		if (this->cached_run) {
+			return true;
+		}
+#if CFG_OS == CFG_OS_WINDOWS
+		return this->thr != nullptr;
+#else
+		return this->thr.has_value();
+#endif
+	}
 
 public:
+	/**
+	 * @brief Thread attributes.
+	 * Attributes of the OS thread which are set before the thread's run() method is called.
+	 */
+	struct attributes {
+		/**
+		 * @brief Scheduling policy.
+		 */
+		enum class scheduling_policy {
+			/**
+			 * @brief Default time-sharing scheduling, SCHED_OTHER.
+			 */
+			other,
+
+			/**
+			 * @brief Real-time first-in first-out scheduling, SCHED_FIFO.
+			 */
+			fifo,
+
+			/**
+			 * @brief Real-time round-robin scheduling, SCHED_RR.
+			 */
+			round_robin
+		};
+
+		/**
+		 * @brief Indices of CPUs the thread is allowed to run on.
+		 * Empty list means no restriction.
+		 * Not supported on macOS.
+		 */
+		std::vector<unsigned> cpus;
+
+		/**
+		 * @brief Name of the thread, as seen in debuggers, top, perf etc.
+		 * On Linux the name is truncated to 15 characters.
+		 * Empty name means the name is not set.
+		 */
+		std::string name;
+
+		/**
+		 * @brief Scheduling policy.
+		 * Real-time policies usually require privileges.
+		 * Only scheduling_policy::other is supported on Windows.
+		 */
+		scheduling_policy policy = scheduling_policy::other;
+
+		/**
+		 * @brief Real-time priority of the thread.
+		 * Only used with real-time scheduling policies.
+		 */
+		int priority = 0;
+
+		/**
+		 * @brief Nice value of the thread.
+		 * Only used with scheduling_policy::other. Only supported on Linux.
+		 */
+		std::optional<int> nice;
+
+		/**
+		 * @brief Stack size in bytes.
+		 * Zero means default stack size.
+		 */
+		size_t stack_size = 0;
+
+		/**
+		 * @brief Lock the thread's stack in memory.
+		 * Locks the whole stack with mlock(), so it makes sense to set the stack_size as well.
+		 * Not supported on Windows.
+		 */
+		bool lock_stack = false;
+	};
+
 	thread(const thread&) = delete;
 	thread& operator=(const thread&) = delete;
 
@@ -55,7 +159,7 @@ public:
 	// NOLINTNEXTLINE(modernize-use-equals-default, "destructor is not trivial in debug build configuration")
 	virtual ~thread()
 	{
-		ASSERT(!this->thr.joinable(), [](auto& o) {
+		ASSERT(!this->is_joinable(), [](auto& o) {
 			o << "~thread() destructor is called while the thread was not joined before. "
 			  << "Make sure the thread is joined by calling thread::join() " //
 			  << "before destroying the thread object.";
@@ -82,10 +186,35 @@ public:
 	 */
 	void start();
 
+	/**
+	 * @brief Start thread execution with given attributes.
+	 * Starts execution of the thread. thread's thread::run() method will
+	 * be run as separate thread of execution.
+	 * All the attributes are applied before the run() method is called. In case some
+	 * attribute cannot be applied, the run() method is not called and an exception is thrown.
+	 * @param attrs - attributes of the thread.
+	 * @throw std::invalid_argument - if some of the attributes is not supported on the OS.
+	 * @throw std::system_error - if the thread could not be created or some of the attributes
+	 *                            could not be applied, e.g. due to lack of privileges.
+	 */
+	void start(const attributes& attrs);
+
+	/**
+	 * @brief Start thread execution on a cached OS thread.
+	 * The thread's thread::run() method is run by one of the OS threads parked in the cache,
+	 * or by a new OS thread if the cache has no parked threads.
+	 * See nitki::thread_cache for details.
+	 * @param cache - thread cache to take the OS thread from.
+	 * @throw std::system_error - if a new OS thread could not be created.
+	 */
+	void start(thread_cache& cache);
+
 	/**
 	 * @brief Wait for thread to finish its execution.
 	 * This function waits for the thread finishes its execution,
 	 * i.e. until the thread returns from its thread::run() method.
+	 * In case the thread was started on a thread_cache, the OS thread can still
+	 * be running after this function returns, it goes back to the cache.
 	 */
 	void join() noexcept;
 };
@@ -0,0 +1,206 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#include "thread_cache.hpp"
+
+#include <algorithm>
+
+#include <utki/debug.hpp>
+
+using namespace nitki;
+
+thread_cache::thread_cache(const parameters& params) :
+	params(params)
+{
+	try {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		for (size_t i = 0; i != std::min(this->params.num_warm_up, this->params.max_size); ++i) {
+			this->add_worker(nullptr, nullptr);
+		}
+	} catch (...) {
+		// the destructor is not called for the partially constructed object,
+		// so the already started threads have to be stopped here
+		this->stop();
+		throw;
+	}
+}
+
+thread_cache::~thread_cache()
+{
+	this->stop();
+}
+
+void thread_cache::stop()
+{
+	std::vector<std::thread> to_join;
+	{
+		std::unique_lock<std::mutex> lock(this->mutex);
+
+		this->quitting = true;
+		for (auto& w : this->workers) {
+			w->cv.notify_one();
+		}
+
+		// the threads which are still finishing the run() of already joined nitki::thread are waited for as well
+		this->exited_cv.wait(lock, [this]() {
+			return this->workers.empty();
+		});
+
+		to_join = std::move(this->exited);
+	}
+
+	for (auto& t : to_join) {
+		t.join();
+	}
+}
+
+thread_cache::worker& thread_cache::add_worker(procedure&& task, procedure&& done)
+{
+	this->workers.push_back(std::make_unique<worker>());
+	auto& w = *this->workers.back();
+
+	w.task = std::move(task);
+	w.done = std::move(done);
+	try {
+		w.thr = std::thread([this, &w]() {
+			this->run_worker(w);
+		});
+	} catch (...) {
+		this->workers.pop_back();
+		throw;
+	}
+
+	if (!w.task) {
+		this->parked.push_back(&w);
+	}
+
+	return w;
+}
+
+void thread_cache::run_worker(worker& w)
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while (true) {
+		if (w.task) {
+			{
+				auto task = std::move(w.task);
+				lock.unlock();
+				task();
+			}
+			lock.lock();
+
+			bool exit = this->quitting || this->parked.size() >= this->params.max_size;
+			if (!exit) {
+				this->parked.push_back(&w);
+			}
+
+			// report completion after parking, so that the thread can be reused right away
+			{
+				auto done = std::move(w.done);
+				lock.unlock();
+				done();
+			}
+			lock.lock();
+
+			if (exit) {
+				break;
+			}
+			continue;
+		}
+
+		if (this->quitting) {
+			break;
+		}
+
+		if (!w.cv.wait_for(lock, this->params.idle_timeout, [&]() {
+				return w.task || this->quitting;
+			}))
+		{
+			// idle timeout
+			break;
+		}
+	}
+
+	if (auto i = std::find(this->parked.begin(), this->parked.end(), &w); i != this->parked.end()) {
+		this->parked.erase(i);
+	}
+
+	// the worker is destroyed here, the OS thread is joined later
+	auto i = std::find_if(this->workers.begin(), this->workers.end(), [&w](const auto& p) {
+		return p.get() == &w;
+	});
+	ASSERT(i != this->workers.end())
+	this->exited.push_back(std::move(w.thr));
+	this->workers.erase(i);
+
+	if (this->quitting) {
+		this->exited_cv.notify_all();
+	}
+}
+
+void thread_cache::join_exited()
+{
+	std::vector<std::thread> to_join;
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (this->exited.empty()) {
+			return;
+		}
+		std::swap(to_join, this->exited);
+	}
+
+	for (auto& t : to_join) {
+		t.join();
+	}
+}
+
+void thread_cache::launch(procedure&& task, procedure&& done)
+{
+	this->join_exited();
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (this->parked.empty()) {
+		this->add_worker(std::move(task), std::move(done));
+		return;
+	}
+
+	auto w = this->parked.back();
+	this->parked.pop_back();
+
+	w->task = std::move(task);
+	w->done = std::move(done);
+
+	// notify under the lock, because the worker can exit and be destroyed right after the lock is released
+	w->cv.notify_one();
+}
+
+size_t thread_cache::size()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->parked.size();
+}
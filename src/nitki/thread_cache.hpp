@@ -0,0 +1,168 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "procedure.hpp"
+
+namespace nitki {
+
+class thread;
+
+/**
+ * @brief Cache of parked OS threads for starting nitki::thread objects.
+ * Starting a thread with nitki::thread::start(thread_cache&) hands the thread's run()
+ * to one of the parked OS threads, instead of creating a new OS thread.
+ * When run() returns, the OS thread goes back to the cache, and nitki::thread::join()
+ * only waits for the run() to return, not for the OS thread to exit.
+ * If there are no parked threads, a new OS thread is created.
+ * Parked threads which stay idle longer than the idle timeout exit.
+ *
+ * Note, that the OS thread is reused, so the thread-local variables set by one run()
+ * are seen by the next run() performed by the same OS thread.
+ *
+ * The cache must outlive all the threads started with it.
+ */
+class thread_cache
+{
+	friend class thread;
+
+public:
+	/**
+	 * @brief Default maximum number of parked threads.
+	 */
+	constexpr static size_t default_max_size = 8;
+
+	/**
+	 * @brief Default idle timeout.
+	 */
+	constexpr static std::chrono::milliseconds default_idle_timeout = std::chrono::seconds(10);
+
+	/**
+	 * @brief Thread cache construction parameters.
+	 */
+	struct parameters {
+		/**
+		 * @brief Maximum number of parked threads.
+		 * OS thread which has finished running a nitki::thread exits if there are
+		 * already this number of parked threads.
+		 */
+		size_t max_size = default_max_size;
+
+		/**
+		 * @brief Time after which a parked thread exits if it was not reused.
+		 */
+		std::chrono::milliseconds idle_timeout = default_idle_timeout;
+
+		/**
+		 * @brief Number of threads to create and park when the cache is constructed.
+		 * Limited by max_size.
+		 */
+		size_t num_warm_up = 0;
+	};
+
+private:
+	const parameters params;
+
+	struct worker {
+		std::thread thr;
+
+		// guarded by the cache mutex
+		procedure task;
+		// called when the task has returned and the thread is parked again
+		procedure done;
+		std::condition_variable cv;
+	};
+
+	std::mutex mutex;
+
+	// all the threads which have not exited yet
+	std::vector<std::unique_ptr<worker>> workers;
+
+	// threads waiting for a task, the most recently parked is the last
+	std::vector<worker*> parked;
+
+	// exited threads to be joined
+	std::vector<std::thread> exited;
+
+	// signalled when a thread exits during the cache destruction
+	std::condition_variable exited_cv;
+
+	bool quitting = false;
+
+	void run_worker(worker& w);
+
+	worker& add_worker(procedure&& task, procedure&& done);
+
+	void join_exited();
+
+	// stops and joins all the threads, the cache cannot be used afterwards
+	void stop();
+
+	void launch(procedure&& task, procedure&& done);
+
+public:
+	thread_cache(const thread_cache&) = delete;
+	thread_cache& operator=(const thread_cache&) = delete;
+	thread_cache(thread_cache&&) = delete;
+	thread_cache& operator=(thread_cache&&) = delete;
+
+	/**
+	 * @brief Constructor, creates cache with default parameters.
+	 */
+	thread_cache() :
+		thread_cache(parameters())
+	{}
+
+	/**
+	 * @brief Constructor.
+	 * @param params - cache parameters.
+	 * @throw std::system_error - if warm-up threads could not be created.
+	 */
+	thread_cache(const parameters& params);
+
+	/**
+	 * @brief Destructor.
+	 * Waits for all the parked threads to exit.
+	 */
+	~thread_cache();
+
+	/**
+	 * @brief Get number of parked threads.
+	 * @return number of threads waiting in the cache for a nitki::thread to run.
+	 */
+	size_t size();
+};
+
+} // namespace nitki
@@ -0,0 +1,172 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#include "thread_pool.hpp"
+
+#include <mutex>
+#include <stdexcept>
+
+using namespace nitki;
+
+namespace {
+// thread pool and index of its worker which is running on the current thread, if any
+thread_local const thread_pool* current_pool = nullptr;
+thread_local size_t current_worker_index = 0;
+} // namespace
+
+thread_pool::thread_pool(size_t num_threads)
+{
+	if (num_threads == 0) {
+		throw std::invalid_argument("thread_pool::thread_pool(): num_threads must be greater than zero");
+	}
+
+	this->workers.reserve(num_threads);
+	for (size_t i = 0; i != num_threads; ++i) {
+		this->workers.push_back(std::make_unique<worker>(*this, i));
+	}
+
+	for (auto& w : this->workers) {
+		w->start();
+	}
+}
+
+thread_pool::~thread_pool()
+{
+	this->quit_flag.store(true);
+
+	// wake up all the parked workers, every worker consumes at most one of these signals before exiting
+	for (size_t i = 0; i != this->workers.size(); ++i) {
+		this->idle_sema.signal();
+	}
+
+	for (auto& w : this->workers) {
+		w->join();
+	}
+}
+
+void thread_pool::push_back(procedure proc)
+{
+	size_t index = current_pool == this
+		? current_worker_index
+		: this->next_worker.fetch_add(1, std::memory_order_relaxed) % this->workers.size();
+
+	auto& w = *this->workers[index];
+
+	{
+		std::lock_guard<decltype(w.mut)> lock(w.mut);
+		w.procedures.push_back(std::move(proc));
+
+		// increment under the lock, so that the counter is never less than actual number of queued procedures
+		this->num_queued.fetch_add(1);
+	}
+
+	this->wake_one();
+}
+
+void thread_pool::wake_one()
+{
+	// the load pairs with the num_queued check in park(), both are sequentially consistent,
+	// so either the parking worker sees the pushed procedure or this thread sees the parking worker
+	size_t n = this->num_idle.load();
+	while (n != 0) {
+		if (this->num_idle.compare_exchange_weak(n, n - 1)) {
+			this->idle_sema.signal();
+			return;
+		}
+	}
+}
+
+void thread_pool::park()
+{
+	this->num_idle.fetch_add(1);
+
+	if (this->num_queued.load() != 0 || this->quit_flag.load()) {
+		// try to cancel parking
+		size_t n = this->num_idle.load();
+		while (n != 0) {
+			if (this->num_idle.compare_exchange_weak(n, n - 1)) {
+				return;
+			}
+		}
+		// some pusher has claimed this worker and signalled the semaphore, consume the signal
+	}
+
+	this->idle_sema.wait();
+}
+
+procedure thread_pool::take(size_t worker_index)
+{
+	if (this->num_queued.load(std::memory_order_relaxed) == 0) {
+		return nullptr;
+	}
+
+	// LIFO from own deque
+	{
+		auto& w = *this->workers[worker_index];
+		std::lock_guard<decltype(w.mut)> lock(w.mut);
+		if (!w.procedures.empty()) {
+			auto proc = std::move(w.procedures.back());
+			w.procedures.pop_back();
+			this->num_queued.fetch_sub(1, std::memory_order_relaxed);
+			return proc;
+		}
+	}
+
+	// FIFO steal from other workers' deques
+	for (size_t i = 1; i != this->workers.size(); ++i) {
+		auto& w = *this->workers[(worker_index + i) % this->workers.size()];
+		std::lock_guard<decltype(w.mut)> lock(w.mut);
+		if (!w.procedures.empty()) {
+			auto proc = std::move(w.procedures.front());
+			w.procedures.pop_front();
+			this->num_queued.fetch_sub(1, std::memory_order_relaxed);
+			return proc;
+		}
+	}
+
+	return nullptr;
+}
+
+void thread_pool::worker::run()
+{
+	current_pool = &this->pool;
+	current_worker_index = this->index;
+
+	for (;;) {
+		if (auto proc = this->pool.take(this->index)) {
+			proc();
+			continue;
+		}
+
+		if (this->pool.quit_flag.load() && this->pool.num_queued.load() == 0) {
+			break;
+		}
+
+		this->pool.park();
+	}
+
+	current_pool = nullptr;
+}
@@ -0,0 +1,128 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <utki/spin_lock.hpp>
+
+#include "procedure.hpp"
+#include "semaphore.hpp"
+#include "thread.hpp"
+#include "util.hpp"
+
+namespace nitki {
+
+/**
+ * @brief Pool of worker threads running procedures.
+ * Each worker thread has its own deque of procedures. Procedures pushed from within a worker thread
+ * go to that worker's deque, procedures pushed from other threads are distributed among the workers
+ * in round-robin manner. A worker runs procedures from its own deque in LIFO order, which is cache friendly
+ * for procedures spawning sub-procedures, and when its deque is empty it steals procedures from other
+ * workers' deques in FIFO order, so that load is balanced even if procedures vary in cost.
+ * Workers which have nothing to do park on a semaphore and are woken up one per pushed procedure.
+ */
+class thread_pool
+{
+	class worker : public nitki::thread
+	{
+	public:
+		thread_pool& pool;
+		const size_t index;
+
+		alignas(cache_line_size) utki::spin_lock mut;
+		std::deque<procedure> procedures;
+
+		worker(thread_pool& pool, size_t index) :
+			pool(pool),
+			index(index)
+		{}
+
+		void run() override;
+	};
+
+	std::vector<std::unique_ptr<worker>> workers;
+
+	// number of procedures in all the workers' deques
+	alignas(cache_line_size) std::atomic_size_t num_queued = 0;
+
+	// number of workers which are parked or going to park and were not yet claimed for waking up
+	alignas(cache_line_size) std::atomic_size_t num_idle = 0;
+
+	std::atomic_size_t next_worker = 0;
+
+	std::atomic_bool quit_flag = false;
+
+	nitki::semaphore idle_sema;
+
+	procedure take(size_t worker_index);
+	void park();
+	void wake_one();
+
+public:
+	/**
+	 * @brief Create and start the thread pool.
+	 * @param num_threads - number of worker threads, must be greater than zero.
+	 */
+	thread_pool(size_t num_threads = std::max(std::thread::hardware_concurrency(), 1u));
+
+	/**
+	 * @brief Destroy the thread pool.
+	 * Waits until all the procedures pushed to the pool are run, including the ones pushed by
+	 * procedures while waiting, and then stops and joins the worker threads.
+	 */
+	~thread_pool();
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	thread_pool(thread_pool&&) = delete;
+	thread_pool& operator=(thread_pool&&) = delete;
+
+	/**
+	 * @brief Get number of worker threads.
+	 * @return number of worker threads in the pool.
+	 */
+	size_t size() const noexcept
+	{
+		return this->workers.size();
+	}
+
+	/**
+	 * @brief Push a procedure to be run by one of the pool's threads.
+	 * Can be called from any thread.
+	 * @param proc - the procedure to run.
+	 */
+	void push_back(procedure proc);
+};
+
+} // namespace nitki
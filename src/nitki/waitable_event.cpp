@@ -0,0 +1,255 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#include "waitable_event.hpp"
+
+#include <stdexcept>
+#include <system_error>
+
+#include <utki/debug.hpp>
+
+#if CFG_OS == CFG_OS_LINUX
+#	include <sys/eventfd.h>
+#	include <unistd.h>
+#elif CFG_OS == CFG_OS_MACOSX
+#	include <array>
+#	include <fcntl.h>
+#	include <unistd.h>
+#endif
+
+using namespace nitki;
+
+namespace {
+#if CFG_OS == CFG_OS_WINDOWS
+const HANDLE invalid_handle = nullptr;
+#elif CFG_OS == CFG_OS_MACOSX || CFG_OS == CFG_OS_LINUX
+constexpr int invalid_handle = -1;
+#else
+#	error "Unsupported OS"
+#endif
+
+#if CFG_OS == CFG_OS_LINUX
+constexpr eventfd_t max_eventfd_value = 0xfffffffffffffffe;
+#endif
+} // namespace
+
+waitable_event::waitable_event(opros::ready direction, bool create_os_object) :
+	opros::waitable(invalid_handle),
+	direction(direction)
+{
+	ASSERT(direction == opros::ready::read || direction == opros::ready::write)
+
+	if (create_os_object) {
+		this->create();
+	}
+}
+
+waitable_event::~waitable_event() noexcept
+{
+	if (this->handle == invalid_handle) {
+		return;
+	}
+
+#if CFG_OS == CFG_OS_WINDOWS
+	CloseHandle(this->handle);
+#elif CFG_OS == CFG_OS_MACOSX
+	close(this->handle);
+	close(this->pipe_end);
+#elif CFG_OS == CFG_OS_LINUX
+	close(this->handle);
+#else
+#	error "Unsupported OS"
+#endif
+}
+
+void waitable_event::create()
+{
+	ASSERT(this->handle == invalid_handle)
+
+#if CFG_OS == CFG_OS_WINDOWS
+	this->handle = CreateEvent(
+		nullptr, // security attributes
+		TRUE, // manual-reset
+		this->direction == opros::ready::write ? TRUE : FALSE, // event for writing is initially set
+		nullptr // no name
+	);
+	if (this->handle == nullptr) {
+		throw std::system_error(
+			int(GetLastError()),
+			std::generic_category(),
+			"could not create event (Win32) for implementing Waitable"
+		);
+	}
+#elif CFG_OS == CFG_OS_MACOSX
+	std::array<int, 2> ends{};
+	if (::pipe(ends.data()) < 0) {
+		throw std::system_error(
+			errno,
+			std::generic_category(),
+			"could not create pipe (*nix) for implementing Waitable"
+		);
+	}
+	// both ends are non-blocking, the pipe is filled up and drained until EAGAIN
+	for (auto end : ends) {
+		if (fcntl(end, F_SETFL, O_NONBLOCK) < 0) {
+			close(ends[0]);
+			close(ends[1]);
+			throw std::system_error(
+				errno,
+				std::generic_category(),
+				"could not make pipe (*nix) non-blocking for implementing Waitable"
+			);
+		}
+	}
+	if (this->direction == opros::ready::read) {
+		this->handle = ends[0];
+		this->pipe_end = ends[1];
+	} else {
+		this->handle = ends[1];
+		this->pipe_end = ends[0];
+	}
+#elif CFG_OS == CFG_OS_LINUX
+	int event_fd = eventfd(0, EFD_NONBLOCK);
+	if (event_fd < 0) {
+		throw std::system_error(
+			errno,
+			std::generic_category(),
+			"could not create eventfd (linux) for implementing Waitable"
+		);
+	}
+	this->handle = event_fd;
+#else
+#	error "Unsupported OS"
+#endif
+}
+
+void waitable_event::set() noexcept
+{
+	ASSERT(this->handle != invalid_handle)
+
+#if CFG_OS == CFG_OS_WINDOWS
+	if (SetEvent(this->handle) == 0) {
+		ASSERT(false)
+	}
+#elif CFG_OS == CFG_OS_MACOSX
+	if (this->direction == opros::ready::read) {
+		std::array<uint8_t, 1> one_byte_buf{};
+		if (write(this->pipe_end, one_byte_buf.data(), 1) != 1) {
+			// the pipe is full, so it is ready to read anyway
+			ASSERT(errno == EAGAIN)
+		}
+	} else {
+		// drain the pipe
+		std::array<uint8_t, 0x1000> buf{};
+		while (read(this->pipe_end, buf.data(), buf.size()) > 0) {
+		}
+	}
+#elif CFG_OS == CFG_OS_LINUX
+	if (this->direction == opros::ready::read) {
+		if (eventfd_write(this->handle, 1) < 0) {
+			ASSERT(false)
+		}
+	} else {
+		eventfd_t value{};
+		if (eventfd_read(this->handle, &value) < 0) {
+			// the counter is zero, i.e. the event is already set
+			ASSERT(errno == EAGAIN)
+		}
+	}
+#else
+#	error "Unsupported OS"
+#endif
+}
+
+bool waitable_event::reset() noexcept
+{
+	ASSERT(this->handle != invalid_handle)
+
+#if CFG_OS == CFG_OS_WINDOWS
+	if (WaitForSingleObject(this->handle, 0) != WAIT_OBJECT_0) {
+		return false;
+	}
+	if (ResetEvent(this->handle) == 0) {
+		ASSERT(false)
+	}
+	return true;
+#elif CFG_OS == CFG_OS_MACOSX
+	bool was_set = false;
+	if (this->direction == opros::ready::read) {
+		// drain the pipe
+		std::array<uint8_t, 0x10> buf{};
+		// NOLINTNEXTLINE(clang-analyzer-unix.BlockInCriticalSection, "should not block")
+		while (read(this->handle, buf.data(), buf.size()) > 0) {
+			was_set = true;
+		}
+	} else {
+		// fill up the pipe
+		std::array<uint8_t, 0x1000> buf{};
+		while (write(this->handle, buf.data(), buf.size()) > 0) {
+			was_set = true;
+		}
+		// fill up the last bytes of the pipe buffer
+		while (write(this->handle, buf.data(), 1) > 0) {
+			was_set = true;
+		}
+	}
+	return was_set;
+#elif CFG_OS == CFG_OS_LINUX
+	if (this->direction == opros::ready::read) {
+		eventfd_t value{};
+		if (eventfd_read(this->handle, &value) < 0) {
+			ASSERT(errno == EAGAIN)
+			return false;
+		}
+	} else {
+		if (eventfd_write(this->handle, max_eventfd_value) < 0) {
+			// the counter is not zero, i.e. the event is already reset
+			ASSERT(errno == EAGAIN)
+			return false;
+		}
+	}
+	return true;
+#else
+#	error "Unsupported OS"
+#endif
+}
+
+#if CFG_OS == CFG_OS_WINDOWS
+void waitable_event::set_waiting_flags(utki::flags<opros::ready> wait_for)
+{
+	if (!wait_for.get(this->direction) && !wait_for.clear(this->direction).is_clear()) {
+		throw std::invalid_argument(
+			"waitable_event::set_waiting_flags(): wait_for should have only the flag of the event's direction set, "
+			"other values are not allowed"
+		);
+	}
+}
+
+utki::flags<opros::ready> waitable_event::get_readiness_flags()
+{
+	return utki::flags<opros::ready>(false).set(this->direction);
+}
+#endif
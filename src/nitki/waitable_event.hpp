@@ -0,0 +1,112 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#pragma once
+
+#include <opros/waitable.hpp>
+#include <utki/config.hpp>
+
+namespace nitki {
+
+/**
+ * @brief Base class for waitables backed by an OS event object.
+ * Owns the object which opros::wait_set waits on, i.e. eventfd on Linux, pipe on MacOS
+ * and event on Windows, and switches its readiness.
+ * The event is waited on for one direction, opros::ready::read or opros::ready::write, given on construction.
+ * When the event is set, it is ready for its direction, when the event is reset, it is not ready.
+ * Event for reading is initially reset, event for writing is initially set.
+ * NOTE: only the flag of the event's direction shall be waited for.
+ */
+class waitable_event : public opros::waitable
+{
+	const opros::ready direction;
+
+#if CFG_OS == CFG_OS_WINDOWS
+#elif CFG_OS == CFG_OS_MACOSX
+	// Use pipe to implement waitable in *nix systems.
+	// The end which is waited on is saved in waitable::handle, i.e. the reading end
+	// for reading direction and the writing end for writing direction,
+	// and the other end is saved in this member variable.
+	// The pipe is ready to write unless it is full, so to reset the event for writing
+	// the pipe is filled up, and to set it the pipe is drained.
+	int pipe_end = -1;
+#elif CFG_OS == CFG_OS_LINUX
+	// The eventfd is ready to write if its counter is less than maximum, so to reset the event
+	// for writing the maximum value is written to it, and to set it the counter is read out.
+#else
+#	error "Unsupported OS"
+#endif
+
+protected:
+	/**
+	 * @brief Constructor.
+	 * @param direction - direction of the event, opros::ready::read or opros::ready::write.
+	 * @param create_os_object - whether to create the OS object right away,
+	 *                           otherwise it has to be created later with create() before using the event.
+	 * @throw std::system_error - if creating the OS object fails.
+	 */
+	waitable_event(opros::ready direction, bool create_os_object = true);
+
+	~waitable_event() noexcept
+#if CFG_OS == CFG_OS_WINDOWS
+		override
+#endif
+		;
+
+	/**
+	 * @brief Create the OS object of the event.
+	 * For events constructed without the OS object. The created event is in its initial state.
+	 * Must not be called concurrently with other methods of the event.
+	 * @throw std::system_error - if creating the OS object fails.
+	 */
+	void create();
+
+	/**
+	 * @brief Set the event.
+	 * Setting already set event has no effect.
+	 */
+	void set() noexcept;
+
+	/**
+	 * @brief Reset the event.
+	 * @return true if the event was set.
+	 * @return false if the event was not set.
+	 */
+	bool reset() noexcept;
+
+#if CFG_OS == CFG_OS_WINDOWS
+	void set_waiting_flags(utki::flags<opros::ready>) override;
+	utki::flags<opros::ready> get_readiness_flags() override;
+#endif
+
+public:
+	waitable_event(const waitable_event&) = delete;
+	waitable_event& operator=(const waitable_event&) = delete;
+	waitable_event(waitable_event&&) = delete;
+	waitable_event& operator=(waitable_event&&) = delete;
+};
+
+} // namespace nitki
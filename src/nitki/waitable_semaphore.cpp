@@ -0,0 +1,133 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#include "waitable_semaphore.hpp"
+
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+
+#include <utki/debug.hpp>
+
+using namespace nitki;
+
+waitable_semaphore::waitable_semaphore(unsigned initial_value) :
+	waitable_event(opros::ready::read),
+	value(initial_value)
+{
+	if (initial_value != 0) {
+		this->set_ready();
+	}
+}
+
+void waitable_semaphore::set_ready() noexcept
+{
+	// NOTE: the load has to be sequentially consistent, see clear_ready()
+	if (this->is_ready.load()) {
+		return;
+	}
+
+	if (this->is_ready.exchange(true)) {
+		// someone else has already made the waitable signalled
+		return;
+	}
+
+	this->set();
+}
+
+bool waitable_semaphore::clear_ready() noexcept
+{
+	// Same protocol as in queue::clear_ready_to_read_state(): if the waitable is not signalled yet,
+	// then signalling is in progress in another thread and the ready state is left as is.
+	// Otherwise, the waitable is reset before clearing the flag.
+
+	if (!this->reset()) {
+		return false;
+	}
+
+	this->is_ready.store(false);
+	return true;
+}
+
+void waitable_semaphore::clear_ready_if_no_permits() noexcept
+{
+	// Several threads can take the permits concurrently, the lock makes sure that
+	// a failed read of the waitable in clear_ready() can only be caused by signalling in progress.
+	std::lock_guard<decltype(this->clear_mutex)> lock(this->clear_mutex);
+
+	if (!this->is_ready.load() || this->value.load() != 0) {
+		return;
+	}
+
+	// Releasers add permits and then check the flag, while here the flag is cleared and then
+	// the permits are re-checked, all these operations are sequentially consistent,
+	// so either the releaser sees the flag cleared or the new permits are seen here.
+	if (this->clear_ready()) {
+		if (this->value.load() != 0) {
+			this->set_ready();
+		}
+	}
+}
+
+void waitable_semaphore::release(unsigned num)
+{
+	if (num == 0) {
+		return;
+	}
+
+	auto v = this->value.load(std::memory_order_relaxed);
+	do {
+		if (v > std::numeric_limits<uint32_t>::max() - num) {
+			throw std::logic_error("waitable_semaphore::release(): number of permits would exceed maximum");
+		}
+	} while (!this->value.compare_exchange_weak(v, v + num));
+
+	if (v == 0) {
+		this->set_ready();
+	}
+}
+
+bool waitable_semaphore::try_acquire(unsigned num) noexcept
+{
+	auto v = this->value.load();
+	for (;;) {
+		if (v < num) {
+			if (v == 0) {
+				// the ready state could have been left set by previous clearing attempt
+				this->clear_ready_if_no_permits();
+			}
+			return false;
+		}
+		if (this->value.compare_exchange_weak(v, v - num)) {
+			break;
+		}
+	}
+
+	if (v == num) {
+		this->clear_ready_if_no_permits();
+	}
+	return true;
+}
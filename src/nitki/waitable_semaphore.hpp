@@ -0,0 +1,104 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015-2023 Ivan Gagis <igagis@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* ================ LICENSE END ================ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include <opros/waitable.hpp>
+#include <utki/config.hpp>
+#include <utki/spin_lock.hpp>
+
+#include "waitable_event.hpp"
+
+namespace nitki {
+
+/**
+ * @brief Counting semaphore which can be waited on with opros::wait_set.
+ * The semaphore is ready to read when it has at least one permit, so it can be added
+ * to a loop_thread's wait_set along with other waitables. When the wait_set reports
+ * the semaphore ready to read, the permits can be taken with try_acquire().
+ * Taking and releasing permits only involves system calls when the number of permits
+ * changes from zero to non-zero and back.
+ * NOTE: the semaphore shall only be used to wait for read, see opros::ready::read.
+ */
+class waitable_semaphore : public waitable_event
+{
+	// number of available permits
+	std::atomic<uint32_t> value;
+
+	// whether the waitable is in signalled state or is about to be
+	std::atomic_bool is_ready = false;
+
+	// serializes resetting of the ready state by concurrent acquirers
+	utki::spin_lock clear_mutex;
+
+	void set_ready() noexcept;
+	bool clear_ready() noexcept;
+	void clear_ready_if_no_permits() noexcept;
+
+public:
+	waitable_semaphore(const waitable_semaphore&) = delete;
+	waitable_semaphore& operator=(const waitable_semaphore&) = delete;
+	waitable_semaphore(waitable_semaphore&&) = delete;
+	waitable_semaphore& operator=(waitable_semaphore&&) = delete;
+
+	/**
+	 * @brief Create the semaphore with given initial number of permits.
+	 * @param initial_value - initial number of permits.
+	 */
+	waitable_semaphore(unsigned initial_value = 0);
+
+	/**
+	 * @brief Add permits to the semaphore.
+	 * Can be called from any thread.
+	 * @param num - number of permits to add.
+	 * @throw std::logic_error - if number of permits would exceed maximum.
+	 */
+	void release(unsigned num = 1);
+
+	/**
+	 * @brief Take permits without waiting.
+	 * Either all the requested permits are taken or none.
+	 * Can be called from any thread.
+	 * @param num - number of permits to take.
+	 * @return true if the permits were taken.
+	 * @return false if the semaphore has less permits than requested.
+	 */
+	bool try_acquire(unsigned num = 1) noexcept;
+
+	/**
+	 * @brief Get current number of permits.
+	 * @return current number of permits.
+	 */
+	uint32_t get_value() const noexcept
+	{
+		return this->value.load(std::memory_order_relaxed);
+	}
+};
+
+} // namespace nitki
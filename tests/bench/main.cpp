@@ -0,0 +1,1041 @@
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <utki/config.hpp>
+
+#if CFG_OS == CFG_OS_LINUX
+#	include <semaphore.h>
+#	include <sys/epoll.h>
+#	include <sys/eventfd.h>
+#	include <unistd.h>
+#endif
+
+#include <opros/wait_set.hpp>
+
+#include "../../src/nitki/loop_thread.hpp"
+#include "../../src/nitki/queue.hpp"
+#include "../../src/nitki/semaphore.hpp"
+#include "../../src/nitki/slab_pool.hpp"
+#include "../../src/nitki/spsc_ring.hpp"
+#include "../../src/nitki/thread.hpp"
+#include "../../src/nitki/thread_cache.hpp"
+#include "../../src/nitki/thread_pool.hpp"
+
+namespace{
+std::atomic_size_t num_allocations = 0;
+}
+
+void* operator new(std::size_t size){
+	num_allocations.fetch_add(1, std::memory_order_relaxed);
+	if(void* p = std::malloc(size == 0 ? 1 : size)){
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+// GCC falsely reports free() of memory allocated by the replaced operator new when the operators get inlined
+#if defined(__GNUC__) && !defined(__clang__)
+#	pragma GCC diagnostic push
+#	pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* p)noexcept{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t)noexcept{
+	std::free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#	pragma GCC diagnostic pop
+#endif
+
+#if CFG_OS == CFG_OS_LINUX
+namespace{
+std::atomic_size_t num_eventfd_reads = 0;
+std::atomic_size_t num_eventfd_writes = 0;
+std::atomic_size_t num_epoll_waits = 0;
+}
+
+// the functions are interposed to count system calls made by nitki and opros
+
+extern "C" int eventfd_read(int fd, eventfd_t* value){
+	num_eventfd_reads.fetch_add(1, std::memory_order_relaxed);
+	return read(fd, value, sizeof(*value)) == sizeof(*value) ? 0 : -1;
+}
+
+extern "C" int eventfd_write(int fd, eventfd_t value){
+	num_eventfd_writes.fetch_add(1, std::memory_order_relaxed);
+	return write(fd, &value, sizeof(value)) == sizeof(value) ? 0 : -1;
+}
+
+extern "C" int epoll_wait(int epfd, epoll_event* events, int maxevents, int timeout){
+	num_epoll_waits.fetch_add(1, std::memory_order_relaxed);
+	return epoll_pwait(epfd, events, maxevents, timeout, nullptr);
+}
+#endif
+
+namespace{
+
+struct result{
+	std::string group;
+	std::string name;
+	std::vector<std::pair<std::string, double>> values;
+};
+
+std::vector<result> results;
+
+// print result in human readable form and store it for the JSON report
+void report(const std::string& group, std::string name, std::vector<std::pair<std::string, double>> values){
+	if(results.empty() || results.back().group != group){
+		std::cout << group << ":" << std::endl;
+	}
+
+	std::cout << "  " << name << ":";
+	for(auto i = values.begin(); i != values.end(); ++i){
+		std::cout << (i == values.begin() ? " " : ", ") << i->first << " = " << i->second;
+	}
+	std::cout << std::endl;
+
+	results.push_back(result{group, std::move(name), std::move(values)});
+}
+
+std::string to_json_string(const std::string& str){
+	std::string ret = "\"";
+	for(char c : str){
+		switch(c){
+			case '"':
+				ret += "\\\"";
+				break;
+			case '\\':
+				ret += "\\\\";
+				break;
+			default:
+				ret += c;
+				break;
+		}
+	}
+	ret += "\"";
+	return ret;
+}
+
+void write_json(std::ostream& o){
+	o << "{\n\t\"results\": [";
+	for(auto r = results.begin(); r != results.end(); ++r){
+		o << (r == results.begin() ? "\n" : ",\n");
+		o << "\t\t{\"group\": " << to_json_string(r->group)
+				<< ", \"name\": " << to_json_string(r->name)
+				<< ", \"values\": {";
+		for(auto v = r->values.begin(); v != r->values.end(); ++v){
+			o << (v == r->values.begin() ? "" : ", ") << to_json_string(v->first) << ": " << v->second;
+		}
+		o << "}}";
+	}
+	o << "\n\t]\n}\n";
+}
+
+double to_ns(std::chrono::steady_clock::duration d){
+	return double(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+}
+
+const char* to_string(nitki::queue::kind kind){
+	switch(kind){
+		case nitki::queue::kind::spin_lock:
+			return "spin_lock";
+		case nitki::queue::kind::lock_free:
+			return "lock_free";
+	}
+	return "unknown";
+}
+
+constexpr size_t num_pushes = 100000;
+
+template <size_t capture_size>
+struct payload{
+	std::array<uint8_t, capture_size> data{};
+};
+
+template <typename make_proc_type>
+void measure_allocations_per_push(
+		const char* name,
+		nitki::queue::kind kind,
+		make_proc_type make_proc,
+		std::shared_ptr<nitki::slab_pool> pool = nullptr
+){
+	nitki::queue q({kind, std::nullopt, nitki::queue::default_starvation_limit, false, pool});
+
+	// warm up the pool, so that reserving the slabs is not measured
+	if(pool){
+		size_t sum = 0;
+		for(size_t i = 0; i != num_pushes; ++i){
+			q.push_back(make_proc(sum));
+		}
+		std::deque<nitki::procedure> procs;
+		q.pop_all(procs);
+	}
+
+	size_t sum = 0;
+
+	size_t allocs_before = num_allocations.load();
+	auto start = std::chrono::steady_clock::now();
+
+	for(size_t i = 0; i != num_pushes; ++i){
+		q.push_back(make_proc(sum));
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	size_t allocs_after = num_allocations.load();
+
+	while(auto p = q.pop_front()){
+		p();
+	}
+
+	report(
+		std::string("allocations per queue::push_back(), kind::") + to_string(kind),
+		name,
+		{
+			{"allocations_per_push", double(allocs_after - allocs_before) / double(num_pushes)},
+			{"ns_per_push", to_ns(end - start) / double(num_pushes)}
+		}
+	);
+}
+
+void bench_allocations_per_push(nitki::queue::kind kind){
+	measure_allocations_per_push("empty capture lambda", kind, [](size_t&){
+		return [](){};
+	});
+
+	measure_allocations_per_push("40 byte capture lambda", kind, [](size_t& sum){
+		return [&sum, p = payload<32>()](){sum += p.data[0];};
+	});
+
+	measure_allocations_per_push("40 byte capture lambda via std::function", kind, [](size_t& sum){
+		return std::function<void()>([&sum, p = payload<32>()](){sum += p.data[0];});
+	});
+
+	measure_allocations_per_push("move-only capture lambda", kind, [](size_t& sum){
+		return [&sum, p = std::unique_ptr<int>()](){sum += p ? 1 : 0;};
+	});
+
+	measure_allocations_per_push("72 byte capture lambda", kind, [](size_t& sum){
+		return [&sum, p = payload<64>()](){sum += p.data[0];};
+	});
+
+	// the pool must fit all the procedures pushed before popping
+	measure_allocations_per_push(
+			"72 byte capture lambda, slab_pool",
+			kind,
+			[](size_t& sum){
+				return [&sum, p = payload<64>()](){sum += p.data[0];};
+			},
+			std::make_shared<nitki::slab_pool>(nitki::slab_pool::parameters{nitki::slab_pool::default_slab_size, 64 * 1024 * 1024})
+		);
+}
+
+void bench_bulk_push(nitki::queue::kind kind){
+	constexpr size_t bulk_size = 100;
+
+	nitki::queue q({kind});
+
+	size_t sum = 0;
+
+	std::vector<nitki::procedure> procs(bulk_size);
+
+	auto start = std::chrono::steady_clock::now();
+
+	for(size_t i = 0; i != num_pushes / bulk_size; ++i){
+		for(auto& p : procs){
+			p = [&sum](){++sum;};
+		}
+		q.push_back(procs.begin(), procs.end());
+	}
+
+	auto end = std::chrono::steady_clock::now();
+
+	std::deque<nitki::procedure> batch;
+	q.pop_all(batch);
+	for(auto& p : batch){
+		p();
+	}
+
+	report(
+		std::string("queue::push_back(begin, end), kind::") + to_string(kind),
+		"bulk of " + std::to_string(bulk_size),
+		{
+			{"ns_per_pushed_procedure", to_ns(end - start) / double(num_pushes)}
+		}
+	);
+}
+
+// producers push procedures concurrently while single consumer pops them
+void bench_queue_throughput(nitki::queue::kind kind, size_t num_producers){
+	constexpr size_t num_procs = 400000;
+	const size_t num_per_producer = num_procs / num_producers;
+	const size_t num_total = num_per_producer * num_producers;
+
+	nitki::queue q({kind});
+
+	std::atomic_bool go = false;
+	size_t sum = 0;
+
+	std::vector<std::thread> producers;
+	for(size_t i = 0; i != num_producers; ++i){
+		producers.emplace_back([&](){
+			while(!go.load()){
+				std::this_thread::yield();
+			}
+			for(size_t j = 0; j != num_per_producer; ++j){
+				q.push_back([&sum](){++sum;});
+			}
+		});
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	go.store(true);
+
+	for(size_t num_popped = 0; num_popped != num_total;){
+		if(auto p = q.pop_front()){
+			p();
+			++num_popped;
+		}else{
+			std::this_thread::yield();
+		}
+	}
+
+	auto end = std::chrono::steady_clock::now();
+
+	for(auto& t : producers){
+		t.join();
+	}
+
+	report(
+		std::string("queue push/pop throughput, kind::") + to_string(kind),
+		std::to_string(num_producers) + " producers",
+		{
+			{"procedures_per_second", double(num_total) / std::chrono::duration<double>(end - start).count()},
+			{"ns_per_procedure", to_ns(end - start) / double(num_total)}
+		}
+	);
+}
+
+// producers push procedures with non-inline captures, which are allocated by the producers
+// and freed by the consumer, so the memory crosses threads
+void bench_cross_thread_allocations(std::shared_ptr<nitki::slab_pool> pool, size_t num_producers){
+	constexpr size_t num_procs = 400000;
+	const size_t num_per_producer = num_procs / num_producers;
+	const size_t num_total = num_per_producer * num_producers;
+
+	nitki::queue q({nitki::queue::kind::lock_free, std::nullopt, nitki::queue::default_starvation_limit, false, pool});
+
+	std::atomic_bool go = false;
+	size_t sum = 0;
+
+	std::vector<std::thread> producers;
+	for(size_t i = 0; i != num_producers; ++i){
+		producers.emplace_back([&](){
+			while(!go.load()){
+				std::this_thread::yield();
+			}
+			for(size_t j = 0; j != num_per_producer; ++j){
+				q.push_back([&sum, p = payload<64>()](){sum += 1 + p.data[0];});
+			}
+		});
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	go.store(true);
+
+	for(size_t num_popped = 0; num_popped != num_total;){
+		if(auto p = q.pop_front()){
+			p();
+			++num_popped;
+		}else{
+			std::this_thread::yield();
+		}
+	}
+
+	auto end = std::chrono::steady_clock::now();
+
+	for(auto& t : producers){
+		t.join();
+	}
+
+	report(
+		"cross-thread allocations, 72 byte capture lambda, kind::lock_free",
+		std::string(pool ? "slab_pool, " : "heap, ") + std::to_string(num_producers) + " producers",
+		{
+			{"procedures_per_second", double(num_total) / std::chrono::duration<double>(end - start).count()},
+			{"ns_per_procedure", to_ns(end - start) / double(num_total)},
+			{"pool_fallbacks", pool ? double(pool->get_stats().num_fallbacks) : 0.0}
+		}
+	);
+}
+
+constexpr size_t num_skewed_tasks = 20000;
+
+// every 16th task is 100 times heavier than the rest
+size_t skewed_task_cost(size_t i){
+	constexpr size_t light_cost = 1000;
+	return i % 16 == 0 ? light_cost * 100 : light_cost;
+}
+
+void burn(size_t cost){
+	volatile size_t x = 0;
+	for(size_t i = 0; i != cost; ++i){
+		x = x + i;
+	}
+}
+
+class bench_loop_thread : public nitki::loop_thread{
+public:
+	bench_loop_thread() :
+			nitki::loop_thread(0)
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		return {};
+	}
+};
+
+void wait_for(const std::atomic_size_t& count, size_t value){
+	while(count.load() != value){
+		std::this_thread::yield();
+	}
+}
+
+void bench_skewed_workload(size_t num_threads){
+	std::atomic_size_t count = 0;
+
+	double round_robin_ms = 0;
+	{
+		std::vector<std::unique_ptr<bench_loop_thread>> threads;
+		for(size_t i = 0; i != num_threads; ++i){
+			threads.push_back(std::make_unique<bench_loop_thread>());
+			threads.back()->start();
+		}
+
+		auto start = std::chrono::steady_clock::now();
+
+		for(size_t i = 0; i != num_skewed_tasks; ++i){
+			threads[i % num_threads]->push_back([&count, cost = skewed_task_cost(i)](){
+				burn(cost);
+				++count;
+			});
+		}
+		wait_for(count, num_skewed_tasks);
+
+		round_robin_ms = double(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()) / 1000;
+
+		for(auto& t : threads){
+			t->quit();
+			t->join();
+		}
+	}
+
+	count.store(0);
+
+	double pool_ms = 0;
+	{
+		nitki::thread_pool pool(num_threads);
+
+		auto start = std::chrono::steady_clock::now();
+
+		for(size_t i = 0; i != num_skewed_tasks; ++i){
+			pool.push_back([&count, cost = skewed_task_cost(i)](){
+				burn(cost);
+				++count;
+			});
+		}
+		wait_for(count, num_skewed_tasks);
+
+		pool_ms = double(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()) / 1000;
+	}
+
+	report(
+		"skewed workload of " + std::to_string(num_skewed_tasks) + " tasks",
+		std::to_string(num_threads) + " threads",
+		{
+			{"round_robin_loop_threads_ms", round_robin_ms},
+			{"thread_pool_ms", pool_ms}
+		}
+	);
+}
+
+double percentile(const std::vector<double>& sorted, double fraction){
+	return sorted[std::min(sorted.size() - 1, size_t(double(sorted.size()) * fraction))];
+}
+
+// latency from loop_thread::push_back() to the start of the procedure execution on an idle loop thread
+void bench_wakeup_latency(std::chrono::nanoseconds spin_budget){
+	constexpr size_t num_samples = 5000;
+
+	bench_loop_thread t;
+	t.set_spin_budget(spin_budget);
+	t.start();
+
+	std::vector<double> samples;
+	samples.reserve(num_samples);
+
+	nitki::semaphore done;
+
+	for(size_t i = 0; i != num_samples; ++i){
+		// let the loop thread park
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+
+		auto pushed = std::chrono::steady_clock::now();
+		t.push_back([&samples, &done, pushed](){
+			samples.push_back(to_ns(std::chrono::steady_clock::now() - pushed));
+			done.signal();
+		});
+		done.wait();
+	}
+
+	auto profile = t.get_profile();
+
+	t.quit();
+	t.join();
+
+	std::sort(samples.begin(), samples.end());
+
+	double sum = 0;
+	for(auto s : samples){
+		sum += s;
+	}
+
+	report(
+		"cross-thread wakeup latency",
+		spin_budget.count() == 0
+			? std::string("loop_thread::push_back()")
+			: "loop_thread::push_back(), spin budget " + std::to_string(spin_budget.count() / 1000) + " us",
+		{
+			{"p50_ns", percentile(samples, 0.5)},
+			{"p99_ns", percentile(samples, 0.99)},
+			{"p999_ns", percentile(samples, 0.999)},
+			{"max_ns", samples.back()},
+			{"mean_ns", sum / double(samples.size())},
+			{"spin_hits", double(profile.num_spin_hits)},
+			{"parks", double(profile.num_parks)}
+		}
+	);
+}
+
+// procedure bounces between two loop threads
+class ping_pong{
+	bench_loop_thread a;
+	bench_loop_thread b;
+
+	size_t num_left;
+	nitki::semaphore done;
+
+	void ping(){
+		if(this->num_left == 0){
+			this->done.signal();
+			return;
+		}
+		--this->num_left;
+		this->b.push_back([this](){
+			this->a.push_back([this](){
+				this->ping();
+			});
+		});
+	}
+
+public:
+	void run(size_t num_round_trips){
+		this->a.start();
+		this->b.start();
+
+		this->num_left = num_round_trips;
+
+		auto start = std::chrono::steady_clock::now();
+
+		this->a.push_back([this](){
+			this->ping();
+		});
+		this->done.wait();
+
+		auto end = std::chrono::steady_clock::now();
+
+		this->a.quit();
+		this->a.join();
+		this->b.quit();
+		this->b.join();
+
+		report(
+			"loop_thread ping-pong",
+			std::to_string(num_round_trips) + " round trips",
+			{
+				{"ns_per_round_trip", to_ns(end - start) / double(num_round_trips)}
+			}
+		);
+	}
+};
+
+constexpr uint32_t num_pipeline_items = 1000000;
+
+// consumer loop thread of a pipeline stage fed via spsc_ring
+class ring_consumer_thread : public nitki::loop_thread{
+	nitki::spsc_ring<uint32_t>& ring;
+public:
+	uint64_t sum = 0;
+	uint32_t num_received = 0;
+	nitki::semaphore done;
+
+	ring_consumer_thread(nitki::spsc_ring<uint32_t>& ring) :
+			nitki::loop_thread(1),
+			ring(ring)
+	{
+		this->wait_set.add(this->ring, opros::ready::read, &this->ring);
+	}
+
+	~ring_consumer_thread()override{
+		this->wait_set.remove(this->ring);
+	}
+
+	std::optional<uint32_t> on_loop()override{
+		for(auto elems = this->ring.peek(); !elems.empty(); elems = this->ring.peek()){
+			for(auto v : elems){
+				this->sum += v;
+			}
+			this->num_received += uint32_t(elems.size());
+			this->ring.release(elems.size());
+		}
+		if(this->num_received == num_pipeline_items){
+			this->done.signal();
+		}
+		if(!this->ring.prepare_to_park()){
+			return 0;
+		}
+		return {};
+	}
+};
+
+// items passed from producer thread to consumer loop_thread
+void bench_pipeline(){
+	double ring_ms = 0;
+	{
+		nitki::spsc_ring<uint32_t> ring(1024);
+		ring_consumer_thread consumer(ring);
+		consumer.start();
+
+		auto start = std::chrono::steady_clock::now();
+
+		for(uint32_t i = 0; i != num_pipeline_items;){
+			auto slots = ring.reserve(std::min(uint32_t(64), num_pipeline_items - i));
+			if(slots.empty()){
+				std::this_thread::yield();
+				continue;
+			}
+			for(auto& s : slots){
+				s = i++;
+			}
+			ring.commit(slots.size());
+		}
+		consumer.done.wait();
+
+		ring_ms = double(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()) / 1000;
+
+		consumer.quit();
+		consumer.join();
+	}
+
+	double queue_ms = 0;
+	{
+		bench_loop_thread consumer;
+		consumer.start();
+
+		uint64_t sum = 0;
+		nitki::semaphore done;
+
+		auto start = std::chrono::steady_clock::now();
+
+		for(uint32_t i = 0; i != num_pipeline_items; ++i){
+			consumer.push_back([&sum, &done, i](){
+				sum += i;
+				if(i == num_pipeline_items - 1){
+					done.signal();
+				}
+			});
+		}
+		done.wait();
+
+		queue_ms = double(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()) / 1000;
+
+		consumer.quit();
+		consumer.join();
+	}
+
+	report(
+		"thread-to-thread pipeline of " + std::to_string(num_pipeline_items) + " items",
+		"producer thread to consumer loop_thread",
+		{
+			{"spsc_ring_ms", ring_ms},
+			{"loop_thread_push_back_ms", queue_ms}
+		}
+	);
+}
+
+#if CFG_OS == CFG_OS_LINUX
+// Producer pushes bursts of procedures with pauses in between, so that the consumer goes idle from time to time.
+// Within a burst the procedures are pushed more frequently than the consumer runs them,
+// so that they are pushed while the consumer is awake.
+template <typename push_type>
+void produce_bursts(size_t num_procs, std::atomic_size_t& count, push_type push){
+	constexpr size_t burst_size = 50;
+	constexpr auto push_interval = std::chrono::microseconds(1);
+
+	for(size_t i = 0; i != num_procs; ++i){
+		push([&count](){
+			burn(2000);
+			++count;
+		});
+		if(i % burst_size == burst_size - 1){
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}else{
+			auto next = std::chrono::steady_clock::now() + push_interval;
+			while(std::chrono::steady_clock::now() < next){
+			}
+		}
+	}
+}
+
+void report_syscalls(const std::string& name, size_t num_procs){
+	double reads = double(num_eventfd_reads.exchange(0));
+	double writes = double(num_eventfd_writes.exchange(0));
+	double waits = double(num_epoll_waits.exchange(0));
+
+	report(
+		"system calls per procedure at moderate load",
+		name,
+		{
+			{"eventfd_write", writes / double(num_procs)},
+			{"eventfd_read", reads / double(num_procs)},
+			{"epoll_wait", waits / double(num_procs)},
+			{"total", (writes + reads + waits) / double(num_procs)}
+		}
+	);
+}
+
+void bench_syscalls(){
+	constexpr size_t num_procs = 20000;
+
+	// consumer draining the queue without wakeup suppression
+	{
+		nitki::queue q;
+		std::atomic_size_t count = 0;
+
+		num_eventfd_reads.store(0);
+		num_eventfd_writes.store(0);
+		num_epoll_waits.store(0);
+
+		std::thread consumer([&q, &count](){
+			opros::wait_set ws(1);
+			ws.add(q, opros::ready::read, &q);
+			std::deque<nitki::procedure> batch;
+			while(count.load() != num_procs){
+				ws.wait();
+				q.pop_all(batch);
+				for(auto& p : batch){
+					p();
+				}
+				batch.clear();
+			}
+			ws.remove(q);
+		});
+
+		produce_bursts(num_procs, count, [&q](nitki::procedure&& p){
+			q.push_back(std::move(p));
+		});
+
+		consumer.join();
+
+		report_syscalls("queue consumer without wakeup suppression", num_procs);
+	}
+
+	// loop_thread announces when it is awake
+	{
+		bench_loop_thread t;
+		t.start();
+
+		std::atomic_size_t count = 0;
+
+		num_eventfd_reads.store(0);
+		num_eventfd_writes.store(0);
+		num_epoll_waits.store(0);
+
+		produce_bursts(num_procs, count, [&t](nitki::procedure&& p){
+			t.push_back(std::move(p));
+		});
+
+		wait_for(count, num_procs);
+
+		report_syscalls("loop_thread with wakeup suppression", num_procs);
+
+		t.quit();
+		t.join();
+	}
+}
+#endif
+
+class empty_thread : public nitki::thread{
+public:
+	void run()override{}
+};
+
+void bench_thread_start_join(){
+	constexpr size_t num_threads = 2000;
+
+	auto start = std::chrono::steady_clock::now();
+
+	for(size_t i = 0; i != num_threads; ++i){
+		empty_thread t;
+		t.start();
+		t.join();
+	}
+
+	auto end = std::chrono::steady_clock::now();
+
+	nitki::thread_cache cache({1, nitki::thread_cache::default_idle_timeout, 1});
+
+	auto cached_start = std::chrono::steady_clock::now();
+
+	for(size_t i = 0; i != num_threads; ++i){
+		empty_thread t;
+		t.start(cache);
+		t.join();
+	}
+
+	auto cached_end = std::chrono::steady_clock::now();
+
+	report(
+		"thread start and join",
+		"nitki::thread",
+		{
+			{"ns_per_start_join", to_ns(end - start) / double(num_threads)},
+			{"thread_cache_ns_per_start_join", to_ns(cached_end - cached_start) / double(num_threads)}
+		}
+	);
+}
+
+void bench_queue_construction(){
+	constexpr size_t num_queues = 10000;
+
+	auto measure = [](bool lazy_waitable){
+		nitki::queue::parameters params;
+		params.lazy_waitable = lazy_waitable;
+
+		auto start = std::chrono::steady_clock::now();
+
+		for(size_t i = 0; i != num_queues; ++i){
+			nitki::queue q(params);
+			q.push_back([](){});
+			q.pop_front()();
+		}
+
+		auto end = std::chrono::steady_clock::now();
+
+		return to_ns(end - start) / double(num_queues);
+	};
+
+	report(
+		"queue construction, push, pop and destruction",
+		"nitki::queue",
+		{
+			{"ns_per_queue", measure(false)},
+			{"lazy_waitable_ns_per_queue", measure(true)}
+		}
+	);
+}
+
+
+#if CFG_OS == CFG_OS_LINUX
+// the sem_t based semaphore, as nitki::semaphore was implemented before, for comparison
+class posix_semaphore{
+	sem_t s;
+public:
+	posix_semaphore(unsigned initial_value = 0){
+		sem_init(&this->s, 0, initial_value);
+	}
+	~posix_semaphore(){
+		sem_destroy(&this->s);
+	}
+	void wait(){
+		while(sem_wait(&this->s) != 0){}
+	}
+	void signal(){
+		sem_post(&this->s);
+	}
+};
+#endif
+
+template <typename semaphore_type>
+void bench_semaphore_handoff(const char* name){
+	constexpr size_t num_round_trips = 100000;
+
+	semaphore_type ping;
+	semaphore_type pong;
+
+	std::thread t([&](){
+		for(size_t i = 0; i != num_round_trips; ++i){
+			ping.wait();
+			pong.signal();
+		}
+	});
+
+	auto start = std::chrono::steady_clock::now();
+
+	for(size_t i = 0; i != num_round_trips; ++i){
+		ping.signal();
+		pong.wait();
+	}
+
+	auto end = std::chrono::steady_clock::now();
+
+	t.join();
+
+	report(
+		"semaphore handoff",
+		name,
+		{
+			{"ns_per_round_trip", to_ns(end - start) / double(num_round_trips)}
+		}
+	);
+}
+
+template <typename semaphore_type>
+void bench_semaphore_contention(const char* name, size_t num_threads){
+	constexpr size_t num_ops_per_thread = 100000;
+
+	// semaphore with single permit is used as a mutex
+	semaphore_type sema(1);
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> threads;
+	for(size_t i = 0; i != num_threads; ++i){
+		threads.emplace_back([&sema](){
+			for(size_t j = 0; j != num_ops_per_thread; ++j){
+				sema.wait();
+				sema.signal();
+			}
+		});
+	}
+	for(auto& t : threads){
+		t.join();
+	}
+
+	auto end = std::chrono::steady_clock::now();
+
+	report(
+		"semaphore contention",
+		std::string(name) + ", " + std::to_string(num_threads) + " threads",
+		{
+			{"ns_per_wait_signal", to_ns(end - start) / double(num_ops_per_thread * num_threads)}
+		}
+	);
+}
+
+}
+
+int main(int argc, char** argv){
+	// optional argument: --json <file> to write the results in JSON format, '-' for stdout
+	const char* json_file = nullptr;
+	for(int i = 1; i < argc; ++i){
+		if(std::strcmp(argv[i], "--json") == 0 && i + 1 < argc){
+			json_file = argv[++i];
+		}else{
+			std::cerr << "usage: " << argv[0] << " [--json <file>]" << std::endl;
+			return 1;
+		}
+	}
+
+	// when JSON goes to stdout, human readable output is suppressed
+	if(json_file && std::strcmp(json_file, "-") == 0){
+		std::cout.setstate(std::ios_base::failbit);
+	}
+
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		bench_allocations_per_push(kind);
+	}
+
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		bench_bulk_push(kind);
+	}
+
+	const size_t max_producers = std::max(size_t(4), size_t(std::thread::hardware_concurrency()));
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		for(size_t num_producers = 1; num_producers <= max_producers; num_producers *= 2){
+			bench_queue_throughput(kind, num_producers);
+		}
+	}
+
+	for(size_t num_producers = 1; num_producers <= max_producers; num_producers *= 2){
+		bench_cross_thread_allocations(nullptr, num_producers);
+		// the pool must fit all the procedures pushed before popping
+		bench_cross_thread_allocations(
+				std::make_shared<nitki::slab_pool>(nitki::slab_pool::parameters{nitki::slab_pool::default_slab_size, 256 * 1024 * 1024}),
+				num_producers
+			);
+	}
+
+	for(size_t num_threads : {2, 4, 8}){
+		bench_skewed_workload(num_threads);
+	}
+
+	bench_wakeup_latency(std::chrono::nanoseconds(0));
+	bench_wakeup_latency(std::chrono::microseconds(200));
+
+	ping_pong().run(100000);
+
+	bench_pipeline();
+
+#if CFG_OS == CFG_OS_LINUX
+	bench_syscalls();
+#endif
+
+	bench_semaphore_handoff<nitki::semaphore>("nitki::semaphore");
+#if CFG_OS == CFG_OS_LINUX
+	bench_semaphore_handoff<posix_semaphore>("sem_t");
+#endif
+
+	for(size_t num_threads : {2, 4, 8}){
+		bench_semaphore_contention<nitki::semaphore>("nitki::semaphore", num_threads);
+#if CFG_OS == CFG_OS_LINUX
+		bench_semaphore_contention<posix_semaphore>("sem_t", num_threads);
+#endif
+	}
+
+	bench_thread_start_join();
+
+	bench_queue_construction();
+
+	if(json_file){
+		if(std::strcmp(json_file, "-") == 0){
+			std::cout.clear();
+			write_json(std::cout);
+		}else{
+			std::ofstream f(json_file);
+			write_json(f);
+			if(!f){
+				std::cerr << "failed to write " << json_file << std::endl;
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,36 @@
+// This translation unit sees nitki headers as code compiled without C++20 coroutines support does,
+// so that test_coroutines can check that loop_thread's layout does not depend on it.
+#ifdef __cpp_impl_coroutine
+#	undef __cpp_impl_coroutine
+#endif
+
+#include <cstddef>
+
+#include "../../src/nitki/loop_thread.hpp"
+
+#include "tests.hpp"
+
+namespace{
+class probe : public nitki::loop_thread{
+public:
+	// member of a derived class, its offset depends on the loop_thread layout
+	int marker = 0;
+
+	probe() :
+			loop_thread(1)
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		return {};
+	}
+};
+}
+
+test_coroutines::layout test_coroutines::get_layout_without_coroutines(){
+	probe p;
+	return {
+		sizeof(nitki::loop_thread),
+		alignof(nitki::loop_thread),
+		size_t(reinterpret_cast<char*>(&p.marker) - reinterpret_cast<char*>(&p))
+	};
+}
@@ -18,4 +18,76 @@ inline void test_nitki_thread(){
 
 	std::cout << "running test_nested_join" << std::endl;
 	test_nested_join::run();
+
+	std::cout << "running test_lock_free_queue" << std::endl;
+	test_lock_free_queue::run();
+
+	std::cout << "running test_procedure" << std::endl;
+	test_procedure::run();
+
+	std::cout << "running test_pop_all" << std::endl;
+	test_pop_all::run();
+
+	std::cout << "running test_bulk_push" << std::endl;
+	test_bulk_push::run();
+
+	std::cout << "running test_bounded_queue" << std::endl;
+	test_bounded_queue::run();
+
+	std::cout << "running test_priorities" << std::endl;
+	test_priorities::run();
+
+	std::cout << "running test_timers" << std::endl;
+	test_timers::run();
+
+	std::cout << "running test_thread_pool" << std::endl;
+	test_thread_pool::run();
+
+	std::cout << "running test_future" << std::endl;
+	test_future::run();
+
+	std::cout << "running test_coroutines" << std::endl;
+	test_coroutines::run();
+
+	std::cout << "running test_thread_attributes" << std::endl;
+	test_thread_attributes::run();
+
+	std::cout << "running test_semaphore" << std::endl;
+	test_semaphore::run();
+
+	std::cout << "running test_waitable_semaphore" << std::endl;
+	test_waitable_semaphore::run();
+
+	std::cout << "running test_queue_metrics" << std::endl;
+	test_queue_metrics::run();
+
+	std::cout << "running test_loop_thread_profile" << std::endl;
+	test_loop_thread_profile::run();
+
+	std::cout << "running test_channel" << std::endl;
+	test_channel::run();
+
+	std::cout << "running test_spsc_ring" << std::endl;
+	test_spsc_ring::run();
+
+	std::cout << "running test_busy_polling" << std::endl;
+	test_busy_polling::run();
+
+	std::cout << "running test_wakeup_suppression" << std::endl;
+	test_wakeup_suppression::run();
+
+	std::cout << "running test_slab_pool" << std::endl;
+	test_slab_pool::run();
+
+	std::cout << "running test_cancellation" << std::endl;
+	test_cancellation::run();
+
+	std::cout << "running test_coalescing" << std::endl;
+	test_coalescing::run();
+
+	std::cout << "running test_thread_cache" << std::endl;
+	test_thread_cache::run();
+
+	std::cout << "running test_lazy_waitable" << std::endl;
+	test_lazy_waitable::run();
 }
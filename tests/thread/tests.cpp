@@ -1,12 +1,28 @@
+#include <array>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+
 #include <utki/debug.hpp>
 #include <utki/config.hpp>
 #include <utki/span.hpp>
 
 #include <opros/wait_set.hpp>
 
+#include "../../src/nitki/channel.hpp"
 #include "../../src/nitki/thread.hpp"
+#include "../../src/nitki/thread_cache.hpp"
 #include "../../src/nitki/loop_thread.hpp"
+#include "../../src/nitki/mailbox.hpp"
 #include "../../src/nitki/queue.hpp"
+#include "../../src/nitki/semaphore.hpp"
+#include "../../src/nitki/slab_pool.hpp"
+#include "../../src/nitki/spsc_ring.hpp"
+#include "../../src/nitki/thread_pool.hpp"
+#include "../../src/nitki/waitable_semaphore.hpp"
 
 #include "tests.hpp"
 
@@ -197,3 +213,2869 @@ void run(){
 
 
 }//~namespace
+
+
+
+namespace test_lock_free_queue{
+
+class consumer_thread : public nitki::loop_thread{
+public:
+	consumer_thread() :
+			loop_thread(0, {nitki::queue::kind::lock_free})
+	{}
+
+	size_t num_executed = 0;
+
+	std::atomic_bool done = false;
+
+	std::optional<uint32_t> on_loop()override{
+		return {};
+	}
+};
+
+void run(){
+	// check FIFO order of procedures
+	{
+		nitki::queue q({nitki::queue::kind::lock_free});
+
+		utki::assert(q.get_kind() == nitki::queue::kind::lock_free, SL);
+		utki::assert(!q.pop_front(), SL);
+
+		std::vector<int> order;
+
+		for(int i = 0; i != 3; ++i){
+			q.push_back([&order, i](){order.push_back(i);});
+		}
+
+		utki::assert(q.size() == 3, SL);
+
+		while(auto proc = q.pop_front()){
+			proc();
+		}
+
+		utki::assert(q.size() == 0, SL);
+		utki::assert(order == std::vector<int>({0, 1, 2}), SL);
+	}
+
+	// many producers push to a single consumer loop_thread
+	{
+		constexpr size_t num_producers = 8;
+		constexpr size_t num_procs_per_producer = 10000;
+
+		consumer_thread consumer;
+		consumer.start();
+
+		std::vector<std::thread> producers;
+		for(size_t i = 0; i != num_producers; ++i){
+			producers.emplace_back([&consumer](){
+				for(size_t j = 0; j != num_procs_per_producer; ++j){
+					consumer.push_back([&consumer](){
+						++consumer.num_executed;
+					});
+				}
+			});
+		}
+
+		for(auto& p : producers){
+			p.join();
+		}
+
+		consumer.push_back([&consumer](){
+			consumer.done.store(true);
+		});
+
+		while(!consumer.done.load()){
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		consumer.quit();
+		consumer.join();
+
+		utki::assert(consumer.num_executed == num_producers * num_procs_per_producer, SL);
+	}
+}
+
+}
+
+
+
+namespace test_procedure{
+
+void run(){
+	// empty procedures
+	{
+		nitki::procedure p;
+		utki::assert(!p, SL);
+		utki::assert(p == nullptr, SL);
+
+		nitki::procedure f = std::function<void()>();
+		utki::assert(!f, SL);
+	}
+
+	// small captures are stored inline, big captures are stored on the heap
+	{
+		struct big{
+			std::array<uint8_t, nitki::procedure::inline_buffer_size + 1> data{};
+		};
+
+		auto small_lambda = [a = int(0)](){};
+		auto big_lambda = [b = big()](){};
+
+		static_assert(nitki::procedure::is_inline<decltype(small_lambda)>);
+		static_assert(!nitki::procedure::is_inline<decltype(big_lambda)>);
+
+		// stored callable object is accessible by its type
+		nitki::procedure small = small_lambda;
+		nitki::procedure big_proc = big_lambda;
+		utki::assert(small.target<decltype(small_lambda)>() != nullptr, SL);
+		utki::assert(small.target<decltype(big_lambda)>() == nullptr, SL);
+		utki::assert(big_proc.target<decltype(big_lambda)>() != nullptr, SL);
+		utki::assert(big_proc.target<decltype(small_lambda)>() == nullptr, SL);
+		utki::assert(nitki::procedure().target<decltype(small_lambda)>() == nullptr, SL);
+	}
+
+	// move-only captures, inline and on the heap
+	{
+		int counter = 0;
+
+		nitki::procedure small = [&counter, p = std::make_unique<int>(10)](){counter += *p;};
+		nitki::procedure big = [&counter, p = std::make_unique<int>(20), data = std::array<uint8_t, 64>()](){counter += *p;};
+
+		nitki::procedure moved_small = std::move(small);
+		nitki::procedure moved_big = std::move(big);
+
+		utki::assert(!small, SL); // NOLINT(bugprone-use-after-move)
+		utki::assert(!big, SL); // NOLINT(bugprone-use-after-move)
+
+		moved_small();
+		moved_big();
+		utki::assert(counter == 30, SL);
+
+		moved_small = std::move(moved_big);
+		moved_small();
+		utki::assert(counter == 50, SL);
+	}
+
+	// captured objects are destroyed together with the procedure
+	{
+		auto ptr = std::make_shared<int>(0);
+		{
+			nitki::procedure p = [ptr](){};
+			utki::assert(ptr.use_count() == 2, SL);
+		}
+		utki::assert(ptr.use_count() == 1, SL);
+	}
+
+	// queue accepts move-only procedures and std::function
+	{
+		nitki::queue q;
+
+		int counter = 0;
+
+		q.push_back([&counter, p = std::make_unique<int>(1)](){counter += *p;});
+		q.push_back(std::function<void()>([&counter](){counter += 2;}));
+
+		while(auto proc = q.pop_front()){
+			proc();
+		}
+
+		utki::assert(counter == 3, SL);
+	}
+
+	// procedures popped from queue can be stored in std::function
+	{
+		nitki::queue q;
+
+		int counter = 0;
+
+		q.push_back([&counter, p = std::make_unique<int>(1)](){counter += *p;});
+
+		std::function<void()> f = q.pop_front();
+		utki::assert(bool(f), SL);
+
+		auto copy = f;
+		f();
+		copy();
+		utki::assert(counter == 2, SL);
+
+		std::function<void()> empty = q.pop_front();
+		utki::assert(!empty, SL);
+	}
+}
+
+}
+
+
+
+namespace test_pop_all{
+
+class test_thread : public nitki::loop_thread{
+public:
+	test_thread() :
+			loop_thread(0)
+	{}
+
+	std::atomic_size_t num_iterations = 0;
+
+	std::optional<uint32_t> on_loop()override{
+		++this->num_iterations;
+		return {};
+	}
+};
+
+void run(){
+	// pop_all from both kinds of queue
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		nitki::queue q({kind});
+
+		std::vector<int> order;
+
+		for(int i = 0; i != 5; ++i){
+			q.push_back([&order, i](){order.push_back(i);});
+		}
+
+		std::deque<nitki::procedure> batch;
+		batch.emplace_back([&order](){order.push_back(-1);});
+
+		q.pop_all(batch);
+
+		utki::assert(q.size() == 0, SL);
+		utki::assert(!q.pop_front(), SL);
+		utki::assert(batch.size() == 6, SL);
+
+		for(auto& p : batch){
+			p();
+		}
+
+		utki::assert(order == std::vector<int>({-1, 0, 1, 2, 3, 4}), SL);
+
+		batch.clear();
+		q.pop_all(batch);
+		utki::assert(batch.empty(), SL);
+	}
+
+	// procedure pushed from a running procedure is run on the next loop iteration
+	{
+		test_thread t;
+
+		t.start();
+
+		std::atomic_size_t outer_iteration = 0;
+		std::atomic_size_t inner_iteration = 0;
+
+		t.push_back([&](){
+			outer_iteration.store(t.num_iterations.load());
+			t.push_back([&](){
+				inner_iteration.store(t.num_iterations.load());
+			});
+		});
+
+		while(inner_iteration.load() == 0){
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		t.quit();
+		t.join();
+
+		utki::assert(inner_iteration.load() > outer_iteration.load(), SL);
+	}
+}
+
+}
+
+
+
+namespace test_bulk_push{
+
+class test_thread : public nitki::loop_thread{
+public:
+	test_thread() :
+			loop_thread(0, {nitki::queue::kind::lock_free})
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		return {};
+	}
+};
+
+void run(){
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		nitki::queue q({kind});
+
+		std::vector<int> order;
+
+		q.push_back([&order](){order.push_back(0);});
+
+		std::vector<nitki::procedure> procs;
+		for(int i = 1; i != 4; ++i){
+			procs.emplace_back([&order, i](){order.push_back(i);});
+		}
+
+		q.push_back(procs.begin(), procs.end());
+
+		// empty range
+		q.push_back(procs.end(), procs.end());
+
+		utki::assert(q.size() == 4, SL);
+
+		std::deque<nitki::procedure> batch;
+		q.pop_all(batch);
+		for(auto& p : batch){
+			p();
+		}
+
+		utki::assert(order == std::vector<int>({0, 1, 2, 3}), SL);
+	}
+
+	// push a range to loop_thread
+	{
+		test_thread t;
+		t.start();
+
+		std::atomic_int counter = 0;
+
+		std::vector<nitki::procedure> procs;
+		for(int i = 0; i != 100; ++i){
+			procs.emplace_back([&counter](){++counter;});
+		}
+
+		t.push_back(procs);
+
+		while(counter.load() != 100){
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		t.quit();
+		t.join();
+	}
+}
+
+}
+
+
+
+namespace test_bounded_queue{
+
+void run(){
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		nitki::queue q({kind, 2});
+
+		utki::assert(q.get_capacity() == 2, SL);
+
+		opros::wait_set ws(1);
+		ws.add(q.get_space_waitable(), opros::ready::write, nullptr);
+
+		utki::assert(ws.wait(0), SL);
+
+		int counter = 0;
+
+		utki::assert(q.try_push_back([&counter](){++counter;}), SL);
+		utki::assert(q.push_back([&counter](){++counter;}, 0), SL);
+
+		// the queue is full
+		utki::assert(q.size() == 2, SL);
+		utki::assert(!ws.wait(0), SL);
+
+		nitki::procedure proc = [&counter](){counter += 10;};
+		utki::assert(!q.try_push_back(std::move(proc)), SL);
+		utki::assert(!q.push_back(std::move(proc), 10), SL);
+		utki::assert(bool(proc), SL); // NOLINT(bugprone-use-after-move)
+
+		// take one procedure out, the queue has room again
+		q.pop_front()();
+		utki::assert(ws.wait(0), SL);
+		utki::assert(q.try_push_back(std::move(proc)), SL);
+		utki::assert(!ws.wait(0), SL);
+
+		// blocking push is released when the consumer takes procedures out of the queue
+		std::thread consumer([&q](){
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			// take out the two procedures which are in the queue
+			for(unsigned i = 0; i != 2; ++i){
+				q.pop_front()();
+			}
+		});
+
+		q.push_back([&counter](){counter += 100;});
+
+		consumer.join();
+
+		utki::assert(q.size() == 1, SL);
+		q.pop_front()();
+
+		utki::assert(counter == 112, SL);
+
+		ws.remove(q.get_space_waitable());
+	}
+
+	// range push does not exceed the capacity
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		nitki::queue q({kind, 3});
+
+		size_t counter = 0;
+
+		std::thread producer([&q, &counter](){
+			std::vector<nitki::procedure> procs;
+			for(unsigned i = 0; i != 7; ++i){
+				procs.emplace_back([&counter](){++counter;});
+			}
+			q.push_back(procs.begin(), procs.end());
+		});
+
+		while(counter != 7){
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			utki::assert(q.size() <= 3, [&](auto&o){o << "q.size() = " << q.size();}, SL);
+			if(auto p = q.pop_front()){
+				p();
+			}
+		}
+
+		producer.join();
+
+		utki::assert(q.size() == 0, SL);
+	}
+
+	// unbounded queue
+	{
+		nitki::queue q;
+		utki::assert(!q.get_capacity().has_value(), SL);
+		utki::assert(q.try_push_back([](){}), SL);
+
+		bool thrown = false;
+		try{
+			q.get_space_waitable();
+		}catch(std::logic_error&){
+			thrown = true;
+		}
+		utki::assert(thrown, SL);
+	}
+}
+
+}
+
+
+
+namespace test_priorities{
+
+class test_thread : public nitki::loop_thread{
+public:
+	test_thread() :
+			loop_thread(0)
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		return {};
+	}
+};
+
+void run(){
+	using nitki::queue;
+
+	for(auto kind : {queue::kind::spin_lock, queue::kind::lock_free}){
+		// higher priority procedures go first
+		{
+			queue q({kind});
+
+			std::vector<int> order;
+
+			q.push_back([&order](){order.push_back(1);});
+			q.push_back([&order](){order.push_back(2);}, queue::priority::normal);
+			q.push_back([&order](){order.push_back(3);}, queue::priority::high);
+			q.push_back([&order](){order.push_back(4);}, queue::priority::low);
+
+			utki::assert(q.size() == 4, SL);
+			utki::assert(q.size(queue::priority::normal) == 2, SL);
+			utki::assert(q.size(queue::priority::high) == 1, SL);
+
+			while(auto p = q.pop_front()){
+				p();
+			}
+
+			utki::assert(order == std::vector<int>({3, 1, 2, 4}), SL);
+		}
+
+		// lower priority procedures are not starved
+		{
+			queue::parameters params;
+			params.storage = kind;
+			params.starvation_limit = 2;
+			queue q(params);
+
+			std::vector<int> order;
+
+			q.push_back([&order](){order.push_back(-1);}, queue::priority::low);
+			for(int i = 0; i != 5; ++i){
+				q.push_back([&order, i](){order.push_back(i);}, queue::priority::high);
+			}
+
+			while(auto p = q.pop_front()){
+				p();
+			}
+
+			utki::assert(order == std::vector<int>({0, 1, -1, 2, 3, 4}), SL);
+		}
+
+		// pop_all() takes higher priority procedures first
+		{
+			queue q({kind});
+
+			std::vector<int> order;
+
+			q.push_back([&order](){order.push_back(1);}, queue::priority::low);
+			q.push_back([&order](){order.push_back(2);});
+			q.push_back([&order](){order.push_back(3);}, queue::priority::high);
+
+			std::deque<nitki::procedure> batch;
+			q.pop_all(batch);
+			for(auto& p : batch){
+				p();
+			}
+
+			utki::assert(order == std::vector<int>({3, 2, 1}), SL);
+		}
+	}
+
+	// high priority procedure pushed while loop_thread runs a batch is run before the rest of the batch
+	{
+		test_thread t;
+		t.start();
+
+		std::mutex order_mutex;
+		std::vector<int> order;
+		std::atomic_bool started = false;
+		std::atomic_bool high_pushed = false;
+
+		std::vector<nitki::procedure> batch;
+		batch.emplace_back([&](){
+			started.store(true);
+			while(!high_pushed.load()){
+				std::this_thread::yield();
+			}
+			std::lock_guard<std::mutex> lock(order_mutex);
+			order.push_back(1);
+		});
+		batch.emplace_back([&](){
+			std::lock_guard<std::mutex> lock(order_mutex);
+			order.push_back(2);
+		});
+		t.push_back(batch);
+
+		while(!started.load()){
+			std::this_thread::yield();
+		}
+
+		t.push_back([&](){
+			std::lock_guard<std::mutex> lock(order_mutex);
+			order.push_back(3);
+		}, queue::priority::high);
+		high_pushed.store(true);
+
+		for(;;){
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			std::lock_guard<std::mutex> lock(order_mutex);
+			if(order.size() == 3){
+				break;
+			}
+		}
+
+		t.quit();
+		t.join();
+
+		utki::assert(order == std::vector<int>({1, 3, 2}), SL);
+	}
+}
+
+}
+
+
+
+namespace test_timers{
+
+class test_thread : public nitki::loop_thread{
+public:
+	test_thread() :
+			loop_thread(0)
+	{}
+
+	std::atomic_size_t num_on_loop_calls = 0;
+
+	std::optional<uint32_t> on_loop()override{
+		++this->num_on_loop_calls;
+		return {};
+	}
+};
+
+void run(){
+	using clock = nitki::loop_thread::clock;
+
+	test_thread t;
+	t.start();
+
+	// one-shot timer does not fire before its deadline, also with sub-millisecond delay
+	for(auto delay : {std::chrono::microseconds(500), std::chrono::microseconds(20000)}){
+		std::atomic_bool fired = false;
+		clock::time_point fired_at;
+
+		auto start = clock::now();
+		t.push_after(delay, [&](){
+			fired_at = clock::now();
+			fired.store(true);
+		});
+
+		while(!fired.load()){
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		utki::assert(fired_at - start >= delay, SL);
+	}
+
+	// cancelled timer does not fire, timers fire in order of deadlines
+	{
+		std::mutex order_mutex;
+		std::vector<int> order;
+		std::atomic_bool done = false;
+
+		auto now = clock::now();
+		t.push_at(now + std::chrono::milliseconds(30), [&](){
+			{
+				std::lock_guard<std::mutex> lock(order_mutex);
+				order.push_back(3);
+			}
+			done.store(true);
+		});
+		auto h = t.push_at(now + std::chrono::milliseconds(10), [&](){
+			std::lock_guard<std::mutex> lock(order_mutex);
+			order.push_back(1);
+		});
+		t.push_at(now + std::chrono::milliseconds(20), [&](){
+			std::lock_guard<std::mutex> lock(order_mutex);
+			order.push_back(2);
+		});
+
+		utki::assert(bool(h), SL);
+		h.cancel();
+
+		while(!done.load()){
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		std::lock_guard<std::mutex> lock(order_mutex);
+		utki::assert(order == std::vector<int>({2, 3}), SL);
+	}
+
+	// repeating timer fires until cancelled, timer scheduled from within the loop thread
+	{
+		std::atomic_int count = 0;
+		nitki::loop_thread::timer_handle h;
+		std::atomic_bool scheduled = false;
+
+		t.push_back([&](){
+			h = t.push_every(std::chrono::milliseconds(2), [&](){
+				++count;
+			});
+			scheduled.store(true);
+		});
+
+		while(count.load() < 3){
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		utki::assert(scheduled.load(), SL);
+		h.cancel();
+
+		// let the possibly running timer procedure finish
+		std::atomic_bool flushed = false;
+		t.push_back([&](){flushed.store(true);});
+		while(!flushed.load()){
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		int c = count.load();
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		utki::assert(count.load() == c, SL);
+	}
+
+	// sub-millisecond part of the timer timeout is not waited out by spinning on on_loop() calls
+	{
+		size_t num_calls_before = t.num_on_loop_calls.load();
+
+		constexpr unsigned num_timers = 10;
+		for(unsigned i = 0; i != num_timers; ++i){
+			std::atomic_bool fired = false;
+			t.push_after(std::chrono::microseconds(2900), [&](){
+				fired.store(true);
+			});
+			while(!fired.load()){
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+
+		size_t num_calls = t.num_on_loop_calls.load() - num_calls_before;
+		utki::assert(num_calls < num_timers * 10, [&](auto&o){o << "num_calls = " << num_calls;}, SL);
+	}
+
+	// cancelling timer releases its procedure right away
+	{
+		auto ptr = std::make_shared<int>(0);
+		auto h = t.push_after(std::chrono::hours(1), [ptr](){});
+		utki::assert(ptr.use_count() == 2, SL);
+		h.cancel();
+		utki::assert(ptr.use_count() == 1, SL);
+	}
+
+	t.quit();
+	t.join();
+}
+
+}
+
+
+
+namespace test_thread_pool{
+void run(){
+	// all pushed procedures are run before the pool is destroyed
+	{
+		std::atomic_int count = 0;
+		{
+			nitki::thread_pool pool(4);
+			utki::assert(pool.size() == 4, SL);
+
+			for(int i = 0; i != 1000; ++i){
+				pool.push_back([&count](){++count;});
+			}
+		}
+		utki::assert(count.load() == 1000, SL);
+	}
+
+	// procedures pushed from within procedures
+	{
+		std::atomic_int count = 0;
+		{
+			nitki::thread_pool pool(3);
+
+			for(int i = 0; i != 10; ++i){
+				pool.push_back([&pool, &count](){
+					for(int j = 0; j != 100; ++j){
+						pool.push_back([&count](){++count;});
+					}
+				});
+			}
+		}
+		utki::assert(count.load() == 1000, SL);
+	}
+
+	// procedure queued behind a blocked procedure is stolen by other worker
+	{
+		nitki::thread_pool pool(2);
+
+		std::atomic_bool flag = false;
+		std::atomic_bool done = false;
+
+		pool.push_back([&](){
+			// goes to this worker's own deque
+			pool.push_back([&flag](){flag.store(true);});
+
+			while(!flag.load()){
+				std::this_thread::yield();
+			}
+			done.store(true);
+		});
+
+		while(!done.load()){
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+}
+}
+
+
+
+namespace test_future{
+
+class test_thread : public nitki::loop_thread{
+public:
+	test_thread() :
+			loop_thread(0)
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		return {};
+	}
+};
+
+void run(){
+	// result, void result, move-only result and exception are passed through the future
+	{
+		nitki::queue q;
+
+		auto f1 = q.push_with_result([](){return 42;});
+		auto f2 = q.push_with_result([](){});
+		auto f3 = q.push_with_result([](){return std::make_unique<int>(13);});
+		auto f4 = q.push_with_result([]() -> int {throw std::runtime_error("error");});
+
+		utki::assert(!f1.is_ready(), SL);
+
+		while(auto p = q.pop_front()){
+			p();
+		}
+
+		utki::assert(f1.is_ready(), SL);
+		utki::assert(f1.get() == 42, SL);
+		utki::assert(!f1.valid(), SL);
+
+		f2.get();
+
+		utki::assert(*f3.get() == 13, SL);
+
+		bool thrown = false;
+		try{
+			f4.get();
+		}catch(std::runtime_error&){
+			thrown = true;
+		}
+		utki::assert(thrown, SL);
+	}
+
+	// future is completed with exception if the procedure is destroyed without being run
+	{
+		nitki::future<int> f;
+		{
+			nitki::queue q;
+			f = q.push_with_result([](){return 1;});
+		}
+
+		bool thrown = false;
+		try{
+			f.get();
+		}catch(std::logic_error&){
+			thrown = true;
+		}
+		utki::assert(thrown, SL);
+	}
+
+	// call() from other thread, from within the loop thread and waiting via wait_set
+	{
+		test_thread t;
+		t.start();
+
+		utki::assert(t.call([](){return 10;}).get() == 10, SL);
+
+		auto inner = t.call([&t](){
+			auto f = t.call([](){return 20;});
+			return f.is_ready() ? f.get() : 0;
+		});
+		utki::assert(inner.get() == 20, SL);
+
+		std::atomic_bool proceed = false;
+		auto f = t.call([&proceed](){
+			while(!proceed.load()){
+				std::this_thread::yield();
+			}
+			return 30;
+		});
+
+		opros::wait_set ws(1);
+		ws.add(f.get_waitable(), opros::ready::read, nullptr);
+
+		utki::assert(!ws.wait(0), SL);
+
+		proceed.store(true);
+
+		ws.wait();
+		utki::assert(f.is_ready(), SL);
+
+		ws.remove(f.get_waitable());
+		utki::assert(f.get() == 30, SL);
+
+		// waitable requested after the result is ready is ready right away
+		auto ready_f = t.call([](){
+			return 40;
+		});
+		ready_f.wait();
+		ws.add(ready_f.get_waitable(), opros::ready::read, nullptr);
+		utki::assert(ws.wait(0), SL);
+		utki::assert(ws.wait(0), SL);
+		ws.remove(ready_f.get_waitable());
+		utki::assert(ready_f.get() == 40, SL);
+
+		t.quit();
+		t.join();
+	}
+}
+
+}
+
+
+
+namespace test_coroutines{
+
+namespace{
+class probe : public nitki::loop_thread{
+public:
+	int marker = 0;
+
+	probe() :
+			loop_thread(1)
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		return {};
+	}
+};
+
+void check_layout(){
+	probe p;
+	auto without_coroutines = get_layout_without_coroutines();
+
+	utki::assert(sizeof(nitki::loop_thread) == without_coroutines.size, SL);
+	utki::assert(alignof(nitki::loop_thread) == without_coroutines.alignment, SL);
+	utki::assert(
+			size_t(reinterpret_cast<char*>(&p.marker) - reinterpret_cast<char*>(&p)) == without_coroutines.derived_member_offset,
+			SL
+		);
+}
+}
+
+#if defined(__cpp_impl_coroutine)
+class test_thread : public nitki::loop_thread{
+public:
+	test_thread() :
+			loop_thread(1)
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		return {};
+	}
+};
+
+struct detached{
+	struct promise_type{
+		detached get_return_object(){
+			return {};
+		}
+		std::suspend_never initial_suspend()noexcept{
+			return {};
+		}
+		std::suspend_never final_suspend()noexcept{
+			return {};
+		}
+		void return_void(){}
+		void unhandled_exception(){
+			std::terminate();
+		}
+	};
+};
+
+struct steps{
+	std::thread::id thread_a;
+	std::thread::id thread_b;
+	std::thread::id after_schedule;
+	std::thread::id after_sleep;
+	std::thread::id after_switch;
+	std::thread::id after_wait;
+	nitki::loop_thread::clock::duration slept{};
+	bool read_triggered = false;
+	std::atomic_bool waiting = false;
+	std::atomic_bool done = false;
+};
+
+detached workflow(test_thread& a, test_thread& b, nitki::queue& q, steps& s){
+	co_await a.schedule();
+	s.after_schedule = std::this_thread::get_id();
+
+	auto start = nitki::loop_thread::clock::now();
+	co_await a.sleep_for(std::chrono::milliseconds(10));
+	s.slept = nitki::loop_thread::clock::now() - start;
+	s.after_sleep = std::this_thread::get_id();
+
+	co_await b.schedule();
+	s.after_switch = std::this_thread::get_id();
+
+	s.waiting.store(true);
+	auto flags = co_await b.wait_for(q, opros::ready::read);
+	s.read_triggered = flags.get(opros::ready::read);
+	s.after_wait = std::this_thread::get_id();
+
+	s.done.store(true);
+}
+#endif
+
+void run(){
+	// loop_thread layout must not depend on whether the code using it is compiled with coroutines support
+	check_layout();
+
+#if defined(__cpp_impl_coroutine)
+	test_thread a;
+	test_thread b;
+	a.start();
+	b.start();
+
+	steps s;
+	s.thread_a = a.call([](){return std::this_thread::get_id();}).get();
+	s.thread_b = b.call([](){return std::this_thread::get_id();}).get();
+
+	nitki::queue q;
+
+	workflow(a, b, q, s);
+
+	while(!s.waiting.load()){
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	// make sure the waitable is added to the wait_set before triggering it
+	b.call([](){}).get();
+
+	q.poke();
+
+	while(!s.done.load()){
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	a.quit();
+	b.quit();
+	a.join();
+	b.join();
+
+	utki::assert(s.after_schedule == s.thread_a, SL);
+	utki::assert(s.after_sleep == s.thread_a, SL);
+	utki::assert(s.slept >= std::chrono::milliseconds(10), SL);
+	utki::assert(s.after_switch == s.thread_b, SL);
+	utki::assert(s.after_wait == s.thread_b, SL);
+	utki::assert(s.read_triggered, SL);
+#else
+	std::cout << "\tskipped, compiled without C++20 coroutines support, see config=cxx20" << std::endl;
+#endif
+}
+
+}
+
+
+
+namespace test_thread_attributes{
+
+class test_thread : public nitki::thread{
+public:
+	bool was_run = false;
+	std::string name;
+	int cpu = -1;
+
+	void run()override{
+		this->was_run = true;
+#if CFG_OS == CFG_OS_LINUX
+		std::array<char, 16> buf{};
+		pthread_getname_np(pthread_self(), buf.data(), buf.size());
+		this->name = buf.data();
+		this->cpu = sched_getcpu();
+#endif
+	}
+};
+
+void run(){
+	// default attributes
+	{
+		test_thread t;
+		t.start(nitki::thread::attributes());
+		t.join();
+		utki::assert(t.was_run, SL);
+	}
+
+#if CFG_OS == CFG_OS_LINUX
+	// name, CPU affinity and stack size are applied before run() is called
+	{
+		nitki::thread::attributes attrs;
+		attrs.name = "nitki_test_thread_long_name";
+		attrs.cpus = {0};
+		attrs.stack_size = 256 * 1024;
+		attrs.nice = 1;
+
+		test_thread t;
+		t.start(attrs);
+		t.join();
+
+		utki::assert(t.was_run, SL);
+		utki::assert(t.name == "nitki_test_thre", [&](auto&o){o << "t.name = " << t.name;}, SL);
+		utki::assert(t.cpu == 0, SL);
+	}
+
+	// real-time scheduling either works or is refused without calling run()
+	{
+		nitki::thread::attributes attrs;
+		attrs.policy = nitki::thread::attributes::scheduling_policy::fifo;
+		attrs.priority = 1;
+
+		test_thread t;
+		try{
+			t.start(attrs);
+			t.join();
+			utki::assert(t.was_run, SL);
+		}catch(std::system_error&){
+			utki::assert(!t.was_run, SL);
+		}
+	}
+#endif
+
+	// invalid CPU index
+	{
+		nitki::thread::attributes attrs;
+		attrs.cpus = {std::numeric_limits<unsigned>::max()};
+
+		test_thread t;
+		bool thrown = false;
+		try{
+			t.start(attrs);
+			t.join();
+		}catch(std::exception&){
+			thrown = true;
+		}
+		utki::assert(thrown, SL);
+		utki::assert(!t.was_run, SL);
+	}
+}
+
+}
+
+
+
+namespace test_semaphore{
+void run(){
+	// batch signal and try_wait
+	{
+		nitki::semaphore s(2);
+
+		utki::assert(!s.try_wait(3), SL);
+		utki::assert(s.try_wait(2), SL);
+		utki::assert(!s.try_wait(), SL);
+
+		s.signal(5);
+		utki::assert(s.try_wait(4), SL);
+		utki::assert(s.wait(0), SL);
+		utki::assert(!s.wait(0), SL);
+	}
+
+	// timed out waiting does not take the permits
+	{
+		nitki::semaphore s(1);
+
+		auto start = std::chrono::steady_clock::now();
+		utki::assert(!s.wait_permits(2, 20), SL);
+		utki::assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20), SL);
+
+		utki::assert(s.try_wait(), SL);
+	}
+
+	// waiters for different numbers of permits are all woken up
+	{
+		nitki::semaphore s;
+
+		std::atomic_int num_done = 0;
+
+		std::vector<std::thread> threads;
+		threads.emplace_back([&](){
+			s.wait_permits(3);
+			++num_done;
+		});
+		for(int i = 0; i != 2; ++i){
+			threads.emplace_back([&](){
+				s.wait();
+				++num_done;
+			});
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+		for(int i = 0; i != 5; ++i){
+			s.signal();
+		}
+
+		for(auto& t : threads){
+			t.join();
+		}
+
+		utki::assert(num_done.load() == 3, SL);
+		utki::assert(!s.try_wait(), SL);
+	}
+
+	// ping-pong handoff between threads
+	{
+		constexpr int num_iterations = 10000;
+
+		nitki::semaphore ping;
+		nitki::semaphore pong;
+
+		std::thread t([&](){
+			for(int i = 0; i != num_iterations; ++i){
+				ping.wait();
+				pong.signal();
+			}
+		});
+
+		for(int i = 0; i != num_iterations; ++i){
+			ping.signal();
+			pong.wait();
+		}
+
+		t.join();
+	}
+}
+}
+
+
+
+namespace test_waitable_semaphore{
+void run(){
+	// readiness follows the number of permits
+	{
+		nitki::waitable_semaphore s(1);
+
+		opros::wait_set ws(1);
+		ws.add(s, opros::ready::read, &s);
+
+		utki::assert(ws.wait(0), SL);
+
+		s.release(2);
+		utki::assert(s.get_value() == 3, SL);
+		utki::assert(!s.try_acquire(4), SL);
+		utki::assert(s.try_acquire(2), SL);
+		utki::assert(ws.wait(0), SL);
+
+		utki::assert(s.try_acquire(), SL);
+		utki::assert(!ws.wait(0), SL);
+		utki::assert(!s.try_acquire(), SL);
+
+		ws.remove(s);
+	}
+
+	// permits released from other threads wake up the waiting thread
+	{
+		constexpr unsigned num_threads = 4;
+		constexpr unsigned num_permits_per_thread = 1000;
+
+		nitki::waitable_semaphore s;
+
+		opros::wait_set ws(1);
+		ws.add(s, opros::ready::read, &s);
+
+		std::vector<std::thread> threads;
+		for(unsigned i = 0; i != num_threads; ++i){
+			threads.emplace_back([&s](){
+				for(unsigned j = 0; j != num_permits_per_thread; ++j){
+					s.release();
+				}
+			});
+		}
+
+		unsigned num_acquired = 0;
+		while(num_acquired != num_threads * num_permits_per_thread){
+			ws.wait();
+			while(s.try_acquire()){
+				++num_acquired;
+			}
+		}
+
+		for(auto& t : threads){
+			t.join();
+		}
+
+		utki::assert(!ws.wait(0), SL);
+
+		ws.remove(s);
+	}
+}
+}
+
+
+
+namespace test_queue_metrics{
+
+class test_thread : public nitki::loop_thread{
+public:
+	test_thread(const nitki::queue::parameters& params) :
+			loop_thread(0, params)
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		return {};
+	}
+};
+
+uint64_t histogram_total(const nitki::queue::metrics& m){
+	uint64_t ret = 0;
+	for(auto n : m.latency_histogram){
+		ret += n;
+	}
+	return ret;
+}
+
+void run(){
+	// metrics are not collected by default
+	{
+		nitki::queue q;
+		utki::assert(!q.is_collecting_metrics(), SL);
+
+		bool thrown = false;
+		try{
+			q.get_metrics();
+		}catch(std::logic_error&){
+			thrown = true;
+		}
+		utki::assert(thrown, SL);
+	}
+
+	// counters and depth
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		nitki::queue::parameters params;
+		params.storage = kind;
+		params.collect_metrics = true;
+		nitki::queue q(params);
+
+		q.push_back([](){});
+		std::vector<nitki::procedure> procs(2);
+		for(auto& p : procs){
+			p = [](){};
+		}
+		q.push_back(procs.begin(), procs.end(), nitki::queue::priority::high);
+
+		auto m = q.get_metrics();
+		utki::assert(m.num_pushed == 3, SL);
+		utki::assert(m.num_popped == 0, SL);
+		utki::assert(m.depth == 3, SL);
+		utki::assert(m.max_depth == 3, SL);
+		utki::assert(histogram_total(m) == 0, SL);
+
+		for(int i = 0; i != 2; ++i){
+			auto p = q.pop_front();
+			utki::assert(p.get_push_time() != std::chrono::steady_clock::time_point(), SL);
+			q.record_latency(p);
+			p();
+		}
+
+		m = q.get_metrics();
+		utki::assert(m.num_pushed == 3, SL);
+		utki::assert(m.num_popped == 2, SL);
+		utki::assert(m.depth == 1, SL);
+		utki::assert(m.max_depth == 3, SL);
+		utki::assert(histogram_total(m) == 2, SL);
+		utki::assert(m.get_latency_percentile(0.5) > std::chrono::nanoseconds(0), SL);
+	}
+
+	// loop_thread records latency of all run procedures
+	{
+		nitki::queue::parameters params;
+		params.collect_metrics = true;
+		test_thread t(params);
+		t.start();
+
+		constexpr size_t num_procs = 10;
+		std::atomic_size_t num_run = 0;
+		for(size_t i = 0; i != num_procs; ++i){
+			t.push_back([&num_run](){++num_run;});
+		}
+
+		while(num_run.load() != num_procs){
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		t.quit();
+		t.join();
+
+		auto m = t.get_queue_metrics();
+		utki::assert(m.num_popped >= num_procs, SL);
+		utki::assert(histogram_total(m) >= num_procs, SL);
+	}
+}
+
+}
+
+namespace test_loop_thread_profile{
+
+class test_thread : public nitki::loop_thread{
+public:
+	std::atomic_size_t num_on_loop_calls = 0;
+
+	test_thread() :
+			loop_thread(0)
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		++this->num_on_loop_calls;
+		return {};
+	}
+};
+
+void run(){
+	// empty profile
+	{
+		nitki::loop_thread::profile p;
+		utki::assert(p.get_iterations_per_second() == 0, SL);
+		utki::assert(p.get_procedures_per_iteration() == 0, SL);
+		utki::assert(p.get_utilization() == 0, SL);
+	}
+
+	test_thread t;
+
+	auto p0 = t.get_profile();
+	utki::assert(p0.num_iterations == 0, SL);
+	utki::assert(p0.num_procedures == 0, SL);
+
+	t.start();
+
+	constexpr size_t num_procs = 10;
+	std::atomic_size_t num_run = 0;
+	for(size_t i = 0; i != num_procs; ++i){
+		t.push_back([&num_run](){
+			++num_run;
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		});
+	}
+
+	while(num_run.load() != num_procs){
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	// call() returns after the procedure has run, but the iteration is accounted only after
+	// all ready procedures have been run, so wait for the next iteration to complete
+	t.call([](){}).get();
+	t.push_back([](){});
+	auto start = std::chrono::steady_clock::now();
+	while(t.get_profile().num_procedures < num_procs + 2){
+		utki::assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(5), SL);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	auto p1 = t.get_profile();
+
+	t.quit();
+	t.join();
+
+	utki::assert(p1.num_iterations >= 1, SL);
+	utki::assert(p1.num_iterations <= t.num_on_loop_calls.load(), SL);
+	utki::assert(p1.num_procedures >= num_procs + 2, SL);
+	utki::assert(p1.procedures_time >= std::chrono::microseconds(100 * num_procs), SL);
+	utki::assert(p1.get_total_time() == p1.on_loop_time + p1.wait_time + p1.procedures_time, SL);
+	utki::assert(p1.get_iterations_per_second() > 0, SL);
+	utki::assert(p1.get_procedures_per_iteration() > 0, SL);
+	utki::assert(p1.get_utilization() > 0, SL);
+	utki::assert(p1.get_utilization() <= 1, SL);
+
+	auto diff = p1 - p0;
+	utki::assert(diff.num_iterations == p1.num_iterations, SL);
+	utki::assert(diff.procedures_time == p1.procedures_time, SL);
+
+	// final profile includes all iterations
+	auto p2 = t.get_profile();
+	utki::assert(p2.num_iterations >= p1.num_iterations, SL);
+	utki::assert(p2.num_procedures >= p1.num_procedures, SL);
+}
+
+}
+
+
+
+namespace test_channel{
+
+// loop thread consuming the channel from its wait_set
+class consumer_thread : public nitki::loop_thread{
+	nitki::channel<int>& c;
+public:
+	std::vector<int> received;
+	size_t num_expected;
+	nitki::semaphore done;
+
+	consumer_thread(nitki::channel<int>& c, size_t num_expected) :
+			loop_thread(1),
+			c(c),
+			num_expected(num_expected)
+	{
+		this->wait_set.add(this->c.get_read_waitable(), opros::ready::read, &this->c);
+	}
+
+	~consumer_thread()override{
+		this->wait_set.remove(this->c.get_read_waitable());
+	}
+
+	std::optional<uint32_t> on_loop()override{
+		std::array<int, 16> buf;
+		while(auto num = this->c.receive(buf)){
+			this->received.insert(this->received.end(), buf.begin(), std::next(buf.begin(), num));
+		}
+		if(this->received.size() == this->num_expected){
+			this->done.signal();
+		}
+		return {};
+	}
+};
+
+// element which counts its live instances and throws from copy constructor on demand
+struct throwing_copy{
+	static int num_alive;
+
+	int value;
+	bool throw_on_copy;
+
+	throwing_copy(int value, bool throw_on_copy = false) :
+			value(value),
+			throw_on_copy(throw_on_copy)
+	{
+		++num_alive;
+	}
+
+	throwing_copy(const throwing_copy& other) :
+			value(other.value),
+			throw_on_copy(other.throw_on_copy)
+	{
+		if(this->throw_on_copy){
+			throw std::runtime_error("throwing_copy");
+		}
+		++num_alive;
+	}
+
+	throwing_copy(throwing_copy&& other)noexcept :
+			value(other.value),
+			throw_on_copy(other.throw_on_copy)
+	{
+		++num_alive;
+	}
+
+	throwing_copy& operator=(const throwing_copy&) = default;
+	throwing_copy& operator=(throwing_copy&&)noexcept = default;
+
+	~throwing_copy(){
+		--num_alive;
+	}
+};
+
+int throwing_copy::num_alive = 0;
+
+void run(){
+	// invalid capacity
+	{
+		bool thrown = false;
+		try{
+			nitki::channel<int> c(0);
+		}catch(std::invalid_argument&){
+			thrown = true;
+		}
+		utki::assert(thrown, SL);
+	}
+
+	// readiness of the ends follows the number of elements
+	{
+		nitki::channel<std::string> c(3);
+		utki::assert(c.capacity() == 3, SL);
+
+		opros::wait_set read_ws(1);
+		read_ws.add(c.get_read_waitable(), opros::ready::read, &c);
+		opros::wait_set write_ws(1);
+		write_ws.add(c.get_write_waitable(), opros::ready::write, &c);
+
+		utki::assert(!read_ws.wait(0), SL);
+		utki::assert(write_ws.wait(0), SL);
+		utki::assert(!c.try_receive(), SL);
+
+		std::string str = "hello";
+		utki::assert(c.try_send(str), SL);
+		utki::assert(str == "hello", SL);
+		utki::assert(read_ws.wait(0), SL);
+
+		std::array<std::string, 3> batch = {{"a", "b", "c"}};
+		utki::assert(c.send(utki::span<std::string>(batch)) == 2, SL);
+		utki::assert(batch[0].empty(), SL);
+		utki::assert(batch[2] == "c", SL);
+		utki::assert(c.size() == 3, SL);
+		utki::assert(!write_ws.wait(0), SL);
+		utki::assert(!c.try_send(std::move(batch[2])), SL);
+		utki::assert(batch[2] == "c", SL);
+
+		auto v = c.try_receive();
+		utki::assert(v && *v == "hello", SL);
+		utki::assert(write_ws.wait(0), SL);
+
+		// the ring buffer wraps around
+		utki::assert(c.try_send(std::move(batch[2])), SL);
+
+		std::array<std::string, 4> out;
+		utki::assert(c.receive(out) == 3, SL);
+		utki::assert(out[0] == "a", SL);
+		utki::assert(out[1] == "b", SL);
+		utki::assert(out[2] == "c", SL);
+		utki::assert(c.size() == 0, SL);
+		utki::assert(!read_ws.wait(0), SL);
+		utki::assert(write_ws.wait(0), SL);
+
+		// elements left in the channel are destroyed with it
+		utki::assert(c.try_send(std::string("left")), SL);
+
+		read_ws.remove(c.get_read_waitable());
+		write_ws.remove(c.get_write_waitable());
+	}
+
+	// throwing copy constructor leaves the channel unchanged
+	{
+		{
+			nitki::channel<throwing_copy> c(4);
+
+			utki::assert(c.try_send(throwing_copy(1)), SL);
+
+			std::vector<throwing_copy> batch;
+			batch.emplace_back(2);
+			batch.emplace_back(3);
+			batch.emplace_back(4, true);
+			bool thrown = false;
+			try{
+				c.send(utki::span<const throwing_copy>(batch.data(), batch.size()));
+			}catch(std::runtime_error&){
+				thrown = true;
+			}
+			utki::assert(thrown, SL);
+			utki::assert(c.size() == 1, SL);
+			utki::assert(throwing_copy::num_alive == 4, SL);
+
+			// the slots are reusable
+			batch.back().throw_on_copy = false;
+			utki::assert(c.send(utki::span<const throwing_copy>(batch.data(), batch.size())) == 3, SL);
+			utki::assert(throwing_copy::num_alive == 7, SL);
+
+			std::array<throwing_copy, 4> out = {throwing_copy(0), throwing_copy(0), throwing_copy(0), throwing_copy(0)};
+			utki::assert(c.receive(out) == 4, SL);
+			for(size_t i = 0; i != out.size(); ++i){
+				utki::assert(out[i].value == int(i + 1), SL);
+			}
+		}
+		utki::assert(throwing_copy::num_alive == 0, SL);
+	}
+
+	// several producers, loop_thread consumer
+	{
+		constexpr size_t num_producers = 4;
+		constexpr size_t num_per_producer = 10000;
+
+		nitki::channel<int> c(64);
+
+		consumer_thread consumer(c, num_producers * num_per_producer);
+		consumer.start();
+
+		std::vector<std::thread> producers;
+		for(size_t i = 0; i != num_producers; ++i){
+			producers.emplace_back([&c, i](){
+				opros::wait_set ws(1);
+				ws.add(c.get_write_waitable(), opros::ready::write, &c);
+
+				std::array<int, 8> buf;
+				for(size_t j = 0; j != num_per_producer;){
+					size_t num = std::min(buf.size(), num_per_producer - j);
+					for(size_t k = 0; k != num; ++k){
+						buf[k] = int(i * num_per_producer + j + k);
+					}
+					auto span = utki::span<const int>(buf.data(), num);
+					while(!span.empty()){
+						ws.wait();
+						span = span.subspan(c.send(span));
+					}
+					j += num;
+				}
+
+				ws.remove(c.get_write_waitable());
+			});
+		}
+
+		for(auto& t : producers){
+			t.join();
+		}
+
+		consumer.done.wait();
+		consumer.quit();
+		consumer.join();
+
+		// every element is received once and elements of each producer are in order
+		utki::assert(consumer.received.size() == num_producers * num_per_producer, SL);
+		std::vector<int> last(num_producers, -1);
+		for(auto v : consumer.received){
+			auto& l = last[size_t(v) / num_per_producer];
+			utki::assert(l < v, SL);
+			l = v;
+		}
+		for(size_t i = 0; i != num_producers; ++i){
+			utki::assert(last[i] == int((i + 1) * num_per_producer - 1), SL);
+		}
+	}
+}
+
+}
+
+
+
+namespace test_spsc_ring{
+
+// loop thread consuming the ring from its wait_set
+class consumer_thread : public nitki::loop_thread{
+	nitki::spsc_ring<uint32_t>& ring;
+public:
+	uint32_t next_expected = 0;
+	uint32_t num_expected;
+	bool error = false;
+	nitki::semaphore done;
+
+	consumer_thread(nitki::spsc_ring<uint32_t>& ring, uint32_t num_expected) :
+			loop_thread(1),
+			ring(ring),
+			num_expected(num_expected)
+	{
+		this->wait_set.add(this->ring, opros::ready::read, &this->ring);
+	}
+
+	~consumer_thread()override{
+		this->wait_set.remove(this->ring);
+	}
+
+	std::optional<uint32_t> on_loop()override{
+		while(true){
+			auto elems = this->ring.peek();
+			if(elems.empty()){
+				break;
+			}
+			for(auto v : elems){
+				if(v != this->next_expected){
+					this->error = true;
+				}
+				++this->next_expected;
+			}
+			this->ring.release(elems.size());
+		}
+
+		if(this->next_expected == this->num_expected){
+			this->done.signal();
+		}
+
+		// do not wait if elements were pushed while the consumer was processing
+		if(!this->ring.prepare_to_park()){
+			return 0;
+		}
+		return {};
+	}
+};
+
+void run(){
+	// capacity
+	{
+		utki::assert(nitki::spsc_ring<int>(5).capacity() == 8, SL);
+		utki::assert(nitki::spsc_ring<int>(1).capacity() == 1, SL);
+
+		bool thrown = false;
+		try{
+			nitki::spsc_ring<int> r(0);
+		}catch(std::invalid_argument&){
+			thrown = true;
+		}
+		utki::assert(thrown, SL);
+	}
+
+	// in place writing and reading, wrapping around
+	{
+		nitki::spsc_ring<std::string> r(4);
+
+		auto slots = r.reserve(3);
+		utki::assert(slots.size() == 3, SL);
+		slots[0] = "a";
+		slots[1] = "b";
+		r.commit(2);
+
+		auto elems = r.peek();
+		utki::assert(elems.size() == 2, SL);
+		utki::assert(elems[0] == "a", SL);
+		r.release(1);
+
+		// contiguous span ends at the end of the ring buffer
+		slots = r.reserve(4);
+		utki::assert(slots.size() == 2, SL);
+		slots[0] = "c";
+		slots[1] = "d";
+		r.commit(2);
+
+		slots = r.reserve(4);
+		utki::assert(slots.size() == 1, SL);
+		slots[0] = "e";
+		r.commit(1);
+
+		utki::assert(r.reserve().empty(), SL);
+		utki::assert(!r.try_push("f"), SL);
+
+		elems = r.peek();
+		utki::assert(elems.size() == 3, SL);
+		utki::assert(elems[0] == "b", SL);
+		utki::assert(elems[2] == "d", SL);
+		r.release(3);
+
+		auto v = r.try_pop();
+		utki::assert(v && *v == "e", SL);
+		utki::assert(!r.try_pop(), SL);
+		utki::assert(r.peek().empty(), SL);
+	}
+
+	// doorbell is only rung when the consumer is parked
+	{
+		nitki::spsc_ring<int> r(16);
+
+		opros::wait_set ws(1);
+		ws.add(r, opros::ready::read, &r);
+
+		utki::assert(r.try_push(1), SL);
+		utki::assert(!ws.wait(0), SL);
+
+		// there are elements, consumer shall not park
+		utki::assert(!r.prepare_to_park(), SL);
+		utki::assert(r.try_pop().value() == 1, SL);
+
+		utki::assert(r.prepare_to_park(), SL);
+		utki::assert(!ws.wait(0), SL);
+		utki::assert(r.try_push(2), SL);
+		utki::assert(ws.wait(0), SL);
+
+		// consumer is not parked after the doorbell is rung
+		utki::assert(r.try_push(3), SL);
+		utki::assert(!r.prepare_to_park(), SL);
+		utki::assert(r.try_pop().value() == 2, SL);
+		utki::assert(r.try_pop().value() == 3, SL);
+
+		// parking clears the doorbell
+		utki::assert(r.prepare_to_park(), SL);
+		utki::assert(!ws.wait(0), SL);
+
+		ws.remove(r);
+	}
+
+	// producer thread, loop_thread consumer
+	{
+		constexpr uint32_t num_elements = 200000;
+
+		nitki::spsc_ring<uint32_t> r(256);
+
+		consumer_thread consumer(r, num_elements);
+		consumer.start();
+
+		std::thread producer([&r](){
+			for(uint32_t i = 0; i != num_elements;){
+				auto slots = r.reserve(std::min(uint32_t(16), num_elements - i));
+				if(slots.empty()){
+					std::this_thread::yield();
+					continue;
+				}
+				for(auto& s : slots){
+					s = i;
+					++i;
+				}
+				r.commit(slots.size());
+			}
+		});
+
+		producer.join();
+
+		consumer.done.wait();
+		consumer.quit();
+		consumer.join();
+
+		utki::assert(!consumer.error, SL);
+		utki::assert(consumer.next_expected == num_elements, SL);
+	}
+}
+
+}
+
+
+
+namespace test_busy_polling{
+
+class test_thread : public nitki::loop_thread{
+public:
+	test_thread(const nitki::queue::parameters& params) :
+			loop_thread(0, params)
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		return {};
+	}
+};
+
+void run(){
+	// loop thread picks up procedures while spinning
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		test_thread t({kind});
+		utki::assert(t.get_spin_budget() == std::chrono::nanoseconds(0), SL);
+		t.set_spin_budget(std::chrono::seconds(1));
+		utki::assert(t.get_spin_budget() == std::chrono::seconds(1), SL);
+		t.start();
+
+		constexpr size_t num_procs = 100;
+		std::atomic_size_t num_run = 0;
+		for(size_t i = 0; i != num_procs; ++i){
+			t.push_back([&num_run](){++num_run;});
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+
+		while(num_run.load() != num_procs){
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		auto p = t.get_profile();
+		utki::assert(p.num_spin_hits > 0, SL);
+
+		// spinning thread quits without waiting out the spin budget
+		auto start = std::chrono::steady_clock::now();
+		t.quit();
+		t.join();
+		utki::assert(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500), SL);
+	}
+
+	// thread falls back to blocking wait after the spin budget is exhausted
+	{
+		test_thread t({});
+		t.set_spin_budget(std::chrono::microseconds(100));
+		t.start();
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+		auto p = t.get_profile();
+		t.quit();
+		t.join();
+
+		utki::assert(p.num_parks > 0, SL);
+	}
+
+	// time spent spinning counts towards the on_loop() timeout
+	{
+		class timeout_thread : public nitki::loop_thread{
+		public:
+			std::vector<std::chrono::steady_clock::time_point> calls;
+			nitki::semaphore done;
+
+			timeout_thread() :
+					loop_thread(0)
+			{}
+
+			std::optional<uint32_t> on_loop()override{
+				this->calls.push_back(std::chrono::steady_clock::now());
+				if(this->calls.size() == 6){
+					this->done.signal();
+				}
+				return 50;
+			}
+		} t;
+		t.set_spin_budget(std::chrono::milliseconds(30));
+		t.start();
+
+		t.done.wait();
+		t.quit();
+		t.join();
+
+		auto average = (t.calls[5] - t.calls[1]) / 4;
+		utki::assert(average >= std::chrono::milliseconds(49), [&](auto&o){o << "average = " << std::chrono::duration_cast<std::chrono::microseconds>(average).count() << " us";}, SL);
+		utki::assert(average < std::chrono::milliseconds(70), [&](auto&o){o << "average = " << std::chrono::duration_cast<std::chrono::microseconds>(average).count() << " us";}, SL);
+	}
+}
+
+}
+
+
+
+namespace test_wakeup_suppression{
+
+// removes other waitable from the wait_set on its first trigger and pushes a procedure,
+// so that the thread does not block before the next on_loop()
+class removing_thread : public nitki::loop_thread{
+public:
+	nitki::queue other;
+	bool removed = false;
+	bool check_next = false;
+	bool stale_triggered = false;
+	nitki::semaphore done;
+
+	removing_thread() :
+			loop_thread(1)
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		bool other_triggered = false;
+		for(const auto& t : this->wait_set.get_triggered()){
+			if(t.object == &this->other){
+				other_triggered = true;
+			}
+		}
+
+		if(this->check_next){
+			this->check_next = false;
+			this->stale_triggered = other_triggered;
+			this->done.signal();
+		}else if(other_triggered && !this->removed){
+			while(auto p = this->other.pop_front()){
+				p();
+			}
+			this->wait_set.remove(this->other);
+			this->removed = true;
+			this->push_back([this](){this->check_next = true;});
+		}
+		return {};
+	}
+};
+
+void run(){
+	// producers do not signal the queue's waitable while the consumer is awake
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		nitki::queue q({kind});
+
+		opros::wait_set ws(1);
+		ws.add(q, opros::ready::read, &q);
+
+		q.announce_awake();
+		utki::assert(!q.has_procedures_hint(), SL);
+		q.push_back([](){});
+		utki::assert(q.has_procedures_hint(), SL);
+		utki::assert(!ws.wait(0), SL);
+
+		// popping does not reset the ready state while the consumer is awake
+		utki::assert(bool(q.pop_front()), SL);
+		q.push_back([](){});
+		utki::assert(!ws.wait(0), SL);
+
+		// consumer shall not block while there are procedures
+		utki::assert(!q.announce_blocking(), SL);
+		utki::assert(!ws.wait(0), SL);
+		utki::assert(bool(q.pop_front()), SL);
+		utki::assert(!bool(q.pop_front()), SL);
+		utki::assert(q.announce_blocking(), SL);
+		utki::assert(!ws.wait(0), SL);
+
+		// producers signal the waitable after the consumer has announced blocking
+		q.push_back([](){});
+		utki::assert(ws.wait(0), SL);
+
+		// the waitable signalled before the consumer woke up is reset
+		q.announce_awake();
+		utki::assert(!ws.wait(0), SL);
+		utki::assert(bool(q.pop_front()), SL);
+		utki::assert(q.announce_blocking(), SL);
+		utki::assert(!ws.wait(0), SL);
+
+		// poke is not lost while the consumer is awake
+		q.announce_awake();
+		q.poke();
+		utki::assert(!ws.wait(0), SL);
+		utki::assert(!q.announce_blocking(), SL);
+		utki::assert(q.announce_blocking(), SL);
+		utki::assert(!ws.wait(0), SL);
+
+		ws.remove(q);
+	}
+
+	// on_loop() does not see the waitables triggered before the previous on_loop() call
+	// when the thread does not block because of the procedures pushed while it was awake
+	for(auto budget : {std::chrono::nanoseconds(0), std::chrono::nanoseconds(std::chrono::milliseconds(1))}){
+		removing_thread t;
+		t.set_spin_budget(budget);
+		t.start();
+
+		nitki::semaphore sema;
+		t.push_back([&t, &sema](){
+			t.wait_set.add(t.other, opros::ready::read, &t.other);
+			sema.signal();
+		});
+		sema.wait();
+
+		t.other.push_back([](){});
+
+		t.done.wait();
+		t.quit();
+		t.join();
+
+		utki::assert(!t.stale_triggered, SL);
+	}
+}
+}
+
+
+
+namespace test_slab_pool{
+
+template <size_t size>
+struct payload{
+	std::array<uint8_t, size> data{};
+};
+
+constexpr size_t cross_thread_block_size = 64;
+
+class pooled_loop_thread : public nitki::loop_thread{
+public:
+	pooled_loop_thread(std::shared_ptr<nitki::slab_pool> pool) :
+			loop_thread(0, {nitki::queue::kind::lock_free, std::nullopt, nitki::queue::default_starvation_limit, false, std::move(pool)})
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		return {};
+	}
+};
+
+void run(){
+	// invalid parameters
+	{
+		bool thrown = false;
+		try{
+			nitki::slab_pool p({nitki::slab_pool::max_block_size - 1});
+		}catch(std::invalid_argument&){
+			thrown = true;
+		}
+		utki::assert(thrown, SL);
+
+		thrown = false;
+		try{
+			nitki::slab_pool p({4096, 4095});
+		}catch(std::invalid_argument&){
+			thrown = true;
+		}
+		utki::assert(thrown, SL);
+	}
+
+	// freed blocks are reused and the footprint is bounded
+	{
+		nitki::slab_pool p({4096, 8192});
+
+		void* b = p.allocate(100);
+		utki::assert(b, SL);
+		p.deallocate(b, 100);
+		utki::assert(p.allocate(100) == b, SL);
+		p.deallocate(b, 100);
+
+		std::vector<void*> blocks;
+		while(void* block = p.allocate(nitki::slab_pool::max_block_size)){
+			blocks.push_back(block);
+		}
+		utki::assert(blocks.size() == 4096 / nitki::slab_pool::max_block_size, [&](auto&o){o << "blocks.size() = " << blocks.size();}, SL);
+
+		// one slab is taken by the 128 byte blocks and the other one by the 1024 byte blocks
+		auto s = p.get_stats();
+		utki::assert(s.num_slabs == 2, SL);
+		utki::assert(s.footprint == 8192, SL);
+		utki::assert(s.max_footprint == 8192, SL);
+		utki::assert(s.num_blocks_in_use == blocks.size(), SL);
+		utki::assert(s.bytes_in_use == blocks.size() * nitki::slab_pool::max_block_size, SL);
+		utki::assert(s.num_fallbacks == 1, SL);
+
+		utki::assert(!p.allocate(nitki::slab_pool::max_block_size + 1), SL);
+
+		for(auto block : blocks){
+			p.deallocate(block, nitki::slab_pool::max_block_size);
+		}
+		utki::assert(p.get_stats().num_blocks_in_use == 0, SL);
+		utki::assert(p.get_stats().num_fallbacks == 2, SL);
+	}
+
+	// procedure allocated from pool
+	{
+		nitki::slab_pool p;
+
+		int a = 0;
+		{
+			nitki::procedure proc([&a, pl = payload<64>()](){a += 1 + pl.data[0];}, p);
+			utki::assert(p.get_stats().num_blocks_in_use == 1, SL);
+
+			auto moved = std::move(proc);
+			moved();
+			utki::assert(a == 1, SL);
+		}
+		utki::assert(p.get_stats().num_blocks_in_use == 0, SL);
+
+		// inline callable does not use the pool
+		{
+			nitki::procedure proc([&a](){++a;}, p);
+			utki::assert(p.get_stats().num_allocations == 1, SL);
+		}
+
+		// too big callable falls back to the heap
+		{
+			nitki::procedure proc([&a, pl = payload<2048>()](){a += 1 + pl.data[0];}, p);
+			proc();
+			utki::assert(a == 2, SL);
+			utki::assert(p.get_stats().num_blocks_in_use == 0, SL);
+		}
+
+		// empty std::function gives empty procedure
+		utki::assert(!nitki::procedure(std::function<void()>(), p), SL);
+	}
+
+	// queues with memory pool
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		auto p = std::make_shared<nitki::slab_pool>();
+
+		nitki::queue q({kind, std::nullopt, nitki::queue::default_starvation_limit, false, p});
+		utki::assert(q.get_pool() == p, SL);
+
+		constexpr size_t num_procs = 1000;
+
+		size_t footprint = 0;
+
+		for(unsigned round = 0; round != 3; ++round){
+			size_t sum = 0;
+			for(size_t i = 0; i != num_procs; ++i){
+				q.push_back([&sum, pl = payload<64>()](){sum += 1 + pl.data[0];});
+			}
+
+			auto s = p->get_stats();
+			size_t blocks_per_proc = kind == nitki::queue::kind::lock_free ? 2 : 1;
+			utki::assert(s.num_blocks_in_use == num_procs * blocks_per_proc, [&](auto&o){o << "num_blocks_in_use = " << s.num_blocks_in_use;}, SL);
+			utki::assert(s.num_fallbacks == 0, SL);
+
+			// the memory freed by the previous round is reused
+			if(round == 0){
+				footprint = s.footprint;
+			}else{
+				utki::assert(s.footprint == footprint, SL);
+			}
+
+			std::deque<nitki::procedure> procs;
+			q.pop_all(procs);
+			for(auto& proc : procs){
+				proc();
+			}
+			utki::assert(sum == num_procs, SL);
+
+			// nodes are returned to the pool when popped, procedures when destroyed
+			utki::assert(p->get_stats().num_blocks_in_use == num_procs, SL);
+			procs.clear();
+			utki::assert(p->get_stats().num_blocks_in_use == 0, SL);
+		}
+
+		// procedures remaining in the queue are returned to the pool on queue destruction
+		q.push_back([pl = payload<64>()](){});
+	}
+
+	// loop thread with memory pool
+	{
+		auto p = std::make_shared<nitki::slab_pool>();
+
+		pooled_loop_thread t(p);
+		t.start();
+
+		nitki::semaphore sema;
+		t.push_back([&sema, pl = payload<64>()](){sema.signal();});
+		sema.wait();
+
+		t.quit();
+		t.join();
+
+		utki::assert(p->get_stats().num_allocations == 2, SL);
+	}
+
+	// blocks deallocated by another thread are reused, magazines of exited threads are returned to the pool
+	{
+		nitki::slab_pool p;
+
+		constexpr size_t num_rounds = 100;
+		constexpr size_t num_blocks = 1000;
+
+		nitki::queue to_free;
+		nitki::semaphore freed;
+		std::atomic_bool done = false;
+
+		std::thread consumer([&](){
+			opros::wait_set ws(1);
+			ws.add(to_free, opros::ready::read, nullptr);
+			while(!done.load()){
+				ws.wait();
+				while(auto proc = to_free.pop_front()){
+					proc();
+				}
+			}
+			ws.remove(to_free);
+		});
+
+		std::thread producer([&](){
+			for(size_t r = 0; r != num_rounds; ++r){
+				auto blocks = std::make_shared<std::vector<void*>>();
+				for(size_t i = 0; i != num_blocks; ++i){
+					blocks->push_back(p.allocate(cross_thread_block_size));
+				}
+				to_free.push_back([&p, &freed, blocks](){
+					for(auto b : *blocks){
+						if(b){
+							p.deallocate(b, cross_thread_block_size);
+						}
+					}
+					freed.signal();
+				});
+
+				// only one round of blocks is in flight
+				freed.wait();
+			}
+			to_free.push_back([&done](){done.store(true);});
+		});
+
+		producer.join();
+		consumer.join();
+
+		auto s = p.get_stats();
+		utki::assert(s.num_blocks_in_use == 0, [&](auto&o){o << "num_blocks_in_use = " << s.num_blocks_in_use;}, SL);
+		utki::assert(s.num_allocations == num_rounds * num_blocks, [&](auto&o){o << "num_allocations = " << s.num_allocations;}, SL);
+		utki::assert(s.num_fallbacks == 0, SL);
+		utki::assert(s.footprint <= 4 * nitki::slab_pool::default_slab_size, [&](auto&o){o << "footprint = " << s.footprint;}, SL);
+
+		// the blocks returned by the exited threads are reused
+		std::vector<void*> blocks;
+		for(size_t i = 0; i != num_blocks; ++i){
+			blocks.push_back(p.allocate(cross_thread_block_size));
+		}
+		utki::assert(p.get_stats().footprint == s.footprint, SL);
+		for(auto b : blocks){
+			p.deallocate(b, cross_thread_block_size);
+		}
+	}
+
+	// thread outlives the pool
+	{
+		auto p = std::make_unique<nitki::slab_pool>();
+
+		nitki::semaphore used;
+		nitki::semaphore destroyed;
+
+		std::thread t([&](){
+			p->deallocate(p->allocate(100), 100);
+			used.signal();
+			destroyed.wait();
+
+			// the thread's magazine of the destroyed pool is discarded
+			nitki::slab_pool p2;
+			p2.deallocate(p2.allocate(100), 100);
+		});
+
+		used.wait();
+		p.reset();
+		destroyed.signal();
+		t.join();
+	}
+}
+
+}
+
+
+
+namespace test_cancellation{
+
+class test_loop_thread : public nitki::loop_thread{
+public:
+	test_loop_thread(const nitki::queue::parameters& queue_params = {}) :
+			loop_thread(0, queue_params)
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		return {};
+	}
+};
+
+void run(){
+	// cancelled procedures are skipped and their captured state is released right away
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		nitki::queue q({kind, std::nullopt, nitki::queue::default_starvation_limit, true});
+
+		constexpr size_t num_procs = 10;
+
+		size_t num_run = 0;
+		std::vector<std::weak_ptr<int>> captures;
+		std::vector<nitki::cancellation_handle> handles;
+
+		for(size_t i = 0; i != num_procs; ++i){
+			auto c = std::make_shared<int>(int(i));
+			captures.push_back(c);
+			handles.push_back(q.push_cancellable([c, &num_run](){++num_run;}));
+		}
+
+		for(size_t i = 0; i != num_procs; i += 2){
+			utki::assert(handles[i].cancel(), SL);
+			utki::assert(handles[i].is_cancelled(), SL);
+			utki::assert(captures[i].expired(), SL);
+			utki::assert(!captures[i + 1].expired(), SL);
+
+			// second cancellation does nothing
+			utki::assert(!handles[i].cancel(), SL);
+		}
+
+		auto m = q.get_metrics();
+		utki::assert(q.size() == num_procs, SL);
+		utki::assert(m.depth == num_procs / 2, [&](auto&o){o << "m.depth = " << m.depth;}, SL);
+		utki::assert(m.num_cancelled == num_procs / 2, SL);
+
+		{
+			std::deque<nitki::procedure> procs;
+			q.pop_all(procs);
+			for(auto& p : procs){
+				p();
+			}
+		}
+		utki::assert(num_run == num_procs / 2, SL);
+
+		for(auto& c : captures){
+			utki::assert(c.expired(), SL);
+		}
+
+		// already run procedure cannot be cancelled
+		utki::assert(!handles[1].cancel(), SL);
+		utki::assert(!handles[1].is_cancelled(), SL);
+
+		m = q.get_metrics();
+		utki::assert(m.depth == 0, SL);
+		utki::assert(m.num_cancelled == num_procs / 2, SL);
+
+		// handle outlives the queue
+		nitki::cancellation_handle h;
+		{
+			nitki::queue q2;
+			h = q2.push_cancellable([](){});
+		}
+		utki::assert(!h.cancel(), SL);
+
+		// empty handle
+		utki::assert(!nitki::cancellation_handle(), SL);
+		utki::assert(!nitki::cancellation_handle().cancel(), SL);
+	}
+
+	// loop thread skips cancelled procedures and does not count them
+	{
+		nitki::queue::parameters queue_params;
+		queue_params.collect_metrics = true;
+		test_loop_thread t(queue_params);
+		t.start();
+
+		nitki::semaphore started;
+		nitki::semaphore release;
+		nitki::semaphore done;
+
+		bool cancelled_run = false;
+
+		t.push_back([&](){
+			started.signal();
+			release.wait();
+		});
+		started.wait();
+
+		auto h = t.push_cancellable([&](){cancelled_run = true;});
+		t.push_back([&](){done.signal();});
+
+		utki::assert(h.cancel(), SL);
+		release.signal();
+		done.wait();
+
+		utki::assert(!cancelled_run, SL);
+
+		t.quit();
+		t.join();
+
+		utki::assert(t.get_profile().num_procedures == 2, [&](auto&o){o << "num_procedures = " << t.get_profile().num_procedures;}, SL);
+
+		auto m = t.get_queue_metrics();
+		uint64_t num_latency_samples = 0;
+		for(auto n : m.latency_histogram){
+			num_latency_samples += n;
+		}
+		utki::assert(num_latency_samples == 2, [&](auto&o){o << "num_latency_samples = " << num_latency_samples;}, SL);
+	}
+}
+
+}
+
+
+
+namespace test_coalescing{
+
+void run(){
+	// coalesced procedures do not grow the queue
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		nitki::queue q({kind, std::nullopt, nitki::queue::default_starvation_limit, true});
+
+		int a = 0;
+		int b = 0;
+		std::vector<int> a_values;
+		std::vector<int> b_values;
+
+		for(int i = 0; i != 10; ++i){
+			bool pushed = q.push_coalesced(&a, [&a_values, i](){a_values.push_back(i);});
+			utki::assert(pushed == (i == 0), SL);
+
+			pushed = q.push_coalesced(&b, [&b_values, i](){b_values.push_back(i);}, nitki::queue::coalescing::keep);
+			utki::assert(pushed == (i == 0), SL);
+		}
+		q.push_back([](){});
+
+		utki::assert(q.size() == 3, [&](auto&o){o << "q.size() = " << q.size();}, SL);
+		utki::assert(q.get_metrics().num_coalesced == 18, SL);
+
+		// the procedure is run with the latest value, or the first one in case of 'keep' policy
+		while(auto p = q.pop_front()){
+			p();
+		}
+		utki::assert(a_values.size() == 1 && a_values.front() == 9, SL);
+		utki::assert(b_values.size() == 1 && b_values.front() == 0, SL);
+
+		// the procedure taken out of the queue is pending until it is run
+		utki::assert(q.push_coalesced(&a, [&a_values](){a_values.push_back(10);}), SL);
+		auto p = q.pop_front();
+		utki::assert(!q.push_coalesced(&a, [&a_values](){a_values.push_back(11);}), SL);
+		p();
+		utki::assert(q.push_coalesced(&a, [&a_values](){a_values.push_back(12);}), SL);
+		while(auto p = q.pop_front()){
+			p();
+		}
+		utki::assert(a_values.size() == 3 && a_values[1] == 11 && a_values[2] == 12, SL);
+
+		// pending procedures are destroyed with the queue
+		{
+			nitki::queue q2({kind});
+			auto c = std::make_shared<int>();
+			std::weak_ptr<int> wc = c;
+			q2.push_coalesced(&a, [c = std::move(c)](){});
+			utki::assert(!wc.expired(), SL);
+		}
+	}
+
+	// mailbox
+	{
+		nitki::mailbox<std::unique_ptr<int>> mb;
+
+		opros::wait_set ws(1);
+		ws.add(mb.get_waitable(), opros::ready::read, &mb);
+
+		utki::assert(mb.empty(), SL);
+		utki::assert(!mb.take().has_value(), SL);
+		utki::assert(!ws.wait(0), SL);
+
+		utki::assert(!mb.put(std::make_unique<int>(1)), SL);
+		utki::assert(ws.wait(0), SL);
+
+		utki::assert(mb.put(std::make_unique<int>(2)), SL);
+		utki::assert(mb.put(std::make_unique<int>(3)), SL);
+		utki::assert(ws.wait(0), SL);
+
+		auto v = mb.take();
+		utki::assert(v.has_value() && *v.value() == 3, SL);
+		utki::assert(mb.empty(), SL);
+		utki::assert(!ws.wait(0), SL);
+
+		ws.remove(mb.get_waitable());
+	}
+
+	// mailbox conflating values from another thread
+	{
+		nitki::mailbox<int> mb;
+
+		constexpr int num_values = 100000;
+
+		std::thread producer([&mb](){
+			for(int i = 1; i <= num_values; ++i){
+				mb.put(i);
+			}
+		});
+
+		opros::wait_set ws(1);
+		ws.add(mb.get_waitable(), opros::ready::read, &mb);
+
+		int last = 0;
+		while(last != num_values){
+			ws.wait();
+			if(auto v = mb.take()){
+				utki::assert(v.value() > last, SL);
+				last = v.value();
+			}
+		}
+
+		producer.join();
+		ws.remove(mb.get_waitable());
+	}
+}
+
+}
+
+
+
+namespace test_thread_cache{
+
+class id_thread : public nitki::thread{
+public:
+	std::thread::id id;
+
+	void run()override{
+		this->id = std::this_thread::get_id();
+	}
+};
+
+class blocking_thread : public nitki::thread{
+public:
+	nitki::semaphore& started;
+	nitki::semaphore& release;
+
+	blocking_thread(nitki::semaphore& started, nitki::semaphore& release) :
+			started(started),
+			release(release)
+	{}
+
+	void run()override{
+		this->started.signal();
+		this->release.wait();
+	}
+};
+
+// the OS thread goes back to the cache after the nitki::thread is joined, so wait for it
+bool wait_for_size(nitki::thread_cache& cache, size_t size){
+	for(unsigned i = 0; i != 1000; ++i){
+		if(cache.size() == size){
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return false;
+}
+
+void run(){
+	// warm-up and reuse of the OS threads
+	{
+		nitki::thread_cache cache({2, std::chrono::seconds(10), 3});
+		utki::assert(cache.size() == 2, SL);
+
+		std::set<std::thread::id> ids;
+		for(unsigned i = 0; i != 100; ++i){
+			id_thread t;
+			t.start(cache);
+			t.join();
+			utki::assert(t.id != std::this_thread::get_id(), SL);
+			ids.insert(t.id);
+		}
+		utki::assert(ids.size() <= 2, [&](auto&o){o << "ids.size() = " << ids.size();}, SL);
+		utki::assert(wait_for_size(cache, 2), SL);
+	}
+
+	// more threads than the cache size
+	{
+		nitki::thread_cache cache({2});
+		utki::assert(cache.size() == 0, SL);
+
+		nitki::semaphore started;
+		nitki::semaphore release;
+
+		std::vector<std::unique_ptr<blocking_thread>> threads;
+		for(unsigned i = 0; i != 4; ++i){
+			threads.push_back(std::make_unique<blocking_thread>(started, release));
+			threads.back()->start(cache);
+		}
+		for(unsigned i = 0; i != threads.size(); ++i){
+			started.wait();
+		}
+		utki::assert(cache.size() == 0, SL);
+
+		release.signal(unsigned(threads.size()));
+		for(auto& t : threads){
+			t->join();
+		}
+		utki::assert(wait_for_size(cache, 2), SL);
+
+		// the thread can be started again after joining
+		threads.front()->start(cache);
+		release.signal();
+		threads.front()->join();
+	}
+
+	// idle timeout
+	{
+		nitki::thread_cache cache({4, std::chrono::milliseconds(20), 4});
+		utki::assert(cache.size() == 4, SL);
+		utki::assert(wait_for_size(cache, 0), SL);
+
+		id_thread t;
+		t.start(cache);
+		t.join();
+		utki::assert(wait_for_size(cache, 0), SL);
+	}
+
+	// loop thread on the cache
+	{
+		nitki::thread_cache cache;
+
+		test_cancellation::test_loop_thread t;
+		t.start(cache);
+
+		nitki::semaphore sema;
+		t.push_back([&sema](){sema.signal();});
+		sema.wait();
+
+		t.quit();
+		t.join();
+	}
+
+	// the OS thread which ran a loop thread is not treated as the loop thread anymore when reused
+	{
+		nitki::thread_cache cache({1});
+
+		test_cancellation::test_loop_thread lt;
+		lt.start(cache);
+		lt.quit();
+		lt.join();
+		utki::assert(wait_for_size(cache, 1), SL);
+
+		class calling_thread : public nitki::thread{
+		public:
+			nitki::loop_thread& lt;
+			bool called_inline = true;
+
+			calling_thread(nitki::loop_thread& lt) :
+					lt(lt)
+			{}
+
+			void run()override{
+				// the loop thread is not running, so the call is only queued
+				auto f = this->lt.call([](){return 0;});
+				this->called_inline = f.is_ready();
+			}
+		} t(lt);
+		t.start(cache);
+		t.join();
+
+		utki::assert(!t.called_inline, SL);
+	}
+}
+
+}
+
+
+
+namespace test_lazy_waitable{
+
+class lazy_loop_thread : public nitki::loop_thread{
+public:
+	nitki::queue other;
+	size_t num_other_triggered = 0;
+
+	lazy_loop_thread() :
+			loop_thread(1, {nitki::queue::kind::spin_lock, std::nullopt, nitki::queue::default_starvation_limit, false, nullptr, true})
+	{}
+
+	std::optional<uint32_t> on_loop()override{
+		for(const auto& t : this->wait_set.get_triggered()){
+			if(t.object == &this->other){
+				while(auto p = this->other.pop_front()){
+					p();
+				}
+				++this->num_other_triggered;
+			}
+		}
+		return {};
+	}
+};
+
+void run(){
+	for(auto kind : {nitki::queue::kind::spin_lock, nitki::queue::kind::lock_free}){
+		nitki::queue::parameters params;
+		params.storage = kind;
+		params.lazy_waitable = true;
+
+		// waiting on the doorbell
+		{
+			nitki::queue q(params);
+
+			utki::assert(!q.wait_ready(0), SL);
+
+			q.push_back([](){});
+			utki::assert(q.wait_ready(0), SL);
+			// waiting does not reset the ready state
+			utki::assert(q.wait_ready(std::nullopt), SL);
+
+			utki::assert(bool(q.pop_front()), SL);
+			// lock-free queue resets the ready state when popping from empty queue
+			utki::assert(!q.pop_front(), SL);
+			utki::assert(!q.wait_ready(0), SL);
+
+			std::thread producer([&q](){
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				q.push_back([](){});
+			});
+			utki::assert(q.wait_ready(std::nullopt), SL);
+			producer.join();
+			utki::assert(bool(q.pop_front()), SL);
+		}
+
+		// the ready state is carried over to the kernel object created later
+		{
+			nitki::queue q(params);
+
+			q.push_back([](){});
+			q.prepare_waitable();
+
+			bool thrown = false;
+			try{
+				q.wait_ready(0);
+			}catch(std::logic_error&){
+				thrown = true;
+			}
+			utki::assert(thrown, SL);
+
+			opros::wait_set ws(1);
+			ws.add(q, opros::ready::read, &q);
+
+			utki::assert(ws.wait(0), SL);
+			utki::assert(bool(q.pop_front()), SL);
+			utki::assert(!q.pop_front(), SL);
+			utki::assert(!ws.wait(0), SL);
+
+			q.push_back([](){});
+			utki::assert(ws.wait(0), SL);
+
+			ws.remove(q);
+		}
+	}
+
+	// wait_ready() on non-lazy queue is not allowed
+	{
+		nitki::queue q;
+		bool thrown = false;
+		try{
+			q.wait_ready(0);
+		}catch(std::logic_error&){
+			thrown = true;
+		}
+		utki::assert(thrown, SL);
+	}
+
+	// loop thread with lazily waitable queue
+	{
+		// the semaphore outlives all the procedures signalling it
+		nitki::semaphore sema;
+
+		lazy_loop_thread t;
+		t.start();
+
+		for(unsigned i = 0; i != 100; ++i){
+			t.push_back([&sema](){sema.signal();});
+			sema.wait();
+		}
+
+		// add other waitable to the wait_set, the queue is added as well
+		t.push_back([&t, &sema](){
+			t.wait_set.add(t.other, opros::ready::read, &t.other);
+			sema.signal();
+		});
+		sema.wait();
+
+		for(unsigned i = 0; i != 100; ++i){
+			if(i % 2 == 0){
+				t.push_back([&sema](){sema.signal();});
+			}else{
+				t.other.push_back([&sema](){sema.signal();});
+			}
+			sema.wait();
+		}
+
+		t.push_back([&t, &sema](){
+			t.wait_set.remove(t.other);
+			sema.signal();
+		});
+		sema.wait();
+
+		t.quit();
+		t.join();
+
+		utki::assert(t.num_other_triggered >= 50, [&](auto&o){o << "num_other_triggered = " << t.num_other_triggered;}, SL);
+	}
+}
+
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+
 namespace test_join_before_and_after_thread_has_finished{
 void run();
 }//~namespace
@@ -21,3 +23,108 @@ void run();
 namespace test_nested_join{
 void run();
 }//~namespace
+
+namespace test_lock_free_queue{
+void run();
+}//~namespace
+
+namespace test_procedure{
+void run();
+}//~namespace
+
+namespace test_pop_all{
+void run();
+}//~namespace
+
+namespace test_bulk_push{
+void run();
+}//~namespace
+
+namespace test_bounded_queue{
+void run();
+}//~namespace
+
+namespace test_priorities{
+void run();
+}//~namespace
+
+namespace test_timers{
+void run();
+}//~namespace
+
+namespace test_thread_pool{
+void run();
+}//~namespace
+
+namespace test_future{
+void run();
+}//~namespace
+
+namespace test_coroutines{
+struct layout{
+	size_t size;
+	size_t alignment;
+	size_t derived_member_offset;
+};
+
+// layout of loop_thread as seen by code compiled without C++20 coroutines support
+layout get_layout_without_coroutines();
+
+void run();
+}//~namespace
+
+namespace test_thread_attributes{
+void run();
+}//~namespace
+
+namespace test_semaphore{
+void run();
+}//~namespace
+
+namespace test_waitable_semaphore{
+void run();
+}//~namespace
+
+namespace test_queue_metrics{
+void run();
+}//~namespace
+
+namespace test_loop_thread_profile{
+void run();
+}//~namespace
+
+namespace test_channel{
+void run();
+}//~namespace
+
+namespace test_spsc_ring{
+void run();
+}//~namespace
+
+namespace test_busy_polling{
+void run();
+}//~namespace
+
+namespace test_wakeup_suppression{
+void run();
+}//~namespace
+
+namespace test_slab_pool{
+void run();
+}//~namespace
+
+namespace test_cancellation{
+void run();
+}//~namespace
+
+namespace test_coalescing{
+void run();
+}//~namespace
+
+namespace test_thread_cache{
+void run();
+}//~namespace
+
+namespace test_lazy_waitable{
+void run();
+}//~namespace